@@ -0,0 +1,210 @@
+/*
+ *  Microbenchmark for the address index layouts in ext/atoslife/addrindex.c.
+ *
+ *  Usage: addr_index_bench [MACHO] [NKEYS]
+ *
+ *  Builds every layout over two key sets -- the function start addresses
+ *  from the symbol table of MACHO (samples/CrashDummy-iPhoneX by default),
+ *  and NKEYS (5M by default) synthetic, randomly spaced addresses -- checks
+ *  that all layouts agree with plain binary search, and reports the
+ *  average time per lookup for random queries.
+ *
+ *  Built and run by `rake bench:addr_index`.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "addrindex.h"
+
+#define NQUERIES (4 * 1000 * 1000)
+
+#define MH_MAGIC_64 0xfeedfacf
+#define LC_SYMTAB 0x2
+#define N_STAB 0xe0
+#define N_TYPE 0x0e
+#define N_SECT 0xe
+
+struct nlist_64_t {
+    uint32_t n_strx;
+    uint8_t n_type;
+    uint8_t n_sect;
+    uint16_t n_desc;
+    uint64_t n_value;
+} __attribute__((packed));
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_addrs(const void *a, const void *b)
+{
+    Dwarf_Addr addr_a = *(const Dwarf_Addr *)a;
+    Dwarf_Addr addr_b = *(const Dwarf_Addr *)b;
+    return addr_a < addr_b ? -1 : addr_a > addr_b;
+}
+
+/* Defined N_SECT symbols of a thin 64-bit Mach-O, sorted */
+static Dwarf_Addr *load_macho_keys(const char *path, uint32_t *count)
+{
+    struct stat st;
+    unsigned char *data;
+    uint32_t ncmds;
+    size_t off;
+    uint32_t i;
+    Dwarf_Addr *keys = NULL;
+    int fd = open(path, O_RDONLY);
+
+    *count = 0;
+    if (fd < 0 || fstat(fd, &st) < 0)
+        return NULL;
+
+    data = malloc(st.st_size);
+    if (!data || read(fd, data, st.st_size) != st.st_size ||
+        *(uint32_t *)data != MH_MAGIC_64) {
+        close(fd);
+        free(data);
+        return NULL;
+    }
+    close(fd);
+
+    ncmds = *(uint32_t *)(data + 16);
+    off = 32;
+    for (i = 0; i < ncmds; i++) {
+        uint32_t cmd = *(uint32_t *)(data + off);
+        uint32_t cmdsize = *(uint32_t *)(data + off + 4);
+
+        if (cmd == LC_SYMTAB) {
+            uint32_t symoff = *(uint32_t *)(data + off + 8);
+            uint32_t nsyms = *(uint32_t *)(data + off + 12);
+            struct nlist_64_t *syms = (struct nlist_64_t *)(data + symoff);
+            uint32_t j;
+
+            keys = malloc(sizeof(*keys) * (nsyms + 1));
+            for (j = 0; j < nsyms; j++) {
+                if (!(syms[j].n_type & N_STAB) && (syms[j].n_type & N_TYPE) == N_SECT)
+                    keys[(*count)++] = syms[j].n_value;
+            }
+        }
+        off += cmdsize;
+    }
+
+    free(data);
+    if (keys)
+        qsort(keys, *count, sizeof(*keys), compare_addrs);
+    return keys;
+}
+
+static Dwarf_Addr *synthetic_keys(uint32_t count)
+{
+    Dwarf_Addr *keys = malloc(sizeof(*keys) * count);
+    Dwarf_Addr addr = 0x100000000ULL;
+    uint32_t i;
+
+    /* Function sizes between 4 and 512 bytes, instruction aligned */
+    for (i = 0; i < count; i++) {
+        keys[i] = addr;
+        addr += 4 + (rng() % 128) * 4;
+    }
+    return keys;
+}
+
+static void bench(const char *label, const Dwarf_Addr *keys, uint32_t count)
+{
+    static const int layouts[] = {
+        ADDR_INDEX_SORTED, ADDR_INDEX_EYTZINGER, ADDR_INDEX_BTREE
+    };
+    struct addr_index_t sorted;
+    Dwarf_Addr *queries;
+    Dwarf_Addr span;
+    double base_ns = 0;
+    size_t i;
+
+    if (count == 0) {
+        printf("%s: no keys\n", label);
+        return;
+    }
+
+    queries = malloc(sizeof(*queries) * NQUERIES);
+    span = keys[count - 1] - keys[0] + 1024;
+    for (i = 0; i < NQUERIES; i++)
+        queries[i] = keys[0] - 512 + rng() % span;
+
+    printf("%s: %u keys, %d random queries\n", label, count, NQUERIES);
+
+    addr_index_build_layout(&sorted, keys, count, ADDR_INDEX_SORTED);
+
+    for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+        struct addr_index_t index;
+        uint64_t checksum = 0;
+        double start, elapsed_ns;
+        size_t q;
+
+        addr_index_build_layout(&index, keys, count, layouts[i]);
+
+        for (q = 0; q < NQUERIES / 16; q++) {
+            if (addr_index_rank(&index, queries[q]) != addr_index_rank(&sorted, queries[q])) {
+                fprintf(stderr, "%s disagrees with binary search at 0x%llx\n",
+                        addr_index_layout_name(layouts[i]), (unsigned long long)queries[q]);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        start = now();
+        for (q = 0; q < NQUERIES; q++)
+            checksum += addr_index_rank(&index, queries[q]);
+        elapsed_ns = (now() - start) * 1e9 / NQUERIES;
+        if (layouts[i] == ADDR_INDEX_SORTED)
+            base_ns = elapsed_ns;
+
+        printf("  %-14s %7.1f ns/lookup  %5.2fx  (checksum %llx)\n",
+               addr_index_layout_name(index.layout), elapsed_ns,
+               base_ns / elapsed_ns, (unsigned long long)checksum);
+
+        addr_index_free(&index);
+    }
+
+    addr_index_free(&sorted);
+    free(queries);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *macho = argc > 1 ? argv[1] : "samples/CrashDummy-iPhoneX";
+    uint32_t nsynthetic = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 5 * 1000 * 1000;
+    uint32_t count;
+    Dwarf_Addr *keys;
+
+    keys = load_macho_keys(macho, &count);
+    if (keys)
+        bench(macho, keys, count);
+    else
+        fprintf(stderr, "unable to read symbols from %s, skipping\n", macho);
+    free(keys);
+
+    keys = synthetic_keys(nsynthetic);
+    bench("synthetic", keys, nsynthetic);
+    free(keys);
+
+    return 0;
+}
@@ -0,0 +1,43 @@
+#
+#  Throughput of Atoslife::Image#symbolicate with 1, 2, 4, 8 and 16 threads.
+#
+#  Usage: ruby -Ilib bench/symbolicate_bench.rb [MACHO] [NADDRESSES]
+#
+#  Resolves NADDRESSES (1M by default) random addresses from the first
+#  TEXT_SIZE bytes (48KB by default, the __TEXT of the sample) after
+#  LOAD_ADDRESS against MACHO (samples/CrashDummy-iPhoneX by default, as
+#  ARCH arm64), checks that every thread count gives the same results as a
+#  single thread, and reports addresses per second.
+#
+#  Run by `rake bench:symbolicate`.
+#
+
+require 'atoslife'
+
+macho = ARGV[0] || 'samples/CrashDummy-iPhoneX'
+count = (ARGV[1] || 1_000_000).to_i
+arch = ENV['ARCH'] || 'arm64'
+load_address = Integer(ENV['LOAD_ADDRESS'] || '0x100a34000')
+text_size = Integer(ENV['TEXT_SIZE'] || '0xc000')
+
+random = Random.new(1)
+addresses = Array.new(count) { format('0x%x', load_address + random.rand(text_size) / 4 * 4) }
+
+image = Atoslife::Image.new(macho, arch: arch)
+# Warm the line cache so every run does the same work
+expected = image.symbolicate(addresses, load_address: load_address)
+
+puts "#{macho}: #{count} addresses"
+base = nil
+[1, 2, 4, 8, 16].each do |threads|
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  results = image.symbolicate(addresses, load_address: load_address, threads: threads)
+  elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+
+  abort "#{threads} threads disagree with one" unless results == expected
+
+  rate = count / elapsed
+  base ||= rate
+  printf("  %2d threads %12.0f addresses/s  %5.2fx\n", threads, rate, rate / base)
+end
+image.close
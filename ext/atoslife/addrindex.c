@@ -0,0 +1,284 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "addrindex.h"
+#include "common.h"
+
+#define B ADDR_INDEX_BTREE_KEYS
+
+static void *aligned_alloc_or_die(size_t size)
+{
+    void *ptr = NULL;
+
+    if (posix_memalign(&ptr, 64, size ? size : 64) != 0)
+        fatal("unable to allocate memory");
+    return ptr;
+}
+
+const char *addr_index_layout_name(int layout)
+{
+    switch (layout) {
+        case ADDR_INDEX_EYTZINGER:
+            return "eytzinger";
+        case ADDR_INDEX_BTREE:
+#if defined(__AVX2__)
+            return "btree/avx2";
+#elif defined(__SSE2__)
+            return "btree/sse2";
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+            return "btree/neon";
+#else
+            return "btree/scalar";
+#endif
+        default:
+            return "sorted";
+    }
+}
+
+/* Plain binary search */
+
+static uint32_t sorted_rank(const struct addr_index_t *index, Dwarf_Addr addr)
+{
+    uint32_t low = 0;
+    uint32_t high = index->count;
+
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (index->sorted[mid] <= addr)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/* Eytzinger layout: node k has children 2k and 2k+1. Eight 8-byte keys fit
+ * a cache line, so the line holding the node's great-great-grandchildren
+ * (8k..8k+7) is prefetched while the current level is compared. */
+
+static uint32_t eytzinger_fill(struct addr_index_t *index, uint32_t i, uint32_t k)
+{
+    if (k <= index->count) {
+        i = eytzinger_fill(index, i, 2 * k);
+        index->eytzinger[k] = index->sorted[i];
+        index->eytzinger_rank[k] = i;
+        i++;
+        i = eytzinger_fill(index, i, 2 * k + 1);
+    }
+    return i;
+}
+
+static void eytzinger_build(struct addr_index_t *index)
+{
+    index->eytzinger = aligned_alloc_or_die(sizeof(Dwarf_Addr) * (index->count + 1));
+    index->eytzinger_rank = malloc(sizeof(uint32_t) * (index->count + 1));
+    if (!index->eytzinger_rank)
+        fatal("unable to allocate memory");
+
+    eytzinger_fill(index, 0, 1);
+}
+
+static uint32_t eytzinger_rank(const struct addr_index_t *index, Dwarf_Addr addr)
+{
+    uint64_t k = 1;
+
+    while (k <= index->count) {
+        __builtin_prefetch(index->eytzinger + k * 8);
+        k = 2 * k + (index->eytzinger[k] <= addr);
+    }
+
+    /* Undo the right turns taken after the last left turn; that node is the
+     * first key greater than addr */
+    k >>= __builtin_ffsll(~k);
+
+    return k ? index->eytzinger_rank[k] : index->count;
+}
+
+/* Static B-tree: every node is B sorted 32-bit keys (one cache line) and
+ * has B+1 children at k*(B+1)+i+1. Keys are stored relative to the first
+ * key, which is fine for anything that fits in a 4GB span (every __TEXT we
+ * have seen); larger spans fall back to binary search. */
+
+static uint32_t btree_child(uint32_t k, uint32_t i)
+{
+    return k * (B + 1) + i + 1;
+}
+
+static uint32_t btree_fill(struct addr_index_t *index, uint32_t i, uint32_t k)
+{
+    uint32_t j;
+
+    if (k < index->nblocks) {
+        for (j = 0; j < B; j++) {
+            i = btree_fill(index, i, btree_child(k, j));
+            if (i < index->count) {
+                index->btree[k * B + j] = (uint32_t)(index->sorted[i] - index->base);
+                index->btree_rank[k * B + j] = i;
+                i++;
+            } else {
+                index->btree[k * B + j] = UINT32_MAX;
+                index->btree_rank[k * B + j] = index->count;
+            }
+        }
+        i = btree_fill(index, i, btree_child(k, B));
+    }
+    return i;
+}
+
+static int btree_build(struct addr_index_t *index)
+{
+    if (index->count == 0 ||
+        index->sorted[index->count - 1] - index->sorted[0] >= UINT32_MAX)
+        return -1;
+
+    index->base = index->sorted[0];
+    index->nblocks = (index->count + B - 1) / B;
+    index->btree = aligned_alloc_or_die(sizeof(uint32_t) * B * index->nblocks);
+    index->btree_rank = aligned_alloc_or_die(sizeof(uint32_t) * B * index->nblocks);
+
+    btree_fill(index, 0, 0);
+
+    return 0;
+}
+
+/* Number of keys in a node that are <= x */
+static inline uint32_t btree_node_rank(const uint32_t *node, uint32_t x)
+{
+#if defined(__AVX2__)
+    /* No unsigned compares; flip the sign bits and compare signed */
+    const __m256i sign = _mm256_set1_epi32((int)0x80000000);
+    __m256i xv = _mm256_xor_si256(_mm256_set1_epi32((int)x), sign);
+    __m256i a = _mm256_xor_si256(_mm256_load_si256((const __m256i *)node), sign);
+    __m256i b = _mm256_xor_si256(_mm256_load_si256((const __m256i *)(node + 8)), sign);
+    uint32_t gt = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, xv))) |
+                  ((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(b, xv))) << 8);
+    return B - __builtin_popcount(gt);
+#elif defined(__SSE2__)
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    __m128i xv = _mm_xor_si128(_mm_set1_epi32((int)x), sign);
+    __m128i c0 = _mm_cmpgt_epi32(_mm_xor_si128(_mm_load_si128((const __m128i *)node), sign), xv);
+    __m128i c1 = _mm_cmpgt_epi32(_mm_xor_si128(_mm_load_si128((const __m128i *)(node + 4)), sign), xv);
+    __m128i c2 = _mm_cmpgt_epi32(_mm_xor_si128(_mm_load_si128((const __m128i *)(node + 8)), sign), xv);
+    __m128i c3 = _mm_cmpgt_epi32(_mm_xor_si128(_mm_load_si128((const __m128i *)(node + 12)), sign), xv);
+    __m128i packed = _mm_packs_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+    return B - __builtin_popcount((uint32_t)_mm_movemask_epi8(packed));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    uint32x4_t xv = vdupq_n_u32(x);
+    /* Each lane is all ones (-1) when the key is <= x */
+    int32x4_t sum = vreinterpretq_s32_u32(vcleq_u32(vld1q_u32(node), xv));
+    sum = vaddq_s32(sum, vreinterpretq_s32_u32(vcleq_u32(vld1q_u32(node + 4), xv)));
+    sum = vaddq_s32(sum, vreinterpretq_s32_u32(vcleq_u32(vld1q_u32(node + 8), xv)));
+    sum = vaddq_s32(sum, vreinterpretq_s32_u32(vcleq_u32(vld1q_u32(node + 12), xv)));
+    return (uint32_t)-vaddvq_s32(sum);
+#else
+    uint32_t i;
+    uint32_t count = 0;
+
+    for (i = 0; i < B; i++)
+        count += node[i] <= x;
+    return count;
+#endif
+}
+
+static uint32_t btree_rank(const struct addr_index_t *index, Dwarf_Addr addr)
+{
+    uint32_t k = 0;
+    uint32_t rank = index->count;
+    uint32_t x;
+
+    if (addr < index->base)
+        return 0;
+    if (addr - index->base >= UINT32_MAX)
+        return index->count;
+    x = (uint32_t)(addr - index->base);
+
+    while (k < index->nblocks) {
+        uint32_t i = btree_node_rank(index->btree + k * B, x);
+        if (i < B)
+            rank = index->btree_rank[k * B + i];
+        k = btree_child(k, i);
+    }
+
+    return rank;
+}
+
+void addr_index_build_layout(struct addr_index_t *index, const Dwarf_Addr *sorted,
+                             uint32_t count, int layout)
+{
+    memset(index, 0, sizeof(*index));
+    index->sorted = sorted;
+    index->count = count;
+    index->layout = layout;
+
+    switch (layout) {
+        case ADDR_INDEX_EYTZINGER:
+            eytzinger_build(index);
+            break;
+        case ADDR_INDEX_BTREE:
+            if (btree_build(index) < 0)
+                index->layout = ADDR_INDEX_SORTED;
+            break;
+        default:
+            index->layout = ADDR_INDEX_SORTED;
+            break;
+    }
+}
+
+void addr_index_build(struct addr_index_t *index, const Dwarf_Addr *sorted, uint32_t count)
+{
+    addr_index_build_layout(index, sorted, count, ADDR_INDEX_LAYOUT);
+}
+
+uint32_t addr_index_rank(const struct addr_index_t *index, Dwarf_Addr addr)
+{
+    switch (index->layout) {
+        case ADDR_INDEX_EYTZINGER:
+            return eytzinger_rank(index, addr);
+        case ADDR_INDEX_BTREE:
+            return btree_rank(index, addr);
+        default:
+            return sorted_rank(index, addr);
+    }
+}
+
+void addr_index_free(struct addr_index_t *index)
+{
+    free(index->eytzinger);
+    free(index->eytzinger_rank);
+    free(index->btree);
+    free(index->btree_rank);
+    memset(index, 0, sizeof(*index));
+}
+
+size_t addr_index_memsize(const struct addr_index_t *index)
+{
+    switch (index->layout) {
+        case ADDR_INDEX_EYTZINGER:
+            return (sizeof(Dwarf_Addr) + sizeof(uint32_t)) * (index->count + 1);
+        case ADDR_INDEX_BTREE:
+            return 2 * sizeof(uint32_t) * B * index->nblocks;
+        default:
+            return 0;
+    }
+}
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -0,0 +1,78 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef ADDRINDEX_
+#define ADDRINDEX_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libdwarf.h>
+
+/* Search layouts for a sorted array of addresses. All of them answer the
+ * same question -- how many keys are <= addr -- which is what every
+ * "which range starts at or before this address" lookup needs.
+ *
+ *   ADDR_INDEX_SORTED     plain binary search over the sorted keys (default)
+ *   ADDR_INDEX_EYTZINGER  keys stored in BFS order with software prefetch
+ *   ADDR_INDEX_BTREE      static B-tree of 16 32-bit keys per 64 byte node,
+ *                         compared with SSE2/AVX2/NEON (or a scalar loop)
+ *
+ * The layout is chosen at build time, e.g.
+ * `gem install atoslife -- --with-address-index=btree`.
+ */
+#define ADDR_INDEX_SORTED    0
+#define ADDR_INDEX_EYTZINGER 1
+#define ADDR_INDEX_BTREE     2
+
+#ifndef ADDR_INDEX_LAYOUT
+#define ADDR_INDEX_LAYOUT ADDR_INDEX_SORTED
+#endif
+
+#define ADDR_INDEX_BTREE_KEYS 16
+
+struct addr_index_t {
+    /* The sorted keys, owned by whoever built the index */
+    const Dwarf_Addr *sorted;
+    uint32_t count;
+
+    int layout;
+
+    /* ADDR_INDEX_EYTZINGER: 1-based BFS order, rank[k] is the sorted
+     * position of keys[k] */
+    Dwarf_Addr *eytzinger;
+    uint32_t *eytzinger_rank;
+
+    /* ADDR_INDEX_BTREE: keys relative to base, padded with UINT32_MAX */
+    Dwarf_Addr base;
+    uint32_t nblocks;
+    uint32_t *btree;
+    uint32_t *btree_rank;
+};
+
+/* Build an index over count ascending keys. The keys are referenced, not
+ * copied, and must outlive the index. */
+void addr_index_build(struct addr_index_t *index, const Dwarf_Addr *sorted, uint32_t count);
+void addr_index_build_layout(struct addr_index_t *index, const Dwarf_Addr *sorted,
+                             uint32_t count, int layout);
+
+/* Number of keys <= addr */
+uint32_t addr_index_rank(const struct addr_index_t *index, Dwarf_Addr addr);
+
+void addr_index_free(struct addr_index_t *index);
+
+/* Bytes allocated by the index itself, not counting the sorted keys */
+size_t addr_index_memsize(const struct addr_index_t *index);
+
+const char *addr_index_layout_name(int layout);
+
+#endif /* ADDRINDEX_ */
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -0,0 +1,152 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <dwarf.h>
+#include <libdwarf.h>
+
+#include "aranges.h"
+#include "common.h"
+
+struct arange_entry_t {
+    Dwarf_Addr start;
+    Dwarf_Addr end;
+    Dwarf_Off cu_offset;
+};
+
+static int compare_aranges(const void *a, const void *b)
+{
+    const struct arange_entry_t *arange_a = a;
+    const struct arange_entry_t *arange_b = b;
+
+    if (arange_a->start != arange_b->start)
+        return arange_a->start < arange_b->start ? -1 : 1;
+    if (arange_a->end != arange_b->end)
+        return arange_a->end > arange_b->end ? -1 : 1;
+    return 0;
+}
+
+struct dwarf_aranges_t *aranges_load(Dwarf_Debug dbg)
+{
+    struct dwarf_aranges_t *aranges;
+    struct arange_entry_t *entries;
+    Dwarf_Arange *arange_buf = NULL;
+    Dwarf_Signed naranges = 0;
+    Dwarf_Signed i;
+    uint32_t count = 0;
+    int ret;
+    Dwarf_Error err;
+
+    /* Without aranges the lookups go by function instead */
+    ret = dwarf_get_aranges(dbg, &arange_buf, &naranges, &err);
+    if (ret == DW_DLV_ERROR) {
+        warning("dwarf_errmsg: %s", dwarf_errmsg(err));
+        dwarf_dealloc(dbg, err, DW_DLA_ERROR);
+    }
+    if (ret != DW_DLV_OK)
+        return NULL;
+
+    entries = malloc(sizeof(*entries) * (naranges + 1));
+    if (!entries)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < naranges; i++) {
+        Dwarf_Unsigned segment = 0;
+        Dwarf_Unsigned segment_entry_size = 0;
+        Dwarf_Addr start = 0;
+        Dwarf_Unsigned length = 0;
+        Dwarf_Off cu_die_offset = 0;
+
+        ret = dwarf_get_arange_info_b(arange_buf[i],
+                                      &segment,
+                                      &segment_entry_size,
+                                      &start,
+                                      &length,
+                                      &cu_die_offset,
+                                      &err);
+        if (ret == DW_DLV_ERROR) {
+            warning("dwarf_errmsg: %s", dwarf_errmsg(err));
+            dwarf_dealloc(dbg, err, DW_DLA_ERROR);
+            length = 0;
+        }
+
+        if (length > 0) {
+            entries[count].start = start;
+            entries[count].end = start + length;
+            entries[count].cu_offset = cu_die_offset;
+            count++;
+        }
+
+        dwarf_dealloc(dbg, arange_buf[i], DW_DLA_ARANGE);
+    }
+    dwarf_dealloc(dbg, arange_buf, DW_DLA_LIST);
+
+    qsort(entries, count, sizeof(*entries), compare_aranges);
+
+    aranges = malloc(sizeof(*aranges));
+    if (!aranges)
+        fatal("unable to allocate memory");
+    memset(aranges, 0, sizeof(*aranges));
+
+    aranges->count = count;
+    aranges->start = malloc(sizeof(Dwarf_Addr) * (count + 1));
+    aranges->end = malloc(sizeof(Dwarf_Addr) * (count + 1));
+    aranges->cu_offset = malloc(sizeof(Dwarf_Off) * (count + 1));
+    if (!aranges->start || !aranges->end || !aranges->cu_offset)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < count; i++) {
+        aranges->start[i] = entries[i].start;
+        aranges->end[i] = entries[i].end;
+        aranges->cu_offset[i] = entries[i].cu_offset;
+    }
+    free(entries);
+
+    addr_index_build(&aranges->index, aranges->start, aranges->count);
+
+    return aranges;
+}
+
+int32_t aranges_lookup(const struct dwarf_aranges_t *aranges, Dwarf_Addr addr)
+{
+    int32_t i;
+
+    /* Ranges from different CUs don't overlap, so the last range starting
+     * at or before addr is the only candidate, short of several ranges
+     * sharing its start */
+    i = (int32_t)addr_index_rank(&aranges->index, addr) - 1;
+    while (i >= 0) {
+        if (addr < aranges->end[i])
+            return i;
+        if (i == 0 || aranges->start[i - 1] != aranges->start[i])
+            break;
+        i--;
+    }
+
+    return -1;
+}
+
+void aranges_free(struct dwarf_aranges_t *aranges)
+{
+    if (!aranges)
+        return;
+
+    addr_index_free(&aranges->index);
+    free(aranges->start);
+    free(aranges->end);
+    free(aranges->cu_offset);
+    free(aranges);
+}
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -0,0 +1,31 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef ARANGES_
+#define ARANGES_
+
+#include <stdint.h>
+
+#include <libdwarf.h>
+
+#include "common.h"
+
+/* Read .debug_aranges into a sorted table. Returns NULL if the image has
+ * no aranges. */
+struct dwarf_aranges_t *aranges_load(Dwarf_Debug dbg);
+
+/* Index of the range containing addr, or -1 */
+int32_t aranges_lookup(const struct dwarf_aranges_t *aranges, Dwarf_Addr addr);
+
+void aranges_free(struct dwarf_aranges_t *aranges);
+
+#endif /* ARANGES_ */
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
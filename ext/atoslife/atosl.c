@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include "macho.h"
 #include <ruby.h>
+#include <ruby/thread.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <errno.h>
@@ -23,27 +24,31 @@
 #include <getopt.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <dwarf.h>
 #include <libdwarf.h>
 
 #include "atosl.h"
 #include "subprograms.h"
+#include "aranges.h"
+#include "linecache.h"
+#include "symtab.h"
+#include "cachedir.h"
+#include "registry.h"
+#include "prewarm.h"
 #include "common.h"
 
 #define ATOSL_VERSION "1.0"
 #define VERSION ATOSL_VERSION
 
-#define DWARF_ASSERT(ret, err) \
-    do { \
-        if (ret == DW_DLV_ERROR) { \
-            fatal("dwarf_errmsg: %s", dwarf_errmsg(err)); \
-        } \
-    } while (0);
-
 extern char *
 cplus_demangle (const char *mangled, int options);
-int symbolicate(const char* arch, const char *executable, const char *loadAddress, char *addresses[], int numofaddresses);
+int symbolicate(const char* arch, const char *executable, const char *loadAddress, char *addresses[], int numofaddresses,
+                char *result);
+static int arch_type(const char *arch, cpu_type_t *cpu_type, cpu_subtype_t *cpu_subtype);
 
 typedef unsigned long Dwarf_Word;
 
@@ -59,11 +64,13 @@ _dwarf_decode_u_leb128(Dwarf_Small * leb128,
 
 static int debug = 0;
 #define ATOSLIFE_SIZE 1024
-static char atoslifeResult[ATOSLIFE_SIZE];
-static int runCounter = 0;
+/* Room for the result of an address with inlined frames, each of which
+ * takes up to ATOSLIFE_SIZE bytes */
+#define ATOSLIFE_INLINE_FRAMES 8
 
-void logDebugInfo() {
-    printf("• DEBUG: [%d] [%s]\n", strlen(atoslifeResult), atoslifeResult);
+void logDebugInfo(const char *result) {
+    if (debug)
+        fprintf(stderr, "• DEBUG: [%zu] [%s]\n", strlen(result), result);
 }
 
 static const char *shortopts = "vl:o:A:gcC:VhD";
@@ -93,80 +100,40 @@ static struct {
     {"arm64",  CPU_TYPE_ARM64, CPU_SUBTYPE_ARM64_ALL}
 };
 
-struct symbol_t {
-    const char *name;
-    union {
-        struct nlist_t sym32;
-        struct nlist_64 sym64;
-    } sym;
-    Dwarf_Addr addr;
-    int thumb:1;
-};
-
 struct function_t {
     const char *name;
     Dwarf_Addr addr;
 };
 
-/* Various addresses, parsed from the cmdline or the mach-o sections */
-static struct {
-    Dwarf_Addr load_address;
-    int use_globals;
-    int use_cache;
-    const char *dsym_filename;
-    cpu_type_t cpu_type;
-    cpu_subtype_t cpu_subtype;
-    const char *cache_dir;
-    int should_demangle;
-} options = {
-    .load_address = LONG_MAX,
-    .use_globals = 0,
-    // .use_cache = 1,
-    .use_cache = 0,
-    .cpu_type = CPU_TYPE_ARM,
-    .cpu_subtype = CPU_SUBTYPE_ARM_V7S,
-    .should_demangle = 1,
-};
-
-typedef int dwarf_mach_handle;
 
-struct dwarf_section_t;
+/* A Mach-O section (32 or 64-bit) under the name libdwarf expects */
 struct dwarf_section_t {
-    struct section_t mach_section;
-    struct dwarf_section_t *next;
-};
-
-struct dwarf_section_64_t;
-struct dwarf_section_64_t {
-    struct section_64_t mach_section;
-    struct dwarf_section_64_t *next;
+    /* Long enough for ".debug_str_offsets" */
+    char name[24];
+    Dwarf_Addr addr;
+    Dwarf_Unsigned size;
+    uint32_t offset;
+    /* Section contents, when read into a buffer of their own */
+    void *data;
 };
 
-static struct {
-    /* Symbols from symtab */
-    struct symbol_t *symlist;
-    uint32_t nsymbols;
-    struct dwarf_subprogram_t *subprograms;
-
-    Dwarf_Addr intended_addr;
-    Dwarf_Addr linkedit_addr;
-
-    struct fat_arch_t arch;
-
-    uint8_t uuid[UUID_LEN];
-    uint8_t is_64;
-    uint8_t is_dwarf;
-} context;
-
 typedef struct {
     dwarf_mach_handle handle;
+    struct atosl_context_t *context;
     Dwarf_Small length_size;
     Dwarf_Small pointer_size;
     Dwarf_Endianness endianness;
 
     Dwarf_Unsigned section_count;
     struct dwarf_section_t *sections;
-    struct dwarf_section_64_t *sections_64;
+
+    /* The whole file, when it is mapped; sections then point into it */
+    void *map;
+    size_t map_size;
+
+    /* Sections are loaded by every Dwarf_Debug opened over the object,
+     * some of them on threads of their own (see read_from_cus()) */
+    pthread_mutex_t lock;
 } dwarf_mach_object_access_internals_t;
 
 void print_help(void)
@@ -195,9 +162,14 @@ void print_help(void)
     fprintf(stderr, "\n");
 }
 
-void dwarf_error_handler(Dwarf_Error err, Dwarf_Ptr ptr)
+/* basename() without modifying, or handing out, any buffer */
+static const char *path_basename(const char *path)
 {
-    fatal("dwarf error: %s", dwarf_errmsg(err));
+    const char *slash = strrchr(path, '/');
+
+    if (slash)
+        return slash + 1;
+    return *path ? path : ".";
 }
 
 char *demangle(const char *sym)
@@ -217,16 +189,18 @@ char *demangle(const char *sym)
 int parse_uuid(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize)
 {
     int i;
-    int ret;
+    ssize_t ret;
 
-    ret = _read(obj->handle, context.uuid, UUID_LEN);
-    if (ret < 0)
-        fatal_file(ret);
+    ret = _read(obj->handle, obj->context->uuid, UUID_LEN);
+    if (ret != UUID_LEN) {
+        warning_file(ret);
+        return -1;
+    }
 
     if (debug) {
         fprintf(stderr, "%10s ", "uuid");
         for (i = 0; i < UUID_LEN; i++) {
-            fprintf(stderr, "%.02x", context.uuid[i]);
+            fprintf(stderr, "%.02x", obj->context->uuid[i]);
         }
         fprintf(stderr, "\n");
     }
@@ -234,104 +208,157 @@ int parse_uuid(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize)
     return 0;
 }
 
-int parse_section(dwarf_mach_object_access_internals_t *obj)
+/* Mach-O section names are "__debug_info" rather than ".debug_info", and
+ * are cut off at 16 characters without a terminator */
+static const struct {
+    const char *sectname;
+    const char *name;
+} section_name_aliases[] = {
+    {"__debug_str_offs", ".debug_str_offsets"},
+};
+
+static void classify_section(struct dwarf_section_t *section, const char sectname[16])
 {
-    int ret;
-    struct dwarf_section_t *s;
+    char buf[17];
+    int i;
+
+    memcpy(buf, sectname, 16);
+    buf[16] = '\0';
 
-    s = malloc(sizeof(*s));
-    if (!s)
+    for (i = 0; i < NUMOF(section_name_aliases); i++) {
+        if (strcmp(buf, section_name_aliases[i].sectname) == 0) {
+            strcpy(section->name, section_name_aliases[i].name);
+            return;
+        }
+    }
+
+    if (buf[0] == '_' && buf[1] == '_')
+        snprintf(section->name, sizeof(section->name), ".%s", buf + 2);
+    else
+        snprintf(section->name, sizeof(section->name), "%s", buf);
+}
+
+/* Make room for the sections of a segment up front */
+static struct dwarf_section_t *add_sections(dwarf_mach_object_access_internals_t *obj,
+                                            uint32_t nsects)
+{
+    struct dwarf_section_t *sections;
+
+    sections = realloc(obj->sections, sizeof(*sections) * (obj->section_count + nsects + 1));
+    if (!sections)
         fatal("unable to allocate memory");
+    obj->sections = sections;
 
-    memset(s, 0, sizeof(*s));
+    sections += obj->section_count;
+    memset(sections, 0, sizeof(*sections) * nsects);
+    obj->section_count += nsects;
 
-    ret = _read(obj->handle, &s->mach_section, sizeof(s->mach_section));
-    if (ret < 0)
-        fatal_file(ret);
+    return sections;
+}
 
-    if (debug) {
-        fprintf(stderr, "Section\n");
-        fprintf(stderr, "%10s %s\n", "sectname", s->mach_section.sectname);
-        fprintf(stderr, "%10s %s\n", "segname", s->mach_section.segname);
-        fprintf(stderr, "%10s 0x%.08x\n", "addr", s->mach_section.addr);
-        fprintf(stderr, "%10s 0x%.08x\n", "size", s->mach_section.size);
-        fprintf(stderr, "%10s %d\n", "offset", s->mach_section.offset);
-        /* TODO: what is the second value here? */
-        fprintf(stderr, "%10s 2^%d (?)\n", "align", s->mach_section.align);
-        fprintf(stderr, "%10s %d\n", "reloff", s->mach_section.reloff);
-        fprintf(stderr, "%10s %d\n", "nreloc", s->mach_section.nreloc);
-        fprintf(stderr, "%10s 0x%.08x\n", "flags", s->mach_section.flags);
-        fprintf(stderr, "%10s %d\n", "reserved1", s->mach_section.reserved1);
-        fprintf(stderr, "%10s %d\n", "reserved2", s->mach_section.reserved2);
-    }
-
-    struct dwarf_section_t *sec = obj->sections;
-    if (!sec)
-        obj->sections = s;
-    else {
-        while (sec) {
-            if (sec->next == NULL) {
-                sec->next = s;
-                break;
-            } else {
-                sec = sec->next;
-            }
+int parse_sections(dwarf_mach_object_access_internals_t *obj, uint32_t nsects)
+{
+    ssize_t ret;
+    uint32_t i;
+    struct section_t *mach_sections;
+    struct dwarf_section_t *sections;
+
+    if (nsects == 0)
+        return 0;
+
+    mach_sections = malloc(sizeof(*mach_sections) * nsects);
+    if (!mach_sections)
+        fatal("unable to allocate memory");
+
+    ret = _read(obj->handle, mach_sections, sizeof(*mach_sections) * nsects);
+    if (ret != (ssize_t)(sizeof(*mach_sections) * nsects)) {
+        warning_file(ret);
+        free(mach_sections);
+        return -1;
+    }
+
+    sections = add_sections(obj, nsects);
+
+    for (i = 0; i < nsects; i++) {
+        struct section_t *s = &mach_sections[i];
+
+        if (debug) {
+            fprintf(stderr, "Section\n");
+            fprintf(stderr, "%10s %.16s\n", "sectname", s->sectname);
+            fprintf(stderr, "%10s %.16s\n", "segname", s->segname);
+            fprintf(stderr, "%10s 0x%.08x\n", "addr", s->addr);
+            fprintf(stderr, "%10s 0x%.08x\n", "size", s->size);
+            fprintf(stderr, "%10s %d\n", "offset", s->offset);
+            /* TODO: what is the second value here? */
+            fprintf(stderr, "%10s 2^%d (?)\n", "align", s->align);
+            fprintf(stderr, "%10s %d\n", "reloff", s->reloff);
+            fprintf(stderr, "%10s %d\n", "nreloc", s->nreloc);
+            fprintf(stderr, "%10s 0x%.08x\n", "flags", s->flags);
+            fprintf(stderr, "%10s %d\n", "reserved1", s->reserved1);
+            fprintf(stderr, "%10s %d\n", "reserved2", s->reserved2);
         }
+
+        classify_section(&sections[i], s->sectname);
+        sections[i].addr = s->addr;
+        sections[i].size = s->size;
+        sections[i].offset = s->offset;
     }
 
-    obj->section_count++;
+    free(mach_sections);
 
     return 0;
 }
 
-int parse_section_64(dwarf_mach_object_access_internals_t *obj)
+int parse_sections_64(dwarf_mach_object_access_internals_t *obj, uint32_t nsects)
 {
-    int ret;
-    struct dwarf_section_64_t *s;
+    ssize_t ret;
+    uint32_t i;
+    struct section_64_t *mach_sections;
+    struct dwarf_section_t *sections;
+
+    if (nsects == 0)
+        return 0;
 
-    s = malloc(sizeof(*s));
-    if (!s)
+    mach_sections = malloc(sizeof(*mach_sections) * nsects);
+    if (!mach_sections)
         fatal("unable to allocate memory");
 
-    memset(s, 0, sizeof(*s));
+    ret = _read(obj->handle, mach_sections, sizeof(*mach_sections) * nsects);
+    if (ret != (ssize_t)(sizeof(*mach_sections) * nsects)) {
+        warning_file(ret);
+        free(mach_sections);
+        return -1;
+    }
 
-    ret = _read(obj->handle, &s->mach_section, sizeof(s->mach_section));
-    if (ret < 0)
-        fatal_file(ret);
+    sections = add_sections(obj, nsects);
 
-    if (debug) {
-        fprintf(stderr, "Section\n");
-        fprintf(stderr, "%10s %s\n", "sectname", s->mach_section.sectname);
-        fprintf(stderr, "%10s %s\n", "segname", s->mach_section.segname);
-        fprintf(stderr, "%10s 0x%.8llx\n", "addr", (unsigned long long)s->mach_section.addr);
-        fprintf(stderr, "%10s 0x%.8llx\n", "size", (unsigned long long)s->mach_section.size);
-        fprintf(stderr, "%10s %d\n", "offset", s->mach_section.offset);
-        /* TODO: what is the second value here? */
-        fprintf(stderr, "%10s 2^%d (?)\n", "align", s->mach_section.align);
-        fprintf(stderr, "%10s %d\n", "reloff", s->mach_section.reloff);
-        fprintf(stderr, "%10s %d\n", "nreloc", s->mach_section.nreloc);
-        fprintf(stderr, "%10s 0x%.08x\n", "flags", s->mach_section.flags);
-        fprintf(stderr, "%10s %d\n", "reserved1", s->mach_section.reserved1);
-        fprintf(stderr, "%10s %d\n", "reserved2", s->mach_section.reserved2);
-        fprintf(stderr, "%10s %d\n", "reserved3", s->mach_section.reserved3);
-    }
-
-    struct dwarf_section_64_t *sec = obj->sections_64;
-    
-    if (!sec) {
-        obj->sections_64 = s;
-    } else {
-        while (sec) {
-            if (sec->next == NULL) {
-                sec->next = s;
-                break;
-            } else {
-                sec = sec->next;
-            }
+    for (i = 0; i < nsects; i++) {
+        struct section_64_t *s = &mach_sections[i];
+
+        if (debug) {
+            fprintf(stderr, "Section\n");
+            fprintf(stderr, "%10s %.16s\n", "sectname", s->sectname);
+            fprintf(stderr, "%10s %.16s\n", "segname", s->segname);
+            fprintf(stderr, "%10s 0x%.8llx\n", "addr", (unsigned long long)s->addr);
+            fprintf(stderr, "%10s 0x%.8llx\n", "size", (unsigned long long)s->size);
+            fprintf(stderr, "%10s %d\n", "offset", s->offset);
+            /* TODO: what is the second value here? */
+            fprintf(stderr, "%10s 2^%d (?)\n", "align", s->align);
+            fprintf(stderr, "%10s %d\n", "reloff", s->reloff);
+            fprintf(stderr, "%10s %d\n", "nreloc", s->nreloc);
+            fprintf(stderr, "%10s 0x%.08x\n", "flags", s->flags);
+            fprintf(stderr, "%10s %d\n", "reserved1", s->reserved1);
+            fprintf(stderr, "%10s %d\n", "reserved2", s->reserved2);
+            fprintf(stderr, "%10s %d\n", "reserved3", s->reserved3);
         }
+
+        classify_section(&sections[i], s->sectname);
+        sections[i].addr = s->addr;
+        sections[i].size = s->size;
+        sections[i].offset = s->offset;
     }
 
-    obj->section_count++;
+    free(mach_sections);
 
     return 0;
 }
@@ -339,13 +366,14 @@ int parse_section_64(dwarf_mach_object_access_internals_t *obj)
 int parse_segment(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize)
 {
     int err;
-    int ret;
+    ssize_t ret;
     struct segment_command_t segment;
-    int i;
 
     ret = _read(obj->handle, &segment, sizeof(segment));
-    if (ret < 0)
-        fatal_file(ret);
+    if (ret != (ssize_t)sizeof(segment)) {
+        warning_file(ret);
+        return -1;
+    }
 
     if (debug) {
         fprintf(stderr, "Segment: %s\n", segment.segname);
@@ -360,21 +388,21 @@ int parse_segment(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize)
     }
 
     if (strcmp(segment.segname, "__TEXT") == 0) {
-        context.intended_addr = segment.vmaddr;
+        obj->context->intended_addr = segment.vmaddr;
     }
 
     if (strcmp(segment.segname, "__LINKEDIT") == 0) {
-        context.linkedit_addr = segment.fileoff;
+        obj->context->linkedit_addr = segment.fileoff;
     }
 
     if (strcmp(segment.segname, "__DWARF") == 0) {
-        context.is_dwarf = 1;
+        obj->context->is_dwarf = 1;
     }
 
-    for (i = 0; i < segment.nsects; i++) {
-        err = parse_section(obj);
-        if (err)
-            fatal("unable to parse section in `%s`", segment.segname);
+    err = parse_sections(obj, segment.nsects);
+    if (err) {
+        warning("unable to parse sections in `%.16s'", segment.segname);
+        return -1;
     }
 
     return 0;
@@ -383,13 +411,14 @@ int parse_segment(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize)
 int parse_segment_64(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize)
 {
     int err;
-    int ret;
+    ssize_t ret;
     struct segment_command_64_t segment;
-    int i;
 
     ret = _read(obj->handle, &segment, sizeof(segment));
-    if (ret < 0)
-        fatal_file(ret);
+    if (ret != (ssize_t)sizeof(segment)) {
+        warning_file(ret);
+        return -1;
+    }
 
     if (debug) {
         fprintf(stderr, "Segment: %s\n", segment.segname);
@@ -404,21 +433,21 @@ int parse_segment_64(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize
     }
 
     if (strcmp(segment.segname, "__TEXT") == 0) {
-        context.intended_addr = segment.vmaddr;
+        obj->context->intended_addr = segment.vmaddr;
     }
 
     if (strcmp(segment.segname, "__LINKEDIT") == 0) {
-        context.linkedit_addr = segment.fileoff;
+        obj->context->linkedit_addr = segment.fileoff;
     }
 
     if (strcmp(segment.segname, "__DWARF") == 0) {
-        context.is_dwarf = 1;
+        obj->context->is_dwarf = 1;
     }
 
-    for (i = 0; i < segment.nsects; i++) {
-        err = parse_section_64(obj);
-        if (err)
-            fatal("unable to parse section in `%s`", segment.segname);
+    err = parse_sections_64(obj, segment.nsects);
+    if (err) {
+        warning("unable to parse sections in `%.16s'", segment.segname);
+        return -1;
     }
 
     return 0;
@@ -426,17 +455,20 @@ int parse_segment_64(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize
 
 int parse_symtab(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize)
 {
-    int ret;
-    off_t pos;
+    ssize_t ret;
     int i;
     char *strtable;
+    void *nlists;
+    size_t nlist_size;
 
     struct symtab_command_t symtab;
     struct symbol_t *current;
 
     ret = _read(obj->handle, &symtab, sizeof(symtab));
-    if (ret < 0)
-        fatal_file(ret);
+    if (ret != (ssize_t)sizeof(symtab)) {
+        warning_file(ret);
+        return -1;
+    }
 
     if (debug) {
         fprintf(stderr, "Symbol\n");
@@ -446,221 +478,127 @@ int parse_symtab(dwarf_mach_object_access_internals_t *obj, uint32_t cmdsize)
         fprintf(stderr, "%10s %d\n", "strsize", symtab.strsize);
     }
 
-    strtable = malloc(symtab.strsize);
+    /* One extra byte so that even a truncated last string is terminated */
+    strtable = malloc(symtab.strsize + 1);
     if (!strtable)
         fatal("unable to allocate memory");
+    strtable[symtab.strsize] = '\0';
+    obj->context->strtable = strtable;
+
+    /* Anything short would be read as garbage below */
+    ret = _pread(obj->handle, strtable, symtab.strsize,
+                 obj->context->arch.offset+symtab.stroff);
+    if (ret != (ssize_t)symtab.strsize) {
+        warning_file(ret);
+        return -1;
+    }
 
-    pos = lseek(obj->handle, 0, SEEK_CUR);
-    if (pos < 0)
-        fatal("error seeking: %s", strerror(errno));
-
-    ret = lseek(obj->handle, context.arch.offset+symtab.stroff, SEEK_SET);
-    if (ret < 0)
-        fatal("error seeking: %s", strerror(errno));
-
-    ret = _read(obj->handle, strtable, symtab.strsize);
-    if (ret < 0)
-        fatal_file(ret);
+    /* Read the whole nlist array at once and keep only what the lookups
+     * need from it */
+    nlist_size = obj->context->is_64 ? sizeof(struct nlist_64) : sizeof(struct nlist_t);
+    nlists = malloc(nlist_size * symtab.nsyms + 1);
+    if (!nlists)
+        fatal("unable to allocate memory");
 
-    ret = lseek(obj->handle, context.arch.offset+symtab.symoff, SEEK_SET);
-    if (ret < 0)
-        fatal("error seeking: %s", strerror(errno));
+    ret = _pread(obj->handle, nlists, nlist_size * symtab.nsyms,
+                 obj->context->arch.offset+symtab.symoff);
+    if (ret != (ssize_t)(nlist_size * symtab.nsyms)) {
+        warning_file(ret);
+        free(nlists);
+        return -1;
+    }
 
-    context.nsymbols = symtab.nsyms;
-    context.symlist = malloc(sizeof(struct symbol_t) * symtab.nsyms);
-    if (!context.symlist)
+    obj->context->nsymbols = symtab.nsyms;
+    obj->context->symlist = malloc(sizeof(struct symbol_t) * (symtab.nsyms + 1));
+    if (!obj->context->symlist)
         fatal("unable to allocate memory");
-    current = context.symlist;
+    current = obj->context->symlist;
 
     for (i = 0; i < symtab.nsyms; i++) {
-        ret = _read(obj->handle, context.is_64 ? (void*)&current->sym.sym64 : (void*)&current->sym.sym32, context.is_64 ? sizeof(current->sym.sym64) : sizeof(current->sym.sym32));
-        if (ret < 0)
-            fatal_file(ret);
-
-        if (context.is_64 ? current->sym.sym64.n_un.n_strx : current->sym.sym32.n_un.n_strx) {
-            if ((context.is_64 ? current->sym.sym64.n_un.n_strx : current->sym.sym32.n_un.n_strx) > symtab.strsize)
-                fatal("str offset (%d) greater than strsize (%d)",
-                      (context.is_64 ? current->sym.sym64.n_un.n_strx : current->sym.sym32.n_un.n_strx), symtab.strsize);
-            current->name = strtable+(context.is_64 ? current->sym.sym64.n_un.n_strx : current->sym.sym32.n_un.n_strx);
+        uint32_t strx;
+        uint16_t desc;
+
+        if (obj->context->is_64) {
+            const struct nlist_64 *nlist = (const struct nlist_64 *)nlists + i;
+            strx = nlist->n_un.n_strx;
+            desc = nlist->n_desc;
+            current->type = nlist->n_type;
+            current->addr = nlist->n_value;
+        } else {
+            const struct nlist_t *nlist = (const struct nlist_t *)nlists + i;
+            strx = nlist->n_un.n_strx;
+            desc = nlist->n_desc;
+            current->type = nlist->n_type;
+            current->addr = nlist->n_value;
         }
 
+        if (strx > symtab.strsize) {
+            warning("str offset (%u) greater than strsize (%u)", strx, symtab.strsize);
+            free(nlists);
+            return -1;
+        }
+        current->name = strx;
+        current->thumb = (desc & N_ARM_THUMB_DEF) ? 1 : 0;
+
         current++;
     }
 
-    ret = lseek(obj->handle, pos, SEEK_SET);
-    if (ret < 0)
-        fatal("error seeking: %s", strerror(errno));
+    free(nlists);
 
     return 0;
 }
 
-static int compare_symbols(const void *a, const void *b)
-{
-    struct symbol_t *sym_a = (struct symbol_t *)a;
-    struct symbol_t *sym_b = (struct symbol_t *)b;
-    return sym_a->addr - sym_b->addr;
-}
-
-void print_symbol(const char *symbol, unsigned offset)
+void print_symbol(const struct atosl_image_t *image, char *result, const char *symbol,
+                  unsigned offset)
 {
-    char *demangled = options.should_demangle ? demangle(symbol) : NULL;
+    char *demangled = image->options.should_demangle ? demangle(symbol) : NULL;
     const char *name = demangled ? demangled : symbol;
 
     if (name[0] == '_')
         name++;
 
-    // printf("%s%s (in %s) + %d\n",
-    //         name,
-    //         demangled ? "()" : "",
-    //         basename((char *)options.dsym_filename),
-    //         offset);
-
-    snprintf(atoslifeResult, 
+    snprintf(result,
             ATOSLIFE_SIZE,
             "%s%s (in %s) + %d\n",
             name,
             demangled ? "()" : "",
-            basename((char *)options.dsym_filename),
+            image->image_name,
             offset);
-    logDebugInfo();
+    logDebugInfo(result);
 
     if (demangled)
         free(demangled);
 }
 
-/* Print symbol name based on stabs information.
- * Currently only handles functions (N_FUN stabs)
- *
- * See README.stabs for stabs format information.
- *
- * Here we find pairs of N_FUN stabs. The first has the name of the function and its starting address;
- * the second has its size.
- *
- * We could also symbolicate global and static symbols (N_GSYM and N_STSYM) here,
- * but it's not necessary to do so since they'll be picked up by the generic symbol table
- * search later in this function.
- *
- * Return 1 if a symbol corresponding to search_addr was found; 0 otherwise.
- */
-int handle_stabs_symbol(int is_fun_stab, Dwarf_Addr search_addr, const struct symbol_t *symbol)
-{
-    /* These are static since they need to persist across pairs of symbols. */
-    static const char *last_fun_name = NULL;
-    static Dwarf_Addr last_addr;
-
-    if (is_fun_stab) {  
-        if (last_fun_name) { /* if this is non-null, the last symbol was an N_FUN stab as well. */
-            if (debug)
-                fprintf(stderr, "\t\tSecond consecutive N_FUN symbol. Function size: %llu (0x%llx)\n",
-                        symbol->addr, symbol->addr);
-            if (last_addr <= search_addr
-                    && search_addr < last_addr + symbol->addr) {
-                print_symbol(last_fun_name, (unsigned int)(search_addr - last_addr));
-                return 1;
-            } else if (debug)
-                fprintf(stderr, "\t\tNot printing symbol %s; 0x%llx not in the interval [0x%llx 0x%llx).\n",
-                        last_fun_name, search_addr, last_addr, last_addr + symbol->addr);
-            last_fun_name = NULL;
-        } else { /* last_fun_name is null, so this is the first N_FUN in (possibly) a pair. */
-            last_fun_name = symbol->name;
-            if (debug)
-                fprintf(stderr, "\t\tFirst consecutive N_FUN symbol. Function name: %s; addr: 0x%llx\n",
-                        symbol->name, symbol->addr);
-        }
-    } else {
-        if (debug && last_fun_name) {
-            fprintf(stderr, "%s", "\t\tN_FUN symbol not part of a pair! Ignoring.\n");
-            fprintf(stderr, "Name: %s, addr: 0x%llx (%llu)\n", last_fun_name, last_addr, last_addr);
-        }
-        last_fun_name = NULL;
-    }
-    last_addr = symbol->addr;
-    return 0;
-}
-
-int find_and_print_symtab_symbol(Dwarf_Addr slide, Dwarf_Addr addr)
+int find_and_print_symtab_symbol(const struct atosl_image_t *image, Dwarf_Addr slide,
+                                 Dwarf_Addr addr, char *result)
 {
-    union {
-        struct nlist_t nlist32;
-        struct nlist_64 nlist64;
-    } nlist;
-    struct symbol_t *current;
-    int found = 0;
-
-    int i;
-    int is_stab;
-    uint8_t type;
+    const struct symtab_index_t *symtab = image->context.symtab;
+    int32_t i;
 
     addr = addr - slide;
-    current = context.symlist;
-
-    for (i = 0; i < context.nsymbols; i++) {
-
-        memcpy(context.is_64 ? (void*)&nlist.nlist64 : (void*)&nlist.nlist32, context.is_64 ? (void*)&current->sym.sym64 : (void*)&current->sym.sym32, context.is_64 ? sizeof(current->sym.sym64) : sizeof(current->sym.sym32));
-        current->thumb = ((context.is_64 ? nlist.nlist64.n_desc : nlist.nlist32.n_desc) & N_ARM_THUMB_DEF) ? 1 : 0;
 
-        current->addr = context.is_64 ? nlist.nlist64.n_value : nlist.nlist32.n_value;
-        type = context.is_64 ? nlist.nlist64.n_type : nlist.nlist32.n_type;
-        is_stab = type & N_STAB;
-        if (debug) {
-            fprintf(stderr, "\t\tname: %s\n", current->name);
-            fprintf(stderr, "\t\tn_un.n_un.n_strx: %d\n", context.is_64 ? nlist.nlist64.n_un.n_strx : nlist.nlist32.n_un.n_strx);
-            fprintf(stderr, "\t\traw n_type: 0x%x\n", context.is_64 ? nlist.nlist64.n_type : nlist.nlist32.n_type);
-            fprintf(stderr, "\t\tn_type: ");
-            if (is_stab)
-                fprintf(stderr, "N_STAB ");
-            if ((context.is_64 ? nlist.nlist64.n_type : nlist.nlist32.n_type) & N_PEXT)
-                fprintf(stderr, "N_PEXT ");
-            if ((context.is_64 ? nlist.nlist64.n_type : nlist.nlist32.n_type) & N_EXT)
-                fprintf(stderr, "N_EXT ");
-            fprintf(stderr, "\n");
-
-            fprintf(stderr, "\t\tType: ");
-            switch (type & N_TYPE) {
-                case 0: fprintf(stderr, "U "); break;
-                case N_ABS: fprintf(stderr, "A "); break;
-                case N_SECT: fprintf(stderr, "S "); break;
-                case N_INDR: fprintf(stderr, "I "); break;
-            }
-
-            fprintf(stderr, "\n");
-
-            fprintf(stderr, "\t\tn_sect: %d\n", context.is_64 ? nlist.nlist64.n_sect : nlist.nlist32.n_sect);
-            fprintf(stderr, "\t\tn_desc: %d\n", context.is_64 ? nlist.nlist64.n_desc : nlist.nlist32.n_desc);
-            fprintf(stderr, "\t\tn_value: 0x%llx\n", (unsigned long long)(context.is_64 ? nlist.nlist64.n_value : nlist.nlist32.n_value));
-            fprintf(stderr, "\t\taddr: 0x%llx\n", current->addr);
-        }
-
-        if (handle_stabs_symbol(is_stab && type == N_FUN, addr, current))
-            return DW_DLV_OK;
-
-        current++;
+    if (!symtab)
+        return DW_DLV_NO_ENTRY;
 
-        if (debug)
-            fprintf(stderr, "\n");
+    /* Functions described by stabs have a known size, so prefer them */
+    i = symtab_index_lookup_fun(symtab, addr);
+    if (i >= 0) {
+        print_symbol(image, result, symtab->strings + symtab->fun_name[i],
+                     (unsigned int)(addr - symtab->fun_start[i]));
+        return DW_DLV_OK;
     }
 
-    qsort(context.symlist, context.nsymbols, sizeof(*current), compare_symbols);
-    current = context.symlist;
-
-    for (i = 0; i < context.nsymbols; i++) {
-        if (current->addr > addr) {
-            if (i < 1) {
-                /* Someone is asking about a symbol that comes before the first
-                 * one we know about. In that case we don't have a match for
-                 * them */
-                break;
-            }
-
-            struct symbol_t *prev = (current - 1);
-            print_symbol(prev->name, (unsigned int)(addr - prev->addr));
-            found = 1;
-            break;
-        }
-        current++;
+    /* Otherwise take the closest symbol before addr. There is no match for
+     * addresses before the first symbol we know about. */
+    i = symtab_index_lookup(symtab, addr);
+    if (i >= 0) {
+        print_symbol(image, result, symtab->strings + symtab->name[i],
+                     (unsigned int)(addr - symtab->addr[i]));
+        return DW_DLV_OK;
     }
 
-    return found ? DW_DLV_OK : DW_DLV_NO_ENTRY;
+    return DW_DLV_NO_ENTRY;
 }
 
 int parse_command(
@@ -690,9 +628,10 @@ int parse_command(
             /* Fallthrough */
         case LC_PREPAGE:
             cmdsize = load_command.cmdsize - sizeof(load_command);
-            ret = lseek(obj->handle, cmdsize, SEEK_CUR);
-            if (ret < 0)
-                fatal("error seeking: %s", strerror(errno));
+            if (lseek(obj->handle, cmdsize, SEEK_CUR) < 0) {
+                warning("error seeking: %s", strerror(errno));
+                ret = -1;
+            }
             break;
     }
 
@@ -704,7 +643,7 @@ static int dwarf_mach_object_access_internals_init(
         void *obj_in,
         int *error)
 {
-    int ret;
+    ssize_t ret;
     struct mach_header_t header;
     struct load_command_t load_command;
     int i;
@@ -717,18 +656,20 @@ static int dwarf_mach_object_access_internals_init(
     obj->pointer_size = 4;
     obj->endianness = DW_OBJECT_LSB;
     obj->sections = NULL;
-    obj->sections_64 = NULL;
 
     ret = _read(obj->handle, &header, sizeof(header));
-    if (ret < 0)
-        fatal_file(ret);
+    if (ret != (ssize_t)sizeof(header)) {
+        warning_file(ret);
+        return DW_DLV_ERROR;
+    }
     
     /* Need to skip 4 bytes of the reserved field of mach_header_64  */
     if (header.cputype == CPU_TYPE_ARM64 && header.cpusubtype == CPU_SUBTYPE_ARM64_ALL) {
-        context.is_64 = 1;
-        ret = lseek(obj->handle, sizeof(uint32_t), SEEK_CUR);
-        if (ret < 0)
-            fatal_file(ret);
+        obj->context->is_64 = 1;
+        if (lseek(obj->handle, sizeof(uint32_t), SEEK_CUR) < 0) {
+            warning("error seeking: %s", strerror(errno));
+            return DW_DLV_ERROR;
+        }
     }
 
     if (debug) {
@@ -759,14 +700,16 @@ static int dwarf_mach_object_access_internals_init(
                 fprintf(stderr, "File type: executable file\n");
             break;
         default:
-            fatal("unsupported file type: 0x%x", header.filetype);
-            assert(0);
+            warning("unsupported file type: 0x%x", header.filetype);
+            return DW_DLV_ERROR;
     }
 
     for (i = 0; i < header.ncmds; i++) {
         ret = _read(obj->handle, &load_command, sizeof(load_command));
-        if (ret < 0)
-            fatal_file(ret);
+        if (ret != (ssize_t)sizeof(load_command)) {
+            warning_file(ret);
+            return DW_DLV_ERROR;
+        }
 
         if (debug) {
             fprintf(stderr, "Load Command %d\n", i);
@@ -774,9 +717,10 @@ static int dwarf_mach_object_access_internals_init(
             fprintf(stderr, "%10s %d\n", "cmdsize", load_command.cmdsize);
         }
 
-        ret = parse_command(obj, load_command);
-        if (ret < 0)
-            fatal("unable to parse command %x", load_command.cmd);
+        if (parse_command(obj, load_command) < 0) {
+            warning("unable to parse command %x", load_command.cmd);
+            return DW_DLV_ERROR;
+        }
     }
 
     return DW_DLV_OK;
@@ -802,7 +746,7 @@ static int dwarf_mach_object_access_get_section_info(
         Dwarf_Obj_Access_Section *ret_scn,
         int *error)
 {
-    int i;
+    struct dwarf_section_t *sec;
     dwarf_mach_object_access_internals_t *obj =
         (dwarf_mach_object_access_internals_t *)obj_in;
 
@@ -811,27 +755,10 @@ static int dwarf_mach_object_access_get_section_info(
         return DW_DLV_ERROR;
     }
     
-    if (obj->sections_64) {
-        struct dwarf_section_64_t *sec = obj->sections_64;
-        for (i = 0; i < section_index; i++) {
-            sec = sec->next;
-        }
-        sec->mach_section.sectname[1] = '.';
-        ret_scn->size = sec->mach_section.size;
-        ret_scn->addr = sec->mach_section.addr;
-        ret_scn->name = sec->mach_section.sectname+1;
-    } else {
-        struct dwarf_section_t *sec = obj->sections;
-        for (i = 0; i < section_index; i++) {
-            sec = sec->next;
-        }
-        sec->mach_section.sectname[1] = '.';
-        ret_scn->size = sec->mach_section.size;
-        ret_scn->addr = sec->mach_section.addr;
-        ret_scn->name = sec->mach_section.sectname+1;
-    }
-    if (strcmp(ret_scn->name, ".debug_pubnames__DWARF") == 0)
-        ret_scn->name = ".debug_pubnames";
+    sec = &obj->sections[section_index];
+    ret_scn->size = sec->size;
+    ret_scn->addr = sec->addr;
+    ret_scn->name = sec->name;
 
     ret_scn->link = 0; /* rela section or from symtab to strtab */
     ret_scn->entrysize = 0;
@@ -839,15 +766,42 @@ static int dwarf_mach_object_access_get_section_info(
     return DW_DLV_OK;
 }
 
+/* Read a section into its own buffer, or point into the mapping. NULL
+ * if the file ends before the section does. */
+static void *load_section_data(dwarf_mach_object_access_internals_t *obj,
+                               uint64_t offset, uint64_t size, void **owned)
+{
+    void *addr;
+    ssize_t ret;
+
+    offset += obj->context->arch.offset;
+    *owned = NULL;
+
+    if (obj->map && offset <= obj->map_size && size <= obj->map_size - offset)
+        return (char *)obj->map + offset;
+
+    addr = malloc(size ? size : 1);
+    if (!addr)
+        fatal("unable to allocate memory");
+    ret = _pread(obj->handle, addr, size, offset);
+    if (ret < 0 || (uint64_t)ret != size) {
+        warning_file(ret);
+        free(addr);
+        return NULL;
+    }
+
+    *owned = addr;
+    return addr;
+}
+
 static int dwarf_mach_object_access_load_section(
         void *obj_in,
         Dwarf_Half section_index,
         Dwarf_Small **section_data,
         int *error)
 {
+    struct dwarf_section_t *sec;
     void *addr;
-    int i;
-    int ret;
 
     dwarf_mach_object_access_internals_t *obj =
         (dwarf_mach_object_access_internals_t *)obj_in;
@@ -857,36 +811,16 @@ static int dwarf_mach_object_access_load_section(
         return DW_DLV_ERROR;
     }
 
-    if (obj->sections_64) {
-        struct dwarf_section_64_t *sec = obj->sections_64;
-        for (i = 0; i < section_index; i++) {
-            sec = sec->next;
-        }
-        addr = malloc(sec->mach_section.size);
-        if (!addr)
-            fatal("unable to allocate memory");
-        ret = lseek(obj->handle, context.arch.offset + sec->mach_section.offset, SEEK_SET);
-        if (ret < 0)
-            fatal("error seeking: %s", strerror(errno));
-        ret = _read(obj->handle, addr, sec->mach_section.size);
-        if (ret < 0)
-            fatal_file(ret);
-
-    } else {
-        struct dwarf_section_t *sec = obj->sections;
-        for (i = 0; i < section_index; i++) {
-            sec = sec->next;
-        }
-        addr = malloc(sec->mach_section.size);
-        if (!addr)
-            fatal("unable to allocate memory");
-        ret = lseek(obj->handle, context.arch.offset + sec->mach_section.offset, SEEK_SET);
-        if (ret < 0)
-            fatal("error seeking: %s", strerror(errno));
-        ret = _read(obj->handle, addr, sec->mach_section.size);
-        if (ret < 0)
-            fatal_file(ret);
-        
+    sec = &obj->sections[section_index];
+    pthread_mutex_lock(&obj->lock);
+    if (!sec->data)
+        addr = load_section_data(obj, sec->offset, sec->size, &sec->data);
+    else
+        addr = sec->data;
+    pthread_mutex_unlock(&obj->lock);
+    if (!addr) {
+        *error = DW_DLE_IOF;
+        return DW_DLV_ERROR;
     }
     *section_data = addr;
 
@@ -928,24 +862,62 @@ static const struct Dwarf_Obj_Access_Methods_s
 };
 
 
-void dwarf_mach_object_access_init(
+void dwarf_mach_object_access_finish(Dwarf_Obj_Access_Interface *obj)
+{
+    dwarf_mach_object_access_internals_t *internals;
+
+    if (!obj)
+        return;
+
+    internals = (dwarf_mach_object_access_internals_t *)obj->object;
+    if (internals) {
+        Dwarf_Unsigned i;
+
+        for (i = 0; i < internals->section_count; i++)
+            free(internals->sections[i].data);
+        free(internals->sections);
+        if (internals->map)
+            munmap(internals->map, internals->map_size);
+        pthread_mutex_destroy(&internals->lock);
+        free(internals);
+    }
+    free(obj);
+}
+
+int dwarf_mach_object_access_init(
         dwarf_mach_handle handle,
+        struct atosl_context_t *context,
+        int use_mmap,
         Dwarf_Obj_Access_Interface **ret_obj,
         int *err)
 {
     int res = 0;
     dwarf_mach_object_access_internals_t *internals = NULL;
     Dwarf_Obj_Access_Interface *intfc = NULL;
+    struct stat st;
 
     internals = malloc(sizeof(*internals));
     if (!internals)
         fatal("unable to allocate memory");
 
     memset(internals, 0, sizeof(*internals));
-    res = dwarf_mach_object_access_internals_init(handle, internals, err);
-    if (res != DW_DLV_OK)
-        fatal("error initializing dwarf internals");
-
+    internals->context = context;
+    pthread_mutex_init(&internals->lock, NULL);
+
+    /* A shared read-only mapping lets every process looking at the same
+     * file share its page cache, and only the pages libdwarf touches are
+     * ever read. Fall back to reading sections if the file can't be
+     * mapped. */
+    if (use_mmap && fstat(handle, &st) == 0 && st.st_size > 0 &&
+        (uint64_t)st.st_size <= SIZE_MAX) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, handle, 0);
+        if (map != MAP_FAILED) {
+            internals->map = map;
+            internals->map_size = (size_t)st.st_size;
+        } else if (debug) {
+            fprintf(stderr, "unable to map file, reading sections: %s\n", strerror(errno));
+        }
+    }
     intfc = malloc(sizeof(Dwarf_Obj_Access_Interface));
     if (!intfc)
         fatal("unable to allocate memory");
@@ -953,249 +925,210 @@ void dwarf_mach_object_access_init(
     intfc->object = internals;
     intfc->methods = &dwarf_mach_object_access_methods;
 
+    res = dwarf_mach_object_access_internals_init(handle, internals, err);
+    if (res != DW_DLV_OK) {
+        dwarf_mach_object_access_finish(intfc);
+        return res;
+    }
+
     *ret_obj = intfc;
+    return DW_DLV_OK;
 }
 
-void dwarf_mach_object_access_finish(Dwarf_Obj_Access_Interface *obj)
-{
-    if (!obj)
-        return;
+/* State carried from one address to the next while a sorted batch of
+ * addresses is resolved. Consecutive addresses that land in the same
+ * arange, compilation unit or function reuse what the previous one found. */
+struct dwarf_sweep_t {
+    int32_t arange;
+    const struct dwarf_linetable_t *lines;
+    struct linetab_cursor_t line_cursor;
 
-    if (obj->object)
-        free(obj->object);
-    free(obj);
+    int32_t subprogram;
+};
+
+static void dwarf_sweep_init(struct dwarf_sweep_t *sweep)
+{
+    memset(sweep, 0, sizeof(*sweep));
+    sweep->arange = -1;
+    sweep->subprogram = -1;
+    linetab_cursor_init(&sweep->line_cursor);
 }
 
-struct dwarf_subprogram_t *lookup_symbol(Dwarf_Addr addr)
+/* Index into context->subprograms of the innermost function containing
+ * addr, or -1. The previous match is reused as long as addr is inside it and
+ * no other function starts between the two. */
+static int32_t sweep_lookup_symbol(const struct atosl_context_t *context,
+                                   struct dwarf_sweep_t *sweep,
+                                   Dwarf_Addr addr)
 {
-    struct dwarf_subprogram_t *subprogram = context.subprograms;
+    const struct dwarf_subprograms_t *subprograms = context->subprograms;
+    int32_t i = sweep->subprogram;
 
-    while (subprogram) {
-        if ((addr >= subprogram->lowpc) &&
-            (addr < subprogram->highpc)) {
-            return subprogram;
-        }
+    if (!subprograms)
+        return -1;
 
-        subprogram = subprogram->next;
-    }
+    if (i >= 0 && addr >= subprograms->lowpc[i] && addr < subprograms->highpc[i] &&
+        (i + 1 == subprograms->count || addr < subprograms->lowpc[i + 1]))
+        return i;
 
-    return NULL;
+    i = subprograms_lookup(subprograms, addr);
+    if (i >= 0)
+        sweep->subprogram = i;
+    return i;
 }
 
-int print_subprogram_symbol(Dwarf_Addr slide, Dwarf_Addr addr)
+int print_subprogram_symbol(const struct atosl_image_t *image, struct dwarf_sweep_t *sweep,
+                            Dwarf_Addr slide, Dwarf_Addr addr, char *result)
 {
+    const struct atosl_context_t *context = &image->context;
     char *demangled = NULL;
 
     addr -= slide;
 
-    struct dwarf_subprogram_t *match = lookup_symbol(addr);
+    int32_t match = sweep_lookup_symbol(context, sweep, addr);
+
+    if (match >= 0) {
+        const char *name;
+
+        /* Without a line there is nothing to tell inlined frames apart */
+        match = subprograms_concrete(context->subprograms, match);
+        name = subprograms_name(context->subprograms, match);
 
-    if (match) {
-        demangled = options.should_demangle ? demangle(match->name) : NULL;
-        // printf("%s (in %s) + %d\n",
-        //        demangled ?: match->name,
-        //        basename((char *)options.dsym_filename),
-        //        (unsigned int)(addr - match->lowpc));
+        demangled = image->options.should_demangle ? demangle(name) : NULL;
 
-        snprintf(atoslifeResult, 
+        snprintf(result,
                 ATOSLIFE_SIZE,
                 "%s (in %s) + %d\n",
-                demangled ?: match->name,
-                basename((char *)options.dsym_filename),
-                (unsigned int)(addr - match->lowpc));
-        logDebugInfo();
+                demangled ?: name,
+                image->image_name,
+                (unsigned int)(addr - context->subprograms->lowpc[match]));
+        logDebugInfo(result);
         if (demangled)
             free(demangled);
 
     }
 
-    return match ? 0 : -1;
+    return match >= 0 ? 0 : -1;
 }
 
-int print_dwarf_symbol(Dwarf_Debug dbg, Dwarf_Addr slide, Dwarf_Addr addr)
+/* One line of a result: the function, and where in it when file isn't
+ * empty. Returns the length of the line, however much of it fit. */
+static int print_frame(const struct atosl_image_t *image, const char *name,
+                       const char *file, uint32_t line, char *result, size_t size)
 {
-    Dwarf_Arange *arange_buf = NULL;
-    Dwarf_Line *linebuf = NULL;
-    Dwarf_Signed linecount = 0;
-    Dwarf_Off cu_die_offset = 0;
-    Dwarf_Die cu_die = NULL;
-    Dwarf_Unsigned segment = 0;
-    Dwarf_Unsigned segment_entry_size = 0;
-    Dwarf_Addr start = 0;
-    Dwarf_Unsigned length = 0;
-    Dwarf_Arange arange;
-    Dwarf_Signed count;
-    int ret;
-    Dwarf_Error err;
-    int i;
-    int found = 0;
+    char *demangled = image->options.should_demangle ? demangle(name) : NULL;
+    int len;
+
+    if (*file)
+        len = snprintf(result,
+                       size,
+                       "%s (in %s) (%s:%d)\n",
+                       demangled ? demangled : name,
+                       image->image_name,
+                       path_basename(file), (int)line);
+    else
+        len = snprintf(result,
+                       size,
+                       "%s (in %s)\n",
+                       demangled ? demangled : name,
+                       image->image_name);
+    logDebugInfo(result);
 
-    addr -= slide;
-
-    if (!arange_buf) {
-        ret = dwarf_get_aranges(dbg, &arange_buf, &count, &err);
-        DWARF_ASSERT(ret, err);
-    }
-    ret = dwarf_get_arange(arange_buf, count, addr, &arange, &err);
-    DWARF_ASSERT(ret, err);
-
-    if (ret == DW_DLV_NO_ENTRY)
-        return ret;
-
-    ret = dwarf_get_arange_info_b(
-            arange,
-            &segment,
-            &segment_entry_size,
-            &start,
-            &length,
-            &cu_die_offset,
-            &err);
-    DWARF_ASSERT(ret, err);
-
-    ret = dwarf_offdie(dbg, cu_die_offset, &cu_die, &err);
-    DWARF_ASSERT(ret, err);
+    if (demangled)
+        free(demangled);
 
-    /* ret = dwarf_print_lines(cu_die, &err, &errcnt); */
-    /* DWARF_ASSERT(ret, err); */
+    return len;
+}
 
-    ret = dwarf_srclines(cu_die, &linebuf, &linecount, &err);
-    DWARF_ASSERT(ret, err);
+/* With inlines, result holds ATOSLIFE_SIZE * ATOSLIFE_INLINE_FRAMES bytes
+ * and gets a line per frame, like atos -i: the innermost inlined function
+ * at the line addr is on, then each function it was inlined into at the
+ * line of the call. Frames past what fits are left out, all but the
+ * function that has the code. Otherwise result holds ATOSLIFE_SIZE bytes
+ * and gets that function alone. */
+int print_dwarf_symbol(const struct atosl_image_t *image, struct dwarf_sweep_t *sweep,
+                       Dwarf_Addr slide, Dwarf_Addr addr, int inlines, char *result)
+{
+    const struct atosl_context_t *context = &image->context;
+    const struct dwarf_aranges_t *aranges = context->aranges;
+    const struct dwarf_linetable_t *lines;
+    int32_t arange;
+    int32_t row;
+    int32_t symbol;
+    int32_t caller;
+    const char *file;
+    uint32_t line;
+    size_t size = ATOSLIFE_SIZE;
+    size_t used = 0;
+    int len;
 
-    for (i = 0; i < linecount; i++) {
-        Dwarf_Line prevline;
-        Dwarf_Line nextline;
-        Dwarf_Line line = linebuf[i];
+    addr -= slide;
 
-        Dwarf_Addr lineaddr;
-        Dwarf_Addr lowaddr;
-        Dwarf_Addr highaddr;
+    if (context->linetab) {
+        if (linetab_lookup(context->linetab, &sweep->line_cursor, addr, &line, &file) < 0)
+            return DW_DLV_NO_ENTRY;
+        goto found;
+    }
 
-        ret = dwarf_lineaddr(line, &lineaddr, &err);
-        DWARF_ASSERT(ret, err);
+    if (!aranges || !context->lines)
+        return DW_DLV_NO_ENTRY;
 
-        if (i > 0) {
-            prevline = linebuf[i-1];
-            ret = dwarf_lineaddr(prevline, &lowaddr, &err);
-            DWARF_ASSERT(ret, err);
-            lowaddr += 1;
-        } else {
-            lowaddr = lineaddr;
-        }
+    arange = sweep->arange;
+    if (arange < 0 || addr < aranges->start[arange] || addr >= aranges->end[arange]) {
+        arange = aranges_lookup(aranges, addr);
+        if (arange < 0)
+            return DW_DLV_NO_ENTRY;
 
-        if (i < linecount - 1) {
-            nextline = linebuf[i+1];
-            ret = dwarf_lineaddr(nextline, &highaddr, &err);
-            DWARF_ASSERT(ret, err);
-            highaddr -= 1;
-        } else {
-            highaddr = lineaddr;
+        if (!sweep->lines || sweep->lines->cu_offset != aranges->cu_offset[arange]) {
+            linecache_release(context->lines, sweep->lines);
+            sweep->lines = linecache_get(context->lines, aranges->cu_offset[arange]);
         }
+        sweep->arange = arange;
+    }
 
-        if ((addr >= lowaddr) && (addr <= highaddr)) {
-            char *filename;
-            Dwarf_Unsigned lineno;
-            char *diename;
-            char *demangled;
-            struct dwarf_subprogram_t *symbol;
-            const char *name;
-
-            ret = dwarf_linesrc(line, &filename, &err);
-            DWARF_ASSERT(ret, err);
-
-            ret = dwarf_lineno(line, &lineno, &err);
-            DWARF_ASSERT(ret, err);
-
-            ret = dwarf_diename(cu_die, &diename, &err);
-            DWARF_ASSERT(ret, err);
-
-            symbol = lookup_symbol(addr);
-
-            name = symbol ? symbol->name : "(unknown)";
-
-            demangled = options.should_demangle ? demangle(name) : NULL;
-
-            // printf("%s (in %s) (%s:%d)\n",
-            //        demangled ? demangled : name,
-            //        basename((char *)options.dsym_filename),
-            //        basename(filename), (int)lineno);
-
-            snprintf(atoslifeResult,
-                    ATOSLIFE_SIZE,
-                    "%s (in %s) (%s:%d)\n",
-                    demangled ? demangled : name,
-                    basename((char *)options.dsym_filename),
-                    basename(filename), (int)lineno);
-            logDebugInfo();
-
-            found = 1;
-
-            if (demangled)
-                free(demangled);
-
-            dwarf_dealloc(dbg, diename, DW_DLA_STRING);
-            dwarf_dealloc(dbg, filename, DW_DLA_STRING);
+    lines = sweep->lines;
+    row = linetable_lookup(lines, addr);
+    if (row < 0)
+        return DW_DLV_NO_ENTRY;
+    file = linetable_file(lines, row);
+    line = lines->line[row];
+
+found:
+    symbol = sweep_lookup_symbol(context, sweep, addr);
+    if (symbol < 0) {
+        print_frame(image, "(unknown)", file, line, result, size);
+        return DW_DLV_OK;
+    }
 
-            break;
+    if (inlines)
+        size *= ATOSLIFE_INLINE_FRAMES;
+
+    /* Without inlines, the line of the inlined code goes with the function
+     * it was inlined into, as atos has it */
+    while ((caller = subprograms_caller(context->subprograms, symbol)) >= 0) {
+        if (inlines) {
+            /* Keep room for the last frame */
+            if (size - used >= 2 * ATOSLIFE_SIZE) {
+                len = print_frame(image, subprograms_name(context->subprograms, symbol),
+                                  file, line, result + used, ATOSLIFE_SIZE);
+                used += len < ATOSLIFE_SIZE ? len : ATOSLIFE_SIZE - 1;
+            }
+            file = subprograms_call_file(context->subprograms, symbol);
+            line = context->subprograms->call_line[symbol];
         }
+        symbol = caller;
     }
 
-    // Deallocating arange commented out because it causes segmentation fault when symbolicating multiple addresses
-    // Test case: ./atosl -c -o /home/ec2-user/Swift2 -A arm64 -l 0x100040000 0x100084090 0x100085108 0x10008d9f4
-    //dwarf_dealloc(dbg, arange, DW_DLA_ARANGE);
-    dwarf_srclines_dealloc(dbg, linebuf, linecount);
+    print_frame(image, subprograms_name(context->subprograms, symbol), file, line,
+                result + used, ATOSLIFE_SIZE);
 
-    return found ? DW_DLV_OK : DW_DLV_NO_ENTRY;
+    return DW_DLV_OK;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////
 // Ruby support                                                                     //
 //////////////////////////////////////////////////////////////////////////////////////
 
-extern char *project_name;
-
-static int lookup_by_address(struct thin_macho *thin_macho, CORE_ADDR integer_address){
-    int result = -1;
-    if(thin_macho->dwarf2_per_objfile != NULL){
-        result = lookup_by_address_in_dwarf(thin_macho, integer_address);
-    }
-    if(result == -1){
-        result = lookup_by_address_in_symtable(thin_macho, integer_address);
-    }
-    return result;
-}
-
-static void numeric_to_symbols(struct thin_macho *thin_macho, const char **addresses, int numofaddresses){
-    int i = 0;
-    const char *address = NULL;
-    CORE_ADDR integer_address = 0;
-
-    for (i = 0; i < numofaddresses; i++){
-        address = addresses[i];
-        if(address[0] == '0' && (address[1] == 'x' || address[1] == 'X')){
-            //address start with 0x
-            integer_address = strtoll(address, NULL, 0);
-        }else{
-            integer_address= strtoll(address, NULL, 16);
-        }
-
-        if (lookup_by_address(thin_macho, integer_address) != 0){
-            // printf("%s\n", addresses[i]);
-            snprintf(atoslifeResult, ATOSLIFE_SIZE, "%s\n", addresses[i]);
-            logDebugInfo();
-        }
-    }
-}
-
-static void set_project_name(const char* full_filename){
-    char *filename = strrchr(full_filename, '/');
-    if(filename == NULL){
-        filename = (char *)full_filename;
-    }else{
-        filename = filename + 1;
-    }
-    project_name = filename;
-}
-
 // Initial setup function, takes no arguments and returns nothing. Some API
 // notes:
 //
@@ -1209,136 +1142,1041 @@ static void set_project_name(const char* full_filename){
 //   single method on the given module
 VALUE Atoslife;
 
-VALUE symbolicate_wrapper(VALUE self, VALUE arch, VALUE executable, VALUE loadaddress, VALUE addresses){
-    printf("• symbolicate_wrapper(...)\n");
-    memset(atoslifeResult, '\0', sizeof(atoslifeResult));
-    logDebugInfo();
-
-    int numofaddresses = RARRAY_LEN(addresses);
-    char *arch_str = RSTRING_PTR(StringValue(arch));
-    char *executable_str = RSTRING_PTR(StringValue(executable));
-    char *loadaddress_str = RSTRING_PTR(StringValue(loadaddress));
-    char **addresses_array = malloc(numofaddresses * sizeof(char *));
-    for (int i = 0; i < numofaddresses; i++){
-        VALUE ret = rb_ary_entry(addresses, i);
-        addresses_array[i] = RSTRING_PTR(StringValue(ret));
-    }
-    int result = symbolicate(arch_str, executable_str, loadaddress_str, addresses_array, numofaddresses);
-
-    printf("• result = %d\n", result);
-    free(addresses_array);
-
-    if (result == 0) {
-        printf("• found a result: %s\n", atoslifeResult);
-        return rb_str_new2(atoslifeResult);
-    } else {
-        printf("• Returning nil\n");
-        return Qnil;
-    }
+// The parse and the lookups run without the GVL so that other Ruby threads
+// keep running meanwhile. Ruby strings may be moved by the GC or modified by
+// another thread once the GVL is released, so everything the C side reads is
+// copied into buffers first, and results are turned into Ruby objects only
+// after the GVL is reacquired.
+
+struct image_call_t {
+    struct atosl_image_t *image;
+    const char *arch;
+    const char *path;
+    struct atosl_image_options_t options;
+    Dwarf_Addr load_address;
+    char **addresses;
+    int numofaddresses;
+    char **results;
+    int nthreads;
+    int inlines;
+    // Checked by the lookups instead of options.interrupted, when set
+    const volatile int *interrupted;
+    // Where a shared image from the registry goes
+    struct atosl_image_t **shared;
+    int ret;
+};
 
-    // return INT2NUM(result);
-}
+static void *open_without_gvl(void *ptr)
+{
+    struct image_call_t *call = ptr;
 
-void Init_atoslife(){
-    Atoslife = rb_define_module("Atoslife");
-    rb_define_singleton_method(Atoslife, "symbolicate", symbolicate_wrapper, 4);
+    call->ret = atosl_image_open(call->image, call->arch, call->path, &call->options);
+    return NULL;
 }
 
-//////////////////////////////////////////////////////////////////////////////////////
-// main                                                                             //
-//////////////////////////////////////////////////////////////////////////////////////
+static void *acquire_without_gvl(void *ptr)
+{
+    struct image_call_t *call = ptr;
 
-int symbolicate(const char* arch, const char *executable, const char *loadAddress, char *addresses[], int numofaddresses) {
-    runCounter = runCounter + 1;
-    printf("• runCounter = %d\n", runCounter);
+    *call->shared = atosl_registry_acquire(call->arch, call->path, &call->options);
+    call->ret = *call->shared ? 0 : -1;
+    return NULL;
+}
 
-    int fd;
-    int ret;
-    int i;
-    Dwarf_Debug dbg = NULL;
-    Dwarf_Error err;
-    int derr = 0;
-    Dwarf_Obj_Access_Interface *binary_interface = NULL;
-    Dwarf_Ptr errarg = NULL;
-    int option_index;
-    int c;
-    int found = 0;
-    uint32_t magic;
-    cpu_type_t cpu_type = -1;
-    cpu_subtype_t cpu_subtype = -1;
+static void *symbolicate_without_gvl(void *ptr)
+{
+    struct image_call_t *call = ptr;
+
+    call->ret = atosl_image_symbolicate_parallel(call->image, call->load_address, call->addresses,
+                                                 call->numofaddresses, call->results,
+                                                 call->nthreads, call->inlines, call->interrupted);
+    return NULL;
+}
+
+static void *open_and_symbolicate_without_gvl(void *ptr)
+{
+    struct image_call_t *call = ptr;
+
+    open_without_gvl(call);
+    if (call->ret == 0) {
+        symbolicate_without_gvl(call);
+        atosl_image_close(call->image);
+    }
+    return NULL;
+}
+
+// Unblocking function: Ruby calls it from another thread when the thread
+// running without the GVL is interrupted (Thread#raise, Thread#kill, a
+// signal, interpreter shutdown)
+static void interrupt_call(void *ptr)
+{
+    *(volatile int *)ptr = 1;
+}
+
+// A call that failed either gave up because it was interrupted, or ran into
+// something wrong with the file. path is what it was opening, if anything.
+static void raise_if_failed(const struct image_call_t *call, VALUE path)
+{
+    if (call->ret < 0) {
+        if (call->interrupted && *call->interrupted) {
+            // Raise whatever made Ruby interrupt us, if it is still pending
+            rb_thread_check_ints();
+            rb_raise(rb_eInterrupt, "symbolication interrupted");
+        }
+        if (!NIL_P(path))
+            rb_raise(rb_eRuntimeError, "unable to open `%s'", RSTRING_PTR(path));
+        rb_raise(rb_eRuntimeError, "symbolication failed");
+    }
+}
+
+// Everything atosl_image_open() would refuse is raised before the GVL is
+// released, rather than found out by the C side
+static void check_image_args(VALUE arch, VALUE path)
+{
+    cpu_type_t cpu_type;
+    cpu_subtype_t cpu_subtype;
+
+    StringValueCStr(arch);
+    StringValueCStr(path);
+    if (arch_type(RSTRING_PTR(arch), &cpu_type, &cpu_subtype) < 0)
+        rb_raise(rb_eArgError, "unsupported architecture `%s'", RSTRING_PTR(arch));
+    if (access(RSTRING_PTR(path), R_OK) != 0)
+        rb_raise(rb_eArgError, "unable to open `%s': %s", RSTRING_PTR(path), strerror(errno));
+}
+
+// NUL-terminated copy of str, freed with rb_free_tmp_buffer(buffer)
+static char *cstr_copy(VALUE str, volatile VALUE *buffer)
+{
+    char *copy;
+    long len;
+
+    StringValueCStr(str);
+    len = RSTRING_LEN(str);
+    copy = rb_alloc_tmp_buffer(buffer, len + 1);
+    memcpy(copy, RSTRING_PTR(str), len + 1);
+    RB_GC_GUARD(str);
+    return copy;
+}
+
+// The strings of addresses, copied into one buffer freed with
+// rb_free_tmp_buffer(buffer)
+static char **addresses_from_array(VALUE addresses, int *numofaddresses, volatile VALUE *buffer)
+{
+    VALUE strs;
+    char **addresses_array;
+    char *data;
+    long size = 0;
+
+    Check_Type(addresses, T_ARRAY);
+    strs = rb_ary_new_capa(RARRAY_LEN(addresses));
+    for (long i = 0; i < RARRAY_LEN(addresses); i++) {
+        VALUE str = rb_ary_entry(addresses, i);
+        StringValueCStr(str);
+        // As atosl_image_symbolicate_parallel() parses them
+        errno = 0;
+        strtol(RSTRING_PTR(str), (char **)NULL, 16);
+        if (errno != 0)
+            rb_raise(rb_eArgError, "invalid address: `%s'", RSTRING_PTR(str));
+        rb_ary_push(strs, str);
+        size += RSTRING_LEN(str) + 1;
+    }
+    *numofaddresses = (int)RARRAY_LEN(strs);
+
+    addresses_array = rb_alloc_tmp_buffer(buffer, sizeof(char *) * *numofaddresses + size);
+    data = (char *)(addresses_array + *numofaddresses);
+    for (int i = 0; i < *numofaddresses; i++) {
+        VALUE str = RARRAY_AREF(strs, i);
+        long len = RSTRING_LEN(str);
+
+        memcpy(data, RSTRING_PTR(str), len);
+        data[len] = '\0';
+        addresses_array[i] = data;
+        data += len + 1;
+    }
+    RB_GC_GUARD(strs);
+    return addresses_array;
+}
+
+static Dwarf_Addr load_address_value(VALUE load_address)
+{
     Dwarf_Addr address;
 
-    memset(&context, 0, sizeof(context));
+    if (load_address == Qundef || NIL_P(load_address))
+        return LONG_MAX;
 
-    // 1. First set the VM load address
+    if (RB_INTEGER_TYPE_P(load_address))
+        return NUM2ULL(load_address);
 
+    char *load_address_str = StringValueCStr(load_address);
     errno = 0;
-    address = strtol(loadAddress, (char **)NULL, 16);
+    address = strtol(load_address_str, (char **)NULL, 16);
     if (errno != 0)
-        fatal("invalid load address: `%s': %s (error code %d)", loadAddress, strerror(errno), errno);
-    options.load_address = address;
+        rb_raise(rb_eArgError, "invalid load address: `%s'", load_address_str);
+    return address;
+}
+
+static VALUE results_to_array(char **results, int numofresults)
+{
+    VALUE array = rb_ary_new_capa(numofresults);
+
+    for (int i = 0; i < numofresults; i++) {
+        rb_ary_push(array, results[i] ? rb_str_new2(results[i]) : Qnil);
+        free(results[i]);
+    }
+    return array;
+}
+
+// Opens executable, resolves addresses and closes it again, all without the
+// GVL. Returns one result per address in input order.
+static VALUE symbolicate_once(VALUE arch, VALUE executable, VALUE loadaddress, VALUE addresses)
+{
+    struct atosl_image_t image;
+    struct image_call_t call = {
+        .image = &image,
+        .options = ATOSL_IMAGE_OPTIONS_DEFAULT,
+        .nthreads = 1,
+    };
+    volatile int interrupted = 0;
+    volatile VALUE arch_buffer = 0, path_buffer = 0, addresses_buffer = 0;
+
+    call.load_address = load_address_value(loadaddress);
+    call.options.interrupted = &interrupted;
+    call.interrupted = &interrupted;
+
+    check_image_args(arch, executable);
+
+    call.arch = cstr_copy(arch, &arch_buffer);
+    call.path = cstr_copy(executable, &path_buffer);
+    call.addresses = addresses_from_array(addresses, &call.numofaddresses, &addresses_buffer);
+    call.results = ZALLOC_N(char *, call.numofaddresses);
+
+    // Only the CUs these addresses are in are worth indexing
+    call.options.addresses = call.addresses;
+    call.options.naddresses = call.numofaddresses;
+    call.options.load_address = call.load_address;
+
+    rb_thread_call_without_gvl(open_and_symbolicate_without_gvl, &call,
+                               interrupt_call, (void *)&interrupted);
+
+    rb_free_tmp_buffer(&arch_buffer);
+    rb_free_tmp_buffer(&path_buffer);
+    rb_free_tmp_buffer(&addresses_buffer);
+
+    VALUE array = results_to_array(call.results, call.numofaddresses);
+    xfree(call.results);
+    raise_if_failed(&call, executable);
+    return array;
+}
+
+VALUE symbolicate_wrapper(VALUE self, VALUE arch, VALUE executable, VALUE loadaddress, VALUE addresses){
+    if (debug)
+        fprintf(stderr, "• symbolicate_wrapper(...)\n");
+
+    VALUE results = symbolicate_once(arch, executable, loadaddress, addresses);
+
+    // Callers of this entry point only ever see the last result
+    long numofresults = RARRAY_LEN(results);
+    VALUE result = numofresults ? rb_ary_entry(results, numofresults - 1) : Qnil;
+
+    if (debug)
+        fprintf(stderr, "• result: %s\n", NIL_P(result) ? "" : RSTRING_PTR(result));
+    return NIL_P(result) ? rb_str_new2("") : result;
+}
+
+// Atoslife::Image wraps a struct atosl_image_t, so the dSYM is opened and
+// indexed once in Image.new and every #symbolicate call reuses that state.
+// The libdwarf state is released by #close, or by the GC if it never was.
+VALUE AtoslifeImage;
+
+struct image_handle_t {
+    struct atosl_image_t image;
+    // Set instead of image for Image.new(..., shared: true)
+    struct atosl_image_t *shared;
+    // The image is used without the GVL, so #initialize, #symbolicate and
+    // #close take this Mutex
+    VALUE lock;
+    // Set by the unblocking function while a call runs without the GVL
+    volatile int interrupted;
+};
+
+static void image_mark(void *ptr)
+{
+    struct image_handle_t *handle = ptr;
+
+    rb_gc_mark(handle->lock);
+}
+
+static int handle_open(const struct image_handle_t *handle)
+{
+    return handle->shared || handle->image.fd >= 0;
+}
+
+static void handle_close(struct image_handle_t *handle)
+{
+    if (handle->shared) {
+        atosl_registry_release(handle->shared);
+        handle->shared = NULL;
+    } else if (handle->image.fd >= 0) {
+        atosl_image_close(&handle->image);
+    }
+}
+
+static void image_free(void *ptr)
+{
+    struct image_handle_t *handle = ptr;
+
+    handle_close(handle);
+    xfree(handle);
+}
+
+static size_t image_memsize(const void *ptr)
+{
+    return sizeof(struct image_handle_t);
+}
+
+static const rb_data_type_t image_type = {
+    "Atoslife::Image",
+    {image_mark, image_free, image_memsize,},
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE image_alloc(VALUE klass)
+{
+    struct image_handle_t *handle;
+    VALUE obj = TypedData_Make_Struct(klass, struct image_handle_t, &image_type, handle);
+    handle->image.fd = -1;
+    handle->lock = rb_mutex_new();
+    return obj;
+}
+
+static struct image_handle_t *get_handle(VALUE self)
+{
+    struct image_handle_t *handle;
+
+    TypedData_Get_Struct(self, struct image_handle_t, &image_type, handle);
+    return handle;
+}
+
+struct locked_call_t {
+    struct image_handle_t *handle;
+    struct image_call_t *call;
+    void *(*func)(void *);
+    int want_open;
+};
+
+static VALUE image_call_locked(VALUE ptr)
+{
+    struct locked_call_t *locked = (struct locked_call_t *)ptr;
+    struct image_handle_t *handle = locked->handle;
+
+    if (handle_open(handle) != locked->want_open)
+        return Qtrue;
+
+    locked->call->image = handle->shared ? handle->shared : &handle->image;
+    handle->interrupted = 0;
+    rb_thread_call_without_gvl(locked->func, locked->call,
+                               interrupt_call, (void *)&handle->interrupted);
+    return Qfalse;
+}
 
-    // 2. Debug symbol filename
-    options.dsym_filename = executable;
+// Runs call->ret = func(call) without the GVL, with the image lock held.
+// Returns nonzero if the image was closed (or, for open, already open) by the
+// time the lock was taken, in which case func didn't run.
+static int image_call(struct image_handle_t *handle, struct image_call_t *call,
+                      void *(*func)(void *), int want_open)
+{
+    struct locked_call_t locked = { handle, call, func, want_open };
+
+    return RTEST(rb_mutex_synchronize(handle->lock, image_call_locked, (VALUE)&locked));
+}
+
+// Image.new(path, arch:, line_cache_size: nil, mmap: true, cache_dir: nil,
+//           cache_limit: nil, shared: false, index_threads: nil)
+//
+// index_threads: N splits the CU walk that builds the function table
+// between N native threads; by default it depends on the size of the DWARF.
+//
+// With shared: true the image comes from the process-wide registry (see
+// registry.h): if another Image already opened the same UUID and arch, this
+// one uses it too, and the other options are ignored.
+static VALUE image_initialize(int argc, VALUE *argv, VALUE self)
+{
+    struct image_handle_t *handle = get_handle(self);
+    struct image_call_t call = {
+        .image = &handle->image,
+        .options = ATOSL_IMAGE_OPTIONS_DEFAULT,
+        .interrupted = &handle->interrupted,
+    };
+    volatile VALUE arch_buffer = 0, path_buffer = 0, cache_dir_buffer = 0;
+    VALUE path, opts;
+    ID kw_ids[7];
+    VALUE kw_vals[7];
+    int busy;
+
+    rb_scan_args(argc, argv, "1:", &path, &opts);
+    kw_ids[0] = rb_intern("arch");
+    kw_ids[1] = rb_intern("line_cache_size");
+    kw_ids[2] = rb_intern("mmap");
+    kw_ids[3] = rb_intern("cache_dir");
+    kw_ids[4] = rb_intern("cache_limit");
+    kw_ids[5] = rb_intern("shared");
+    kw_ids[6] = rb_intern("index_threads");
+    rb_get_kwargs(opts, kw_ids, 1, 6, kw_vals);
+
+    if (kw_vals[1] != Qundef && !NIL_P(kw_vals[1]))
+        call.options.line_cache_size = NUM2SIZET(kw_vals[1]);
+    if (kw_vals[2] != Qundef)
+        call.options.use_mmap = RTEST(kw_vals[2]);
+    if (kw_vals[4] != Qundef && !NIL_P(kw_vals[4]))
+        call.options.cache_limit = NUM2ULL(kw_vals[4]);
+    if (kw_vals[6] != Qundef && !NIL_P(kw_vals[6])) {
+        call.options.index_threads = NUM2INT(kw_vals[6]);
+        if (call.options.index_threads < 1)
+            rb_raise(rb_eArgError, "index_threads must be positive");
+    }
+    call.options.interrupted = &handle->interrupted;
+
+    check_image_args(kw_vals[0], path);
+    if (kw_vals[3] != Qundef && !NIL_P(kw_vals[3]))
+        StringValueCStr(kw_vals[3]);
+
+    call.arch = cstr_copy(kw_vals[0], &arch_buffer);
+    call.path = cstr_copy(path, &path_buffer);
+    if (kw_vals[3] != Qundef && !NIL_P(kw_vals[3])) {
+        call.options.use_cache = 1;
+        call.options.cache_dir = cstr_copy(kw_vals[3], &cache_dir_buffer);
+    }
+
+    if (kw_vals[5] != Qundef && RTEST(kw_vals[5])) {
+        call.shared = &handle->shared;
+        busy = image_call(handle, &call, acquire_without_gvl, 0);
+    } else {
+        busy = image_call(handle, &call, open_without_gvl, 0);
+    }
+
+    rb_free_tmp_buffer(&arch_buffer);
+    rb_free_tmp_buffer(&path_buffer);
+    rb_free_tmp_buffer(&cache_dir_buffer);
+
+    if (busy)
+        rb_raise(rb_eRuntimeError, "image already initialized");
+    raise_if_failed(&call, path);
+
+    return self;
+}
+
+// Image#symbolicate(addresses, load_address: nil, threads: 1, inlines: false)
+// => Array, one result per address in input order. With threads: N, large
+// batches are split between up to N native threads. With inlines: true, a
+// result has a line per inlined frame, innermost first, as atos -i prints.
+static VALUE image_symbolicate(int argc, VALUE *argv, VALUE self)
+{
+    struct image_handle_t *handle = get_handle(self);
+    struct image_call_t call = { .nthreads = 1, .interrupted = &handle->interrupted };
+    volatile VALUE addresses_buffer = 0;
+    VALUE addresses, opts;
+    ID kw_ids[3];
+    VALUE kw_vals[3];
+    int closed;
+
+    rb_scan_args(argc, argv, "1:", &addresses, &opts);
+    kw_ids[0] = rb_intern("load_address");
+    kw_ids[1] = rb_intern("threads");
+    kw_ids[2] = rb_intern("inlines");
+    rb_get_kwargs(opts, kw_ids, 0, 3, kw_vals);
+
+    if (kw_vals[1] != Qundef && !NIL_P(kw_vals[1])) {
+        call.nthreads = NUM2INT(kw_vals[1]);
+        if (call.nthreads < 1)
+            rb_raise(rb_eArgError, "threads must be positive");
+    }
+    call.inlines = kw_vals[2] != Qundef && RTEST(kw_vals[2]);
+
+    if (!handle_open(handle))
+        rb_raise(rb_eIOError, "closed image");
+
+    call.load_address = load_address_value(kw_vals[0]);
+    call.addresses = addresses_from_array(addresses, &call.numofaddresses, &addresses_buffer);
+    call.results = ZALLOC_N(char *, call.numofaddresses);
+
+    closed = image_call(handle, &call, symbolicate_without_gvl, 1);
+
+    rb_free_tmp_buffer(&addresses_buffer);
 
-    // 3. Then get the architecture
+    VALUE array = results_to_array(call.results, call.numofaddresses);
+    xfree(call.results);
+    if (closed)
+        rb_raise(rb_eIOError, "closed image");
+    raise_if_failed(&call, Qnil);
+    return array;
+}
+
+// Atoslife.symbolicate_batch(arch, executable, load_address, addresses) =>
+// Array, one result per address in input order
+VALUE symbolicate_batch_wrapper(VALUE self, VALUE arch, VALUE executable, VALUE loadaddress, VALUE addresses){
+    return symbolicate_once(arch, executable, loadaddress, addresses);
+}
+
+static VALUE image_close_locked(VALUE ptr)
+{
+    struct image_handle_t *handle = (struct image_handle_t *)ptr;
+
+    handle_close(handle);
+    return Qnil;
+}
+
+static VALUE image_close(VALUE self)
+{
+    struct image_handle_t *handle = get_handle(self);
+
+    return rb_mutex_synchronize(handle->lock, image_close_locked, (VALUE)handle);
+}
+
+static VALUE image_closed_p(VALUE self)
+{
+    struct image_handle_t *handle = get_handle(self);
+
+    return handle_open(handle) ? Qfalse : Qtrue;
+}
+
+struct cache_call_t {
+    const char *cache_dir;
+    uint64_t limit;
+    struct cachedir_stats_t stats;
+    uint32_t evicted;
+};
+
+static void *cache_stats_without_gvl(void *ptr)
+{
+    struct cache_call_t *call = ptr;
+    char *dir = cachedir_path(call->cache_dir, 0);
+
+    cachedir_stats(dir, &call->stats);
+    free(dir);
+    return NULL;
+}
+
+static void *trim_cache_without_gvl(void *ptr)
+{
+    struct cache_call_t *call = ptr;
+    char *dir = cachedir_path(call->cache_dir, 0);
+
+    call->evicted = dir ? cachedir_trim(dir, call->limit) : 0;
+    free(dir);
+    return NULL;
+}
+
+// Atoslife.cache_stats(cache_dir = nil) => Hash with the :entries and :bytes
+// in the cache directory (~/.atosl-cache by default), and the :hits, :misses
+// and :evictions counted by this process so far.
+static VALUE cache_stats_wrapper(int argc, VALUE *argv, VALUE self)
+{
+    struct cache_call_t call = { NULL };
+    volatile VALUE cache_dir_buffer = 0;
+    VALUE cache_dir, stats;
+
+    rb_scan_args(argc, argv, "01", &cache_dir);
+    if (!NIL_P(cache_dir)) {
+        StringValueCStr(cache_dir);
+        call.cache_dir = cstr_copy(cache_dir, &cache_dir_buffer);
+    }
+
+    rb_thread_call_without_gvl(cache_stats_without_gvl, &call, NULL, NULL);
+    rb_free_tmp_buffer(&cache_dir_buffer);
+
+    stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(rb_intern("entries")), ULL2NUM(call.stats.entries));
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), ULL2NUM(call.stats.bytes));
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), ULL2NUM(call.stats.hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), ULL2NUM(call.stats.misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), ULL2NUM(call.stats.evictions));
+    return stats;
+}
+
+// Atoslife.trim_cache(cache_dir, max_bytes) => number of caches removed,
+// least recently used first, to bring cache_dir (nil for ~/.atosl-cache)
+// down to max_bytes. The most recently used cache is always kept.
+static VALUE trim_cache_wrapper(VALUE self, VALUE cache_dir, VALUE max_bytes)
+{
+    struct cache_call_t call = { NULL };
+    volatile VALUE cache_dir_buffer = 0;
+
+    call.limit = NUM2ULL(max_bytes);
+    if (!NIL_P(cache_dir)) {
+        StringValueCStr(cache_dir);
+        call.cache_dir = cstr_copy(cache_dir, &cache_dir_buffer);
+    }
+
+    rb_thread_call_without_gvl(trim_cache_without_gvl, &call, NULL, NULL);
+    rb_free_tmp_buffer(&cache_dir_buffer);
+
+    return UINT2NUM(call.evicted);
+}
+
+// Atoslife.registry_limit = bytes: memory budget of the shared images; the
+// least recently used ones no Image holds are closed to stay within it
+static VALUE registry_limit_set(VALUE self, VALUE limit)
+{
+    atosl_registry_set_limit(NUM2SIZET(limit));
+    return limit;
+}
+
+// Atoslife.registry_stats => Hash with the shared :entries, how many are
+// :in_use, their estimated :bytes and the :limit, and the :hits, :misses and
+// :evictions so far
+static VALUE registry_stats_wrapper(VALUE self)
+{
+    struct atosl_registry_stats_t stats;
+    VALUE hash = rb_hash_new();
+
+    atosl_registry_stats(&stats);
+    rb_hash_aset(hash, ID2SYM(rb_intern("entries")), UINT2NUM(stats.entries));
+    rb_hash_aset(hash, ID2SYM(rb_intern("in_use")), UINT2NUM(stats.in_use));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes")), SIZET2NUM(stats.bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("limit")), SIZET2NUM(stats.limit));
+    rb_hash_aset(hash, ID2SYM(rb_intern("hits")), ULL2NUM(stats.hits));
+    rb_hash_aset(hash, ID2SYM(rb_intern("misses")), ULL2NUM(stats.misses));
+    rb_hash_aset(hash, ID2SYM(rb_intern("evictions")), ULL2NUM(stats.evictions));
+    return hash;
+}
+
+struct prewarm_call_t {
+    const char **paths;
+    int npaths;
+    struct atosl_image_options_t options;
+    int nthreads;
+    struct atosl_prewarm_result_t *results;
+    int ret;
+};
+
+static void *prewarm_without_gvl(void *ptr)
+{
+    struct prewarm_call_t *call = ptr;
+
+    call->ret = atosl_prewarm(call->paths, call->npaths, &call->options, call->nthreads,
+                              &call->results);
+    return NULL;
+}
+
+static VALUE uuid_string(const uint8_t uuid[UUID_LEN])
+{
+    char str[UUID_LEN * 2 + 1];
+    int i;
+
+    for (i = 0; i < UUID_LEN; i++)
+        sprintf(str + i * 2, "%02x", uuid[i]);
+    return rb_str_new(str, UUID_LEN * 2);
+}
+
+// Atoslife.prewarm(paths, threads: nil, cache_dir: nil, cache_limit: nil)
+// => Array of Hashes, one per dSYM slice found in paths (files, or
+// directories walked recursively): its :path, :arch and :uuid, whether its
+// cache was :built, already :cached or :failed as :status, and the :seconds
+// it took. Caches are built on up to threads native threads, one per CPU by
+// default.
+static VALUE prewarm_wrapper(int argc, VALUE *argv, VALUE self)
+{
+    struct prewarm_call_t call = { .options = ATOSL_IMAGE_OPTIONS_DEFAULT };
+    volatile VALUE paths_buffer = 0, cache_dir_buffer = 0;
+    volatile int interrupted = 0;
+    VALUE paths, opts, results;
+    ID kw_ids[3];
+    VALUE kw_vals[3];
+    long i;
+
+    rb_scan_args(argc, argv, "1:", &paths, &opts);
+    kw_ids[0] = rb_intern("threads");
+    kw_ids[1] = rb_intern("cache_dir");
+    kw_ids[2] = rb_intern("cache_limit");
+    rb_get_kwargs(opts, kw_ids, 0, 3, kw_vals);
+
+    call.nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (kw_vals[0] != Qundef && !NIL_P(kw_vals[0])) {
+        call.nthreads = NUM2INT(kw_vals[0]);
+        if (call.nthreads < 1)
+            rb_raise(rb_eArgError, "threads must be positive");
+    }
+    if (kw_vals[2] != Qundef && !NIL_P(kw_vals[2]))
+        call.options.cache_limit = NUM2ULL(kw_vals[2]);
+    call.options.interrupted = &interrupted;
+
+    paths = rb_Array(paths);
+    for (i = 0; i < RARRAY_LEN(paths); i++)
+        StringValueCStr(RARRAY_PTR(paths)[i]);
+    if (kw_vals[1] != Qundef && !NIL_P(kw_vals[1])) {
+        StringValueCStr(kw_vals[1]);
+        call.options.cache_dir = cstr_copy(kw_vals[1], &cache_dir_buffer);
+    }
+
+    // Copied, since the walk runs without the GVL
+    call.npaths = (int)RARRAY_LEN(paths);
+    call.paths = rb_alloc_tmp_buffer(&paths_buffer, sizeof(char *) * (call.npaths + 1));
+    for (i = 0; i < call.npaths; i++) {
+        call.paths[i] = strdup(RSTRING_PTR(RARRAY_PTR(paths)[i]));
+        if (!call.paths[i])
+            rb_memerror();
+    }
+
+    rb_thread_call_without_gvl(prewarm_without_gvl, &call, interrupt_call, (void *)&interrupted);
+
+    for (i = 0; i < call.npaths; i++)
+        free((char *)call.paths[i]);
+    rb_free_tmp_buffer(&paths_buffer);
+    rb_free_tmp_buffer(&cache_dir_buffer);
+
+    if (call.ret < 0) {
+        rb_thread_check_ints();
+        rb_raise(rb_eInterrupt, "prewarm interrupted");
+    }
+
+    results = rb_ary_new2(call.ret);
+    for (i = 0; i < call.ret; i++) {
+        const struct atosl_prewarm_result_t *result = &call.results[i];
+        VALUE hash = rb_hash_new();
+
+        rb_hash_aset(hash, ID2SYM(rb_intern("path")), rb_str_new2(result->path));
+        rb_hash_aset(hash, ID2SYM(rb_intern("arch")), rb_str_new2(result->slice.arch));
+        rb_hash_aset(hash, ID2SYM(rb_intern("uuid")), uuid_string(result->slice.uuid));
+        rb_hash_aset(hash, ID2SYM(rb_intern("status")),
+                     ID2SYM(rb_intern(result->status == ATOSL_PREWARM_BUILT ? "built" :
+                                      result->status == ATOSL_PREWARM_CACHED ? "cached" :
+                                                                               "failed")));
+        rb_hash_aset(hash, ID2SYM(rb_intern("seconds")), DBL2NUM(result->seconds));
+        rb_ary_push(results, hash);
+    }
+    atosl_prewarm_free(call.results, call.ret);
+
+    return results;
+}
+
+void Init_atoslife(){
+    Atoslife = rb_define_module("Atoslife");
+    rb_define_singleton_method(Atoslife, "symbolicate", symbolicate_wrapper, 4);
+    rb_define_singleton_method(Atoslife, "symbolicate_batch", symbolicate_batch_wrapper, 4);
+    rb_define_singleton_method(Atoslife, "cache_stats", cache_stats_wrapper, -1);
+    rb_define_singleton_method(Atoslife, "trim_cache", trim_cache_wrapper, 2);
+    rb_define_singleton_method(Atoslife, "registry_limit=", registry_limit_set, 1);
+    rb_define_singleton_method(Atoslife, "registry_stats", registry_stats_wrapper, 0);
+    rb_define_singleton_method(Atoslife, "prewarm", prewarm_wrapper, -1);
+
+    AtoslifeImage = rb_define_class_under(Atoslife, "Image", rb_cObject);
+    rb_define_alloc_func(AtoslifeImage, image_alloc);
+    rb_define_method(AtoslifeImage, "initialize", image_initialize, -1);
+    rb_define_method(AtoslifeImage, "symbolicate", image_symbolicate, -1);
+    rb_define_method(AtoslifeImage, "close", image_close, 0);
+    rb_define_method(AtoslifeImage, "closed?", image_closed_p, 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////
+// main                                                                             //
+//////////////////////////////////////////////////////////////////////////////////////
+
+static int arch_type(const char *arch, cpu_type_t *cpu_type, cpu_subtype_t *cpu_subtype)
+{
+    int i;
 
     for (i = 0; i < NUMOF(arch_str_to_type); i++) {
         if (strcmp(arch_str_to_type[i].name, arch) == 0) {
-            cpu_type = arch_str_to_type[i].type;
-            cpu_subtype = arch_str_to_type[i].subtype;
+            *cpu_type = arch_str_to_type[i].type;
+            *cpu_subtype = arch_str_to_type[i].subtype;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const char *arch_name(cpu_type_t cpu_type, cpu_subtype_t cpu_subtype)
+{
+    int i;
+
+    for (i = 0; i < NUMOF(arch_str_to_type); i++) {
+        if (arch_str_to_type[i].type == cpu_type && arch_str_to_type[i].subtype == cpu_subtype)
+            return arch_str_to_type[i].name;
+    }
+    return NULL;
+}
+
+/* Fill in slice from the Mach-O header at offset in fd and the load
+ * commands after it. Returns -1 if there is no header there, or no UUID. */
+static int read_slice(int fd, off_t offset, struct atosl_slice_t *slice)
+{
+    struct mach_header_t header;
+    uint32_t magic;
+    char *commands;
+    uint32_t pos;
+    int found = -1;
+    int i;
+
+    if (_pread(fd, &magic, sizeof(magic), offset) != sizeof(magic) ||
+        (magic != MH_MAGIC && magic != MH_MAGIC_64) ||
+        _pread(fd, &header, sizeof(header), offset + sizeof(magic)) != sizeof(header))
+        return -1;
+
+    slice->arch = arch_name(header.cputype, header.cpusubtype);
+    slice->cputype = header.cputype;
+    slice->cpusubtype = header.cpusubtype;
+    slice->has_dwarf = 0;
+
+    /* Skip the reserved field of mach_header_64 */
+    offset += sizeof(magic) + sizeof(header) + (magic == MH_MAGIC_64 ? sizeof(uint32_t) : 0);
+    commands = malloc(header.sizeofcmds ? header.sizeofcmds : 1);
+    if (!commands)
+        fatal("unable to allocate memory");
+    if (_pread(fd, commands, header.sizeofcmds, offset) != header.sizeofcmds) {
+        free(commands);
+        return -1;
+    }
+
+    for (i = 0, pos = 0; i < header.ncmds &&
+                         pos + sizeof(struct load_command_t) <= header.sizeofcmds; i++) {
+        struct load_command_t *command = (struct load_command_t *)(commands + pos);
+        const char *data = commands + pos + sizeof(*command);
+
+        if (command->cmdsize < sizeof(*command) || command->cmdsize > header.sizeofcmds - pos)
             break;
+        if (command->cmd == LC_UUID && command->cmdsize >= sizeof(*command) + UUID_LEN) {
+            memcpy(slice->uuid, data, UUID_LEN);
+            found = 0;
+        } else if ((command->cmd == LC_SEGMENT || command->cmd == LC_SEGMENT_64) &&
+                   command->cmdsize >= sizeof(*command) + 16 &&
+                   strncmp(data, "__DWARF", 16) == 0) {
+            slice->has_dwarf = 1;
         }
+        pos += command->cmdsize;
     }
-    if ((cpu_type < 0) && (cpu_subtype < 0))
-        fatal("unsupported architecture `%s'", arch);
-    options.cpu_type = cpu_type;
-    options.cpu_subtype = cpu_subtype;
 
-    // 4. And then do all the magical stuff
+    free(commands);
+    return found;
+}
 
-    if (!options.dsym_filename)
-        fatal("no filename specified with -o");
+int atosl_image_slices(const char *filename, struct atosl_slice_t slices[], int max)
+{
+    struct fat_arch_t fat_arch;
+    uint32_t magic, nfat_arch;
+    int count = 0;
+    int fd;
+    int i;
 
-    fd = open(options.dsym_filename, O_RDONLY);
+    fd = open(filename, O_RDONLY);
     if (fd < 0)
-        fatal("unable to open `%s': %s",
-              options.dsym_filename,
-              strerror(errno));
+        return 0;
+
+    if (_pread(fd, &magic, sizeof(magic), 0) != sizeof(magic))
+        goto out;
+
+    if (magic != FAT_CIGAM) {
+        if (max > 0 && read_slice(fd, 0, &slices[0]) == 0 && slices[0].arch)
+            count = 1;
+        goto out;
+    }
+
+    if (_pread(fd, &nfat_arch, sizeof(nfat_arch), sizeof(magic)) != sizeof(nfat_arch))
+        goto out;
+    nfat_arch = ntohl(nfat_arch);
+    for (i = 0; i < nfat_arch && count < max; i++) {
+        if (_pread(fd, &fat_arch, sizeof(fat_arch),
+                   sizeof(magic) + sizeof(nfat_arch) + i * sizeof(fat_arch)) != sizeof(fat_arch))
+            break;
+        /* Java class files share the fat magic, and fail here */
+        if (read_slice(fd, ntohl(fat_arch.offset), &slices[count]) < 0)
+            continue;
+        /* Matched against the fat header, as atosl_image_open() does */
+        slices[count].cputype = ntohl(fat_arch.cputype);
+        slices[count].cpusubtype = ntohl(fat_arch.cpusubtype);
+        slices[count].arch = arch_name(slices[count].cputype, slices[count].cpusubtype);
+        if (slices[count].arch)
+            count++;
+    }
+
+out:
+    close(fd);
+    return count;
+}
+
+int atosl_image_uuid(const char *arch, const char *filename, uint8_t uuid[UUID_LEN],
+                     int32_t *cputype, int32_t *cpusubtype)
+{
+    struct atosl_slice_t slices[ATOSL_MAX_SLICES];
+    cpu_type_t cpu_type;
+    cpu_subtype_t cpu_subtype;
+    int count;
+    int i;
+
+    if (arch_type(arch, &cpu_type, &cpu_subtype) < 0)
+        return -1;
+    *cputype = cpu_type;
+    *cpusubtype = cpu_subtype;
+
+    count = atosl_image_slices(filename, slices, ATOSL_MAX_SLICES);
+    for (i = 0; i < count; i++) {
+        if (slices[i].cputype == cpu_type && slices[i].cpusubtype == cpu_subtype) {
+            memcpy(uuid, slices[i].uuid, UUID_LEN);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t atosl_image_memsize(const struct atosl_image_t *image)
+{
+    const struct atosl_context_t *context = &image->context;
+    const struct dwarf_subprograms_t *subprograms = context->subprograms;
+    size_t size = sizeof(*image);
+    Dwarf_Unsigned i;
+
+    if (subprograms) {
+        if (subprograms->map)
+            size += subprograms->map_size;
+        else
+            size += (sizeof(Dwarf_Addr) * 2 + sizeof(uint32_t) * 3 + sizeof(int32_t)) *
+                    (size_t)subprograms->count + subprograms->strings_size;
+    }
+    if (context->aranges)
+        size += (sizeof(Dwarf_Addr) * 2 + sizeof(Dwarf_Off)) * (size_t)context->aranges->count;
+    if (context->lines) {
+        pthread_mutex_lock(&context->lines->lock);
+        size += context->lines->memsize;
+        pthread_mutex_unlock(&context->lines->lock);
+    }
+    /* Otherwise part of the cache mapping */
+    if (context->linetab && context->linetab->owned)
+        size += context->linetab->size;
+    if (context->symtab)
+        size += (sizeof(Dwarf_Addr) + sizeof(uint32_t)) * (size_t)context->symtab->count +
+                (sizeof(Dwarf_Addr) * 2 + sizeof(uint32_t)) * (size_t)context->symtab->nfuns;
+    size += sizeof(struct symbol_t) * (size_t)context->nsymbols;
+
+    /* DWARF sections read into buffers of their own, rather than mapped */
+    if (image->binary_interface) {
+        const dwarf_mach_object_access_internals_t *obj = image->binary_interface->object;
+
+        for (i = 0; i < obj->section_count; i++) {
+            if (obj->sections[i].data)
+                size += obj->sections[i].size;
+        }
+    }
+
+    return size;
+}
+
+static int compare_addrs(const void *a, const void *b)
+{
+    Dwarf_Addr addr_a = *(const Dwarf_Addr *)a;
+    Dwarf_Addr addr_b = *(const Dwarf_Addr *)b;
+
+    if (addr_a == addr_b)
+        return 0;
+    return addr_a < addr_b ? -1 : 1;
+}
+
+/* The addresses of the options in the file, sorted, as
+ * atosl_image_symbolicate() will look them up; NULL if any of them doesn't
+ * parse, which it will complain about */
+static Dwarf_Addr *file_addresses(const struct atosl_context_t *context,
+                                  const struct atosl_image_options_t *options)
+{
+    Dwarf_Addr load_address = options->load_address;
+    Dwarf_Addr slide;
+    Dwarf_Addr *addrs;
+    int i;
+
+    if (load_address == LONG_MAX)
+        load_address = context->intended_addr;
+    slide = load_address - context->intended_addr;
+
+    addrs = malloc(sizeof(*addrs) * (options->naddresses ? options->naddresses : 1));
+    if (!addrs)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < options->naddresses; i++) {
+        errno = 0;
+        addrs[i] = strtol(options->addresses[i], (char **)NULL, 16) - slide;
+        if (errno != 0) {
+            free(addrs);
+            return NULL;
+        }
+    }
+
+    qsort(addrs, options->naddresses, sizeof(*addrs), compare_addrs);
+
+    return addrs;
+}
+
+int atosl_image_open(struct atosl_image_t *image, const char *arch, const char *filename,
+                     const struct atosl_image_options_t *image_options)
+{
+    static const struct atosl_image_options_t default_options = ATOSL_IMAGE_OPTIONS_DEFAULT;
+    int fd;
+    int ret;
+    int i;
+    Dwarf_Error err;
+    int derr = 0;
+    int found = 0;
+    uint32_t magic;
+    cpu_type_t cpu_type = -1;
+    cpu_subtype_t cpu_subtype = -1;
+    struct atosl_context_t *context = &image->context;
+
+    memset(image, 0, sizeof(*image));
+    image->fd = -1;
+    image->options = image_options ? *image_options : default_options;
+
+    /* Whatever a caller may have got wrong is reported, not fatal */
+    if (arch_type(arch, &cpu_type, &cpu_subtype) < 0) {
+        warning("unsupported architecture `%s'", arch);
+        return -1;
+    }
+
+    if (!filename) {
+        warning("no filename specified");
+        return -1;
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        warning("unable to open `%s': %s", filename, strerror(errno));
+        return -1;
+    }
+
+    image->fd = fd;
+    image->filename = strdup(filename);
+    if (!image->filename)
+        fatal("unable to allocate memory");
+    image->image_name = path_basename(image->filename);
 
     ret = _read(fd, &magic, sizeof(magic));
-    if (ret < 0)
-        fatal_file(fd);
+    if (ret != (int)sizeof(magic))
+        goto invalid;
 
     if (magic == FAT_CIGAM) {
         /* Find the architecture we want.. */
         uint32_t nfat_arch;
 
         ret = _read(fd, &nfat_arch, sizeof(nfat_arch));
-        if (ret < 0)
-            fatal_file(fd);
+        if (ret != (int)sizeof(nfat_arch))
+            goto invalid;
 
         nfat_arch = ntohl(nfat_arch);
         for (i = 0; i < nfat_arch; i++) {
-            ret = _read(fd, &context.arch, sizeof(context.arch));
-            if (ret < 0)
-                fatal("unable to read arch struct");
+            ret = _read(fd, &context->arch, sizeof(context->arch));
+            if (ret != (int)sizeof(context->arch))
+                goto invalid;
 
-            context.arch.cputype = ntohl(context.arch.cputype);
-            context.arch.cpusubtype = ntohl(context.arch.cpusubtype);
-            context.arch.offset = ntohl(context.arch.offset);
+            context->arch.cputype = ntohl(context->arch.cputype);
+            context->arch.cpusubtype = ntohl(context->arch.cpusubtype);
+            context->arch.offset = ntohl(context->arch.offset);
 
-            if ((context.arch.cputype == options.cpu_type) &&
-                (context.arch.cpusubtype == options.cpu_subtype)) {
+            if ((context->arch.cputype == cpu_type) &&
+                (context->arch.cpusubtype == cpu_subtype)) {
                 /* good! */
-                ret = lseek(fd, context.arch.offset, SEEK_SET);
+                ret = lseek(fd, context->arch.offset, SEEK_SET);
                 if (ret < 0)
-                    fatal("unable to seek to arch (offset=%ld): %s",
-                          context.arch.offset, strerror(errno));
+                    goto invalid;
 
                 ret = _read(fd, &magic, sizeof(magic));
-                if (ret < 0)
-                    fatal_file(fd);
+                if (ret != (int)sizeof(magic))
+                    goto invalid;
 
                 found = 1;
                 break;
@@ -1346,7 +2184,7 @@ int symbolicate(const char* arch, const char *executable, const char *loadAddres
                 /* skip */
                 if (debug) {
                     fprintf(stderr, "Skipping arch: %x %x\n",
-                            context.arch.cputype, context.arch.cpusubtype);
+                            context->arch.cputype, context->arch.cpusubtype);
                 }
             }
         }
@@ -1354,84 +2192,338 @@ int symbolicate(const char* arch, const char *executable, const char *loadAddres
         found = 1;
     }
 
-    if (!found)
-        fatal("no valid architectures found");
+    if (!found) {
+        warning("no %s slice in `%s'", arch, filename);
+        atosl_image_close(image);
+        return -1;
+    }
 
     if (magic != MH_MAGIC && magic != MH_MAGIC_64)
-      fatal("invalid magic for architecture");
-
-    dwarf_mach_object_access_init(fd, &binary_interface, &derr);
-    assert(binary_interface);
-
-    if (options.load_address == LONG_MAX)
-        options.load_address = context.intended_addr;
-
-    ret = dwarf_object_init(binary_interface,
-                            dwarf_error_handler,
-                            errarg, &dbg, &err);
-    DWARF_ASSERT(ret, err);
+        goto invalid;
+
+    if (dwarf_mach_object_access_init(fd, context, image->options.use_mmap,
+                                      &image->binary_interface, &derr) != DW_DLV_OK)
+        goto invalid;
+
+    /* No handler: every call passes its own error, to be reported rather
+     * than fatal */
+    ret = dwarf_object_init(image->binary_interface, NULL, NULL, &image->dbg, &err);
+    if (ret == DW_DLV_ERROR) {
+        warning("dwarf_errmsg: %s", dwarf_errmsg(err));
+        image->dbg = NULL;
+        goto invalid;
+    }
+    if (ret != DW_DLV_OK)
+        image->dbg = NULL;
 
     /* If there is dwarf info we'll use that to parse, otherwise we'll use the
      * symbol table */
-    if (context.is_dwarf && ret == DW_DLV_OK) {
-
+    if (context->is_dwarf && image->dbg) {
         struct subprograms_options_t opts = {
-            .persistent = options.use_cache,
-            .cache_dir = options.cache_dir,
+            .persistent = image->options.use_cache,
+            .cache_dir = image->options.cache_dir,
+            .cache_limit = image->options.cache_limit,
+            .cputype = cpu_type,
+            .cpusubtype = cpu_subtype,
+            .object = image->binary_interface,
+            .nthreads = image->options.index_threads,
+            .interrupted = image->options.interrupted,
         };
+        Dwarf_Addr *addrs = NULL;
 
-        context.subprograms =
-            subprograms_load(dbg,
-                             context.uuid,
-                             options.use_globals ? SUBPROGRAMS_GLOBALS :
-                                                   SUBPROGRAMS_CUS,
-                             &opts);
-
-        for (i = 0; i < numofaddresses; i++) {
-            Dwarf_Addr addr;
-            errno = 0;
-            addr = strtol(addresses[i], (char **)NULL, 16);
-            if (errno != 0)
-                fatal("invalid address: `%s': %s", addresses[i], strerror(errno));
-            ret = print_dwarf_symbol(dbg,
-                                 options.load_address - context.intended_addr,
-                                 addr);
+        if (image->options.addresses && !opts.persistent)
+            addrs = file_addresses(context, &image->options);
+        if (addrs) {
+            opts.addresses = addrs;
+            opts.naddresses = image->options.naddresses;
+        }
+
+        context->subprograms =
+            subprograms_load(image->dbg,
+                             context->uuid,
+                             image->options.use_globals ? SUBPROGRAMS_GLOBALS :
+                                                          SUBPROGRAMS_CUS,
+                             &opts,
+                             opts.persistent && image->options.cache_lines ?
+                                 &context->linetab : NULL);
+        free(addrs);
+        if (!context->subprograms) {
+            atosl_image_close(image);
+            return -1;
+        }
+        if (!context->linetab) {
+            context->aranges = aranges_load(image->dbg);
+            context->lines = linecache_create(image->dbg, image->options.line_cache_size);
+        }
+    } else {
+        context->symtab = symtab_index_build(context);
+    }
+
+    return 0;
+
+invalid:
+    warning("`%s' is not a valid Mach-O file", filename);
+    atosl_image_close(image);
+    return -1;
+}
+
+struct address_lookup_t {
+    Dwarf_Addr addr;
+    int index;
+};
+
+static int compare_lookups(const void *a, const void *b)
+{
+    const struct address_lookup_t *lookup_a = a;
+    const struct address_lookup_t *lookup_b = b;
+
+    if (lookup_a->addr != lookup_b->addr)
+        return lookup_a->addr < lookup_b->addr ? -1 : 1;
+    return lookup_a->index - lookup_b->index;
+}
+
+/* A contiguous run of the sorted lookups, resolved by one thread */
+struct symbolicate_shard_t {
+    const struct atosl_image_t *image;
+    Dwarf_Addr slide;
+    const struct address_lookup_t *lookups;
+    int count;
+    char **addresses;
+    char **results;
+    int inlines;
+    const volatile int *interrupted;
+    /* Lookups resolved; less than count if interrupted */
+    int done;
+};
+
+static void *symbolicate_shard(void *ptr)
+{
+    struct symbolicate_shard_t *shard = ptr;
+    const struct atosl_image_t *image = shard->image;
+    const struct atosl_context_t *context = &image->context;
+    const struct address_lookup_t *lookups = shard->lookups;
+    struct dwarf_sweep_t sweep;
+    char result[ATOSLIFE_SIZE * ATOSLIFE_INLINE_FRAMES];
+    int ret;
+    int i;
+    int derr = 0;
+
+    if (context->is_dwarf && image->dbg) {
+        dwarf_sweep_init(&sweep);
+
+        for (i = 0; i < shard->count && !(shard->interrupted && *shard->interrupted); i++) {
+            Dwarf_Addr addr = lookups[i].addr;
+
+            result[0] = '\0';
+            ret = print_dwarf_symbol(image, &sweep, shard->slide, addr, shard->inlines, result);
             if (ret != DW_DLV_OK) {
-                derr = print_subprogram_symbol(
-                         options.load_address - context.intended_addr, addr);
+                derr = print_subprogram_symbol(image, &sweep, shard->slide, addr, result);
             }
 
             if ((ret != DW_DLV_OK) && derr) {
                 // printf("%s\n", addresses[i]);
-                snprintf(atoslifeResult, ATOSLIFE_SIZE, "%s\n", addresses[i]);
-                logDebugInfo();
+                snprintf(result, ATOSLIFE_SIZE, "%s\n", shard->addresses[lookups[i].index]);
+                logDebugInfo(result);
             }
-        }
 
-        dwarf_mach_object_access_finish(binary_interface);
+            shard->results[lookups[i].index] = strdup(result);
+        }
 
-        ret = dwarf_object_finish(dbg, &err);
-        DWARF_ASSERT(ret, err);
+        linecache_release(context->lines, sweep.lines);
     } else {
-        for (i = 0; i < numofaddresses; i++) {
-            Dwarf_Addr addr;
-            errno = 0;
-            addr = strtol(addresses[i], (char **)NULL, 16);
-            if (errno != 0)
-                fatal("invalid address address: `%s': %s", addresses[i], strerror(errno));
-            ret = find_and_print_symtab_symbol(
-                    options.load_address - context.intended_addr,
-                    addr);
+        for (i = 0; i < shard->count && !(shard->interrupted && *shard->interrupted); i++) {
+            Dwarf_Addr addr = lookups[i].addr;
+
+            result[0] = '\0';
+            ret = find_and_print_symtab_symbol(image, shard->slide, addr, result);
 
             if (ret != DW_DLV_OK) {
                 // printf("%s\n", addresses[i]);
-                snprintf(atoslifeResult, ATOSLIFE_SIZE, "%s\n", addresses[i]);
-                logDebugInfo();
+                snprintf(result, ATOSLIFE_SIZE, "%s\n", shard->addresses[lookups[i].index]);
+                logDebugInfo(result);
             }
+
+            shard->results[lookups[i].index] = strdup(result);
         }
     }
 
-    close(fd);
+    shard->done = i;
+
+    return NULL;
+}
+
+/* Resolve every address in `addresses` and store a malloc'd result string
+ * for addresses[i] in results[i]. The addresses are resolved in ascending
+ * order so that the lookups can share state (see struct dwarf_sweep_t), but
+ * the results come back in input order. */
+int atosl_image_symbolicate(struct atosl_image_t *image, Dwarf_Addr load_address,
+                            char *addresses[], int numofaddresses, char *results[])
+{
+    return atosl_image_symbolicate_parallel(image, load_address, addresses, numofaddresses,
+                                            results, 1, 0, NULL);
+}
+
+int atosl_image_symbolicate_parallel(struct atosl_image_t *image, Dwarf_Addr load_address,
+                                     char *addresses[], int numofaddresses, char *results[],
+                                     int nthreads, int inlines, const volatile int *interrupted)
+{
+    int ret = 0;
+    int i;
+    struct atosl_context_t *context = &image->context;
+    struct address_lookup_t *lookups;
+    struct symbolicate_shard_t *shards;
+    pthread_t *threads;
+    Dwarf_Addr slide;
+
+    if (!interrupted)
+        interrupted = image->options.interrupted;
+
+    if (load_address == LONG_MAX)
+        load_address = context->intended_addr;
+    slide = load_address - context->intended_addr;
+
+    lookups = malloc(sizeof(*lookups) * (numofaddresses ? numofaddresses : 1));
+    if (!lookups)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < numofaddresses; i++) {
+        errno = 0;
+        lookups[i].addr = strtol(addresses[i], (char **)NULL, 16);
+        if (errno != 0)
+            fatal("invalid address: `%s': %s", addresses[i], strerror(errno));
+        lookups[i].index = i;
+    }
+
+    qsort(lookups, numofaddresses, sizeof(*lookups), compare_lookups);
+
+    /* Every thread starts its sweep from scratch, so small shards aren't
+     * worth one */
+    if (nthreads > (numofaddresses + ATOSL_MIN_SHARD_SIZE - 1) / ATOSL_MIN_SHARD_SIZE)
+        nthreads = (numofaddresses + ATOSL_MIN_SHARD_SIZE - 1) / ATOSL_MIN_SHARD_SIZE;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    shards = malloc(sizeof(*shards) * nthreads);
+    threads = malloc(sizeof(*threads) * nthreads);
+    if (!shards || !threads)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < nthreads; i++) {
+        int begin = (int)((int64_t)numofaddresses * i / nthreads);
+        int end = (int)((int64_t)numofaddresses * (i + 1) / nthreads);
+
+        shards[i].image = image;
+        shards[i].slide = slide;
+        shards[i].lookups = lookups + begin;
+        shards[i].count = end - begin;
+        shards[i].addresses = addresses;
+        shards[i].results = results;
+        shards[i].inlines = inlines;
+        shards[i].interrupted = interrupted;
+        shards[i].done = 0;
+    }
+
+    /* The calling thread takes the first shard itself */
+    for (i = 1; i < nthreads; i++) {
+        int err = pthread_create(&threads[i], NULL, symbolicate_shard, &shards[i]);
+        if (err != 0)
+            fatal("unable to create thread: %s", strerror(err));
+    }
+    symbolicate_shard(&shards[0]);
+
+    for (i = 0; i < nthreads; i++) {
+        if (i > 0)
+            pthread_join(threads[i], NULL);
+        /* Interrupted before every address was resolved */
+        if (shards[i].done < shards[i].count)
+            ret = -1;
+    }
+
+    free(threads);
+    free(shards);
+    free(lookups);
+
+    return ret;
+}
+
+void atosl_image_close(struct atosl_image_t *image)
+{
+    int ret;
+    Dwarf_Error err;
+    struct atosl_context_t *context = &image->context;
+
+    /* Before subprograms, whose cache mapping it may point into */
+    linetab_free(context->linetab);
+    context->linetab = NULL;
+    subprograms_free(context->subprograms);
+    context->subprograms = NULL;
+    aranges_free(context->aranges);
+    context->aranges = NULL;
+    linecache_free(context->lines);
+    context->lines = NULL;
+    symtab_index_free(context->symtab);
+    context->symtab = NULL;
+
+    if (image->dbg) {
+        ret = dwarf_object_finish(image->dbg, &err);
+        if (ret == DW_DLV_ERROR)
+            warning("dwarf_errmsg: %s", dwarf_errmsg(err));
+        image->dbg = NULL;
+    }
+
+    dwarf_mach_object_access_finish(image->binary_interface);
+    image->binary_interface = NULL;
+
+    free(context->symlist);
+    context->symlist = NULL;
+    free(context->strtable);
+    context->strtable = NULL;
+
+    free(image->filename);
+    image->filename = NULL;
+
+    if (image->fd >= 0) {
+        close(image->fd);
+        image->fd = -1;
+    }
+}
+
+/* Resolve addresses and copy the result for the last one into result,
+ * which holds ATOSLIFE_SIZE bytes */
+int symbolicate(const char* arch, const char *executable, const char *loadAddress, char *addresses[], int numofaddresses,
+                char *result) {
+    struct atosl_image_t image;
+    struct atosl_image_options_t options = ATOSL_IMAGE_OPTIONS_DEFAULT;
+    Dwarf_Addr address;
+    char **results;
+    int i;
+
+    errno = 0;
+    address = strtol(loadAddress, (char **)NULL, 16);
+    if (errno != 0)
+        fatal("invalid load address: `%s': %s (error code %d)", loadAddress, strerror(errno), errno);
+
+    results = calloc(numofaddresses ? numofaddresses : 1, sizeof(char *));
+    if (!results)
+        fatal("unable to allocate memory");
+
+    options.addresses = addresses;
+    options.naddresses = numofaddresses;
+    options.load_address = address;
+
+    if (atosl_image_open(&image, arch, executable, &options) < 0)
+        fatal("unable to open `%s'", executable);
+    atosl_image_symbolicate(&image, address, addresses, numofaddresses, results);
+    atosl_image_close(&image);
+
+    /* Callers of this entry point only ever see the last result */
+    for (i = 0; i < numofaddresses; i++) {
+        if (i == numofaddresses - 1)
+            snprintf(result, ATOSLIFE_SIZE, "%s", results[i]);
+        free(results[i]);
+    }
+    free(results);
+
     return 0;
 }
 
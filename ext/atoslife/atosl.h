@@ -11,6 +11,16 @@
 #ifndef ATOSL_
 #define ATOSL_
 
+#include <limits.h>
+#include <stdint.h>
+
+#include <libdwarf.h>
+
+#include "common.h"
+#include "nlist.h"
+#include "linecache.h"
+#include "linetab.h"
+
 #define MH_MAGIC 0xfeedface
 #define MH_MAGIC_64 0xfeedfacf
 
@@ -174,4 +184,149 @@ struct nlist_t
 //     uint64_t n_value;
 // };
 
+typedef int dwarf_mach_handle;
+
+struct symbol_t {
+    Dwarf_Addr addr;
+    /* Offset into strtable, 0 if the symbol has no name */
+    uint32_t name;
+    uint8_t type;
+    uint8_t thumb:1;
+};
+
+/* Everything we learn about a single Mach-O slice while parsing it */
+struct atosl_context_t {
+    /* Symbols from symtab */
+    struct symbol_t *symlist;
+    uint32_t nsymbols;
+    char *strtable;
+    struct dwarf_subprograms_t *subprograms;
+    struct dwarf_aranges_t *aranges;
+    struct dwarf_linecache_t *lines;
+    /* Replaces aranges and lines when the line table came from the cache */
+    struct dwarf_linetab_t *linetab;
+    struct symtab_index_t *symtab;
+
+    Dwarf_Addr intended_addr;
+    Dwarf_Addr linkedit_addr;
+
+    struct fat_arch_t arch;
+
+    uint8_t uuid[UUID_LEN];
+    uint8_t is_64;
+    uint8_t is_dwarf;
+};
+
+/* Per-image settings for atosl_image_open(); NULL picks the defaults */
+struct atosl_image_options_t {
+    /* Map the file read-only and hand libdwarf pointers into the mapping
+     * instead of reading every DWARF section into its own buffer */
+    int use_mmap;
+    /* Memory limit for decoded line tables, see linecache.h */
+    size_t line_cache_size;
+    /* Demangle C++ and Swift names in the output */
+    int should_demangle;
+    /* Keep the subprogram table in cache_dir between runs */
+    int use_cache;
+    const char *cache_dir;
+    /* Size limit of cache_dir in bytes, 0 for none */
+    uint64_t cache_limit;
+    /* Keep the line table of the image in the cache too, so that a warm
+     * cache needs none of the DWARF sections to symbolicate */
+    int cache_lines;
+    /* Build the subprogram table from .debug_pubnames instead of walking
+     * every CU */
+    int use_globals;
+    /* Threads walking the CUs, 0 for as many as the size of the DWARF
+     * makes worth it, see subprograms.h */
+    int index_threads;
+    /* The addresses the image is opened to look up, when they are known up
+     * front, as they will be passed to atosl_image_symbolicate() along with
+     * load_address: CUs that hold none of them are left out of the function
+     * table. Only read by atosl_image_open(), and ignored with use_cache,
+     * since a cache has to hold every function. */
+    char **addresses;
+    int naddresses;
+    Dwarf_Addr load_address;
+    /* When set, atosl_image_open() and atosl_image_symbolicate() give up
+     * and return -1 once *interrupted becomes non-zero, which may happen on
+     * another thread. An interrupted open leaves the image closed; results
+     * already stored by an interrupted symbolicate are the caller's. */
+    const volatile int *interrupted;
+};
+
+#define ATOSL_IMAGE_OPTIONS_DEFAULT { \
+    .use_mmap = 1, \
+    .line_cache_size = LINECACHE_DEFAULT_LIMIT, \
+    .should_demangle = 1, \
+    .use_cache = 0, \
+    .cache_dir = NULL, \
+    .cache_limit = 0, \
+    .cache_lines = 1, \
+    .use_globals = 0, \
+    .index_threads = 0, \
+    .addresses = NULL, \
+    .naddresses = 0, \
+    .load_address = LONG_MAX, \
+    .interrupted = NULL, \
+}
+
+/* A parsed dSYM/executable slice. Owns the file descriptor, the libdwarf
+ * state and the subprogram index so that a single parse can serve any
+ * number of lookups. */
+struct atosl_image_t {
+    int fd;
+    char *filename;
+    /* Last path component of filename, for symtab results */
+    const char *image_name;
+    struct atosl_image_options_t options;
+    Dwarf_Debug dbg;
+    Dwarf_Obj_Access_Interface *binary_interface;
+    struct atosl_context_t context;
+};
+
+int atosl_image_open(struct atosl_image_t *image, const char *arch, const char *filename,
+                     const struct atosl_image_options_t *image_options);
+int atosl_image_symbolicate(struct atosl_image_t *image, Dwarf_Addr load_address,
+                            char *addresses[], int numofaddresses, char *results[]);
+
+/* Like atosl_image_symbolicate(), with the sorted addresses split into up to
+ * nthreads contiguous shards of at least ATOSL_MIN_SHARD_SIZE addresses,
+ * each resolved by its own thread against the shared indexes of image.
+ * With inlines, a result has a line per inlined frame, innermost first,
+ * followed by the function they were inlined into, as atos -i prints them.
+ * interrupted, when not NULL, is checked instead of the image's own
+ * options.interrupted, for images with more than one user. */
+#define ATOSL_MIN_SHARD_SIZE 1024
+int atosl_image_symbolicate_parallel(struct atosl_image_t *image, Dwarf_Addr load_address,
+                                     char *addresses[], int numofaddresses, char *results[],
+                                     int nthreads, int inlines, const volatile int *interrupted);
+void atosl_image_close(struct atosl_image_t *image);
+
+/* A slice of a Mach-O file, as found by atosl_image_slices() */
+#define ATOSL_MAX_SLICES 16
+struct atosl_slice_t {
+    /* Name to pass to atosl_image_open() */
+    const char *arch;
+    uint8_t uuid[UUID_LEN];
+    int32_t cputype;
+    int32_t cpusubtype;
+    /* Has a __DWARF segment, as a dSYM does */
+    int has_dwarf;
+};
+
+/* Store up to max slices of filename that have a UUID and an architecture
+ * atosl_image_open() supports, from the headers and load commands alone.
+ * Returns how many were stored: 0 for anything but a Mach-O file. */
+int atosl_image_slices(const char *filename, struct atosl_slice_t slices[], int max);
+
+/* UUID of the arch slice of filename, from its load commands alone, along
+ * with the CPU type and subtype of arch. Returns -1 if there is none. */
+int atosl_image_uuid(const char *arch, const char *filename, uint8_t uuid[UUID_LEN],
+                     int32_t *cputype, int32_t *cpusubtype);
+
+/* Estimate of the memory an open image holds on to: its tables, the line
+ * tables decoded so far, sections read into buffers, and cache mappings */
+size_t atosl_image_memsize(const struct atosl_image_t *image);
+
 #endif /* ATOSL _*/
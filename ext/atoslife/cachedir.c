@@ -0,0 +1,311 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cachedir.h"
+#include "subprograms.h"
+#include "common.h"
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+static uint64_t cachedir_hits;
+static uint64_t cachedir_misses;
+static uint64_t cachedir_evictions;
+
+struct cachedir_entry_t {
+    /* An entry, or ".<entry>.XXXXXX" while it is written */
+    char name[UUID_LEN * 2 + 10];
+    int temp;
+    uint64_t size;
+    struct timespec mtime;
+};
+
+/* $HOME, or the home directory of the user when it isn't set, as it may
+ * not be for daemons. The result is the caller's to free. */
+static char *home_dir(void)
+{
+    const char *home = getenv("HOME");
+    struct passwd pwd, *result = NULL;
+    char buf[4096];
+    char *dir;
+
+    if (!home || !*home) {
+        if (getpwuid_r(getuid(), &pwd, buf, sizeof(buf), &result) != 0 || !result ||
+            !result->pw_dir || !*result->pw_dir)
+            return NULL;
+        home = result->pw_dir;
+    }
+
+    dir = strdup(home);
+    if (!dir)
+        fatal("unable to allocate memory");
+    return dir;
+}
+
+char *cachedir_path(const char *cache_dir, int create)
+{
+    char *path;
+
+    if (cache_dir) {
+        path = strdup(cache_dir);
+    } else {
+        char *home = home_dir();
+
+        if (!home) {
+            warning("no home directory for " SUBPROGRAMS_CACHE_PATH);
+            return NULL;
+        }
+        path = malloc(strlen(home) + strlen("/" SUBPROGRAMS_CACHE_PATH) + 1);
+        if (path)
+            sprintf(path, "%s/" SUBPROGRAMS_CACHE_PATH, home);
+        free(home);
+    }
+    if (!path)
+        fatal("unable to allocate memory");
+
+    if (create && access(path, F_OK) != 0 && errno == ENOENT) {
+        /* Someone else may get there first */
+        if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+            warning("unable to create %s: %s", path, strerror(errno));
+            free(path);
+            return NULL;
+        }
+    }
+
+    return path;
+}
+
+void cachedir_touch(int fd)
+{
+    struct timespec times[2] = {
+        { .tv_nsec = UTIME_OMIT },
+        { .tv_nsec = UTIME_NOW },
+    };
+
+    /* Not being allowed to is fine; the entry just looks older */
+    futimens(fd, times);
+}
+
+void cachedir_record(int hit)
+{
+    __atomic_fetch_add(hit ? &cachedir_hits : &cachedir_misses, 1, __ATOMIC_RELAXED);
+}
+
+/* The length of the name of an entry, named after a UUID, at the start of
+ * name */
+static size_t entry_name_len(const char *name)
+{
+    size_t i;
+
+    for (i = 0; name[i] && i < UUID_LEN * 2; i++) {
+        if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f')))
+            return 0;
+    }
+    return i == UUID_LEN * 2 ? i : 0;
+}
+
+static int is_entry_name(const char *name)
+{
+    return entry_name_len(name) && !name[UUID_LEN * 2];
+}
+
+/* The temporary file of an entry being written, as mkstemp() names it */
+static int is_temp_name(const char *name)
+{
+    return name[0] == '.' && entry_name_len(name + 1) && name[UUID_LEN * 2 + 1] == '.' &&
+           strlen(name + UUID_LEN * 2 + 2) == 6;
+}
+
+/* The entries of dir and the temporary files of entries being written,
+ * with *count set to how many there are. Lock files are left alone. */
+static struct cachedir_entry_t *read_entries(const char *dir, uint32_t *count)
+{
+    struct cachedir_entry_t *entries = NULL;
+    uint32_t capacity = 0;
+    struct dirent *dirent;
+    struct stat st;
+    DIR *d;
+    int dfd;
+
+    *count = 0;
+
+    if (!dir)
+        return NULL;
+
+    d = opendir(dir);
+    if (!d) {
+        /* Not created until the first cache is saved */
+        if (errno != ENOENT)
+            warning("unable to open %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+    dfd = dirfd(d);
+
+    while ((dirent = readdir(d))) {
+        int temp = is_temp_name(dirent->d_name);
+
+        /* Gone already is fine: another process trimmed it */
+        if ((!temp && !is_entry_name(dirent->d_name)) ||
+            fstatat(dfd, dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 ||
+            !S_ISREG(st.st_mode))
+            continue;
+
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, sizeof(*entries) * capacity);
+            if (!entries)
+                fatal("unable to allocate memory");
+        }
+        strcpy(entries[*count].name, dirent->d_name);
+        entries[*count].temp = temp;
+        entries[*count].size = st.st_size;
+        entries[*count].mtime = st.st_mtim;
+        (*count)++;
+    }
+
+    closedir(d);
+
+    return entries;
+}
+
+/* Least recently used first */
+static int compare_entries(const void *a, const void *b)
+{
+    const struct cachedir_entry_t *entry_a = a;
+    const struct cachedir_entry_t *entry_b = b;
+
+    if (entry_a->mtime.tv_sec != entry_b->mtime.tv_sec)
+        return entry_a->mtime.tv_sec < entry_b->mtime.tv_sec ? -1 : 1;
+    if (entry_a->mtime.tv_nsec != entry_b->mtime.tv_nsec)
+        return entry_a->mtime.tv_nsec < entry_b->mtime.tv_nsec ? -1 : 1;
+    return strcmp(entry_a->name, entry_b->name);
+}
+
+uint32_t cachedir_trim(const char *dir, uint64_t limit)
+{
+    struct cachedir_entry_t *entries;
+    uint64_t bytes = 0;
+    uint32_t evicted = 0;
+    uint32_t count;
+    uint32_t i, n;
+    time_t now = time(NULL);
+    int dfd;
+
+    entries = read_entries(dir, &count);
+    if (!entries)
+        return 0;
+
+    dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    /* Temporary files count against the limit too. Whoever writes one holds
+     * the lock, which nobody waits on for longer than the timeout, so one
+     * that old was left by a process that died. Only entries are evicted. */
+    for (i = n = 0; i < count; i++) {
+        if (entries[i].temp) {
+            if (dfd >= 0 && now - entries[i].mtime.tv_sec > SUBPROGRAMS_CACHE_LOCK_TIMEOUT &&
+                unlinkat(dfd, entries[i].name, 0) == 0)
+                continue;
+            bytes += entries[i].size;
+        } else {
+            bytes += entries[i].size;
+            entries[n++] = entries[i];
+        }
+    }
+    count = n;
+
+    qsort(entries, count, sizeof(*entries), compare_entries);
+    /* Mapped entries stay usable by whoever has them open */
+    for (i = 0; dfd >= 0 && bytes > limit && i + 1 < count; i++) {
+        if (unlinkat(dfd, entries[i].name, 0) == 0)
+            evicted++;
+        bytes -= entries[i].size;
+    }
+    if (dfd >= 0)
+        close(dfd);
+
+    __atomic_fetch_add(&cachedir_evictions, evicted, __ATOMIC_RELAXED);
+    free(entries);
+
+    return evicted;
+}
+
+struct cachedir_trim_t {
+    char *dir;
+    uint64_t limit;
+};
+
+static void *trim_thread(void *arg)
+{
+    struct cachedir_trim_t *trim = arg;
+
+    cachedir_trim(trim->dir, trim->limit);
+    free(trim->dir);
+    free(trim);
+    return NULL;
+}
+
+void cachedir_trim_async(const char *dir, uint64_t limit)
+{
+    struct cachedir_trim_t *trim;
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    trim = malloc(sizeof(*trim));
+    if (!trim)
+        fatal("unable to allocate memory");
+    trim->dir = strdup(dir);
+    if (!trim->dir)
+        fatal("unable to allocate memory");
+    trim->limit = limit;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, trim_thread, trim) != 0)
+        trim_thread(trim);
+    pthread_attr_destroy(&attr);
+}
+
+void cachedir_stats(const char *dir, struct cachedir_stats_t *stats)
+{
+    struct cachedir_entry_t *entries;
+    uint32_t count;
+    uint32_t i;
+
+    memset(stats, 0, sizeof(*stats));
+
+    entries = read_entries(dir, &count);
+    for (i = 0; i < count; i++) {
+        if (!entries[i].temp)
+            stats->entries++;
+        stats->bytes += entries[i].size;
+    }
+    free(entries);
+
+    stats->hits = __atomic_load_n(&cachedir_hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&cachedir_misses, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&cachedir_evictions, __ATOMIC_RELAXED);
+}
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
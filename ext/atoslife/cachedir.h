@@ -0,0 +1,59 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef CACHEDIR_
+#define CACHEDIR_
+
+#include <stdint.h>
+
+/* A cache directory holds one file per UUID, named after it. The last time
+ * an entry was used is its mtime, which every hit moves forward; atime
+ * can't be relied on, since most file systems are mounted relatime or
+ * noatime. */
+
+struct cachedir_stats_t {
+    /* What is in the directory */
+    uint64_t entries;
+    uint64_t bytes;
+    /* Counted in this process, across all directories */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+/* cache_dir, or ~/.atosl-cache when it is NULL, created if it is missing
+ * and create is set. The result is the caller's to free; NULL, with a
+ * warning, if there is no home directory to put ~/.atosl-cache in or the
+ * directory can't be created. */
+char *cachedir_path(const char *cache_dir, int create);
+
+/* Mark the entry open at fd as just used */
+void cachedir_touch(int fd);
+
+/* Count a lookup of an entry that was (or wasn't) usable as it was */
+void cachedir_record(int hit);
+
+/* Remove the least recently used entries of dir until the others take up
+ * at most limit bytes, counting the temporary files of entries being
+ * written, and remove those left behind by builders that died. The most
+ * recently used entry is always kept. Returns the number of entries
+ * removed. */
+uint32_t cachedir_trim(const char *dir, uint64_t limit);
+
+/* Same as cachedir_trim(), on a thread of its own, so that whoever just
+ * grew the directory doesn't wait for it */
+void cachedir_trim_async(const char *dir, uint64_t limit);
+
+/* dir may be NULL, or missing, for an empty directory */
+void cachedir_stats(const char *dir, struct cachedir_stats_t *stats);
+
+#endif /* CACHEDIR_ */
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
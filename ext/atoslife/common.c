@@ -56,3 +56,11 @@ void common_warning(const char *file, int lineno, const char *format, ...)
     vfprintf(stderr, format, vargs);
     fprintf(stderr, "\n");
 }
+
+void common_warning_file(const char *file, int lineno, ssize_t ret)
+{
+    if (ret == -1)
+        common_warning(file, lineno, "unable to read data: %s", strerror(errno));
+    else
+        common_warning(file, lineno, "too few bytes read from file");
+}
@@ -11,8 +11,12 @@
 #ifndef COMMON_
 #define COMMON_
 
+#include <stdint.h>
+
 #include <libdwarf.h>
 
+#include "addrindex.h"
+
 #define USAGE "Usage: atosl -o|--dsym <FILENAME> [OPTIONS]... <ADDRESS>..."
 
 #define UUID_LEN 16
@@ -21,12 +25,67 @@
 #define MAX(x,y) ((x)>(y)?(x):(y))
 #endif
 
-struct dwarf_subprogram_t;
-struct dwarf_subprogram_t {
-    const char *name;
-    Dwarf_Addr lowpc;
-    Dwarf_Addr highpc;
-    struct dwarf_subprogram_t *next;
+/* Function address ranges, sorted by lowpc (ties: outermost first). The
+ * lowpc/highpc/name arrays are parallel; names are offsets into a single
+ * string pool. parent[i] is the closest earlier entry that was still open
+ * at lowpc[i], which lets lookups walk outwards from the innermost range.
+ *
+ * Inlined subroutines are entries too, nested in the function they were
+ * inlined into, so the chain of parents from an address is its inline
+ * stack. Their call_file (an offset into the pool) and call_line are where
+ * the call was, in the enclosing entry; call_file is
+ * SUBPROGRAMS_NOT_INLINED for everything else. */
+struct dwarf_subprograms_t {
+    uint32_t count;
+    Dwarf_Addr *lowpc;
+    Dwarf_Addr *highpc;
+    uint32_t *name;
+    int32_t *parent;
+    uint32_t *call_file;
+    uint32_t *call_line;
+
+    /* Search structure over lowpc */
+    struct addr_index_t index;
+
+    char *strings;
+    size_t strings_size;
+
+    /* A cache file the arrays and strings point into, or NULL when they
+     * are allocated, and the block CRCs entries are checked against before
+     * they are used */
+    void *map;
+    size_t map_size;
+    struct crc32c_blocks_t *blocks;
+};
+
+/* Address ranges from .debug_aranges, sorted by start, mapping each range
+ * to the offset of its compilation unit DIE */
+struct dwarf_aranges_t {
+    uint32_t count;
+    Dwarf_Addr *start;
+    Dwarf_Addr *end;
+    Dwarf_Off *cu_offset;
+
+    /* Search structure over start */
+    struct addr_index_t index;
+};
+
+/* Defined symbols from the Mach-O symbol table, sorted by address, and the
+ * functions described by pairs of N_FUN stabs, which come with a size.
+ * Names are offsets into the image's string table. */
+struct symtab_index_t {
+    uint32_t count;
+    Dwarf_Addr *addr;
+    uint32_t *name;
+    struct addr_index_t index;
+
+    uint32_t nfuns;
+    Dwarf_Addr *fun_start;
+    Dwarf_Addr *fun_end;
+    uint32_t *fun_name;
+    struct addr_index_t fun_index;
+
+    const char *strings;
 };
 
 #define fatal(args...) common_fatal(__FILE__, __LINE__, args)
@@ -41,6 +100,9 @@ void common_fatal_file(const char *file, int lineno, int ret);
 #define warning(args...) common_warning(__FILE__, __LINE__, args)
 void common_warning(const char *file, int lineno, const char *format, ...);
 
+#define warning_file(args...) common_warning_file(__FILE__, __LINE__, args)
+void common_warning_file(const char *file, int lineno, ssize_t ret);
+
 #define DWARF_ASSERT(ret, err) \
     do { \
         if (ret == DW_DLV_ERROR) { \
@@ -81,4 +143,21 @@ static inline ssize_t _read(int fd, void *buf, size_t count)
     return n_read;
 }
 
+/* Same as _read(), at an absolute offset and without moving the file
+ * position */
+static inline ssize_t _pread(int fd, void *buf, size_t count, off_t offset)
+{
+    ssize_t n_read = 0;
+    ssize_t ret = 0;
+    while (n_read < count) {
+        ret = pread(fd, buf+n_read, count-n_read, offset+n_read);
+        if (ret == 0)
+            return n_read;
+        else if (ret < 0)
+            return ret;
+        n_read += ret;
+    }
+    return n_read;
+}
+
 #endif /* COMMON_ */
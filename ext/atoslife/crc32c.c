@@ -0,0 +1,252 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARMV8 1
+#endif
+
+#include "crc32c.h"
+#include "common.h"
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const uint8_t *p, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+/* Slicing-by-8: eight bytes per step through eight tables */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7)) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+
+        memcpy(&word, p, sizeof(word));
+        /* The tables are for little-endian words */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc64;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+
+    crc64 = crc;
+    while (len >= 8) {
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+#elif CRC32C_ARMV8
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        crc = __crc32cd(crc, *(const uint64_t *)p);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+    uint32_t i, j, crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            crc = crc32c_table[j - 1][i];
+            crc32c_table[j][i] = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+        }
+    }
+
+    crc32c_impl = crc32c_sw;
+#if CRC32C_SSE42
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_hw;
+#elif CRC32C_ARMV8
+    crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+
+    return ~crc32c_impl(~crc, data, len);
+}
+
+void crc32c_blocks_compute(const void *data, uint64_t size, uint32_t block_size, uint32_t *crc)
+{
+    const uint8_t *p = data;
+    uint64_t offset;
+
+    for (offset = 0; offset < size; offset += block_size) {
+        uint64_t len = size - offset < block_size ? size - offset : block_size;
+
+        *crc++ = crc32c(0, p + offset, len);
+    }
+}
+
+struct crc32c_blocks_t *crc32c_blocks_create(const void *base, uint64_t size, uint32_t block_size,
+                                             const uint32_t *crc, const char *path)
+{
+    struct crc32c_blocks_t *blocks;
+
+    blocks = malloc(sizeof(*blocks));
+    if (!blocks)
+        fatal("unable to allocate memory");
+    memset(blocks, 0, sizeof(*blocks));
+
+    blocks->base = base;
+    blocks->size = size;
+    blocks->block_size = block_size;
+    blocks->nblocks = (uint32_t)((size + block_size - 1) / block_size);
+    blocks->crc = crc;
+    blocks->state = calloc(blocks->nblocks + 1, 1);
+    if (!blocks->state)
+        fatal("unable to allocate memory");
+    if (path) {
+        blocks->path = strdup(path);
+        if (!blocks->path)
+            fatal("unable to allocate memory");
+    }
+
+    return blocks;
+}
+
+int crc32c_blocks_check(struct crc32c_blocks_t *blocks, uint32_t n)
+{
+    uint8_t state = __atomic_load_n(&blocks->state[n], __ATOMIC_ACQUIRE);
+    uint64_t offset = (uint64_t)n * blocks->block_size;
+    uint64_t len;
+
+    if (state == CRC32C_BLOCK_UNCHECKED) {
+        len = blocks->size - offset < blocks->block_size ? blocks->size - offset :
+                                                           blocks->block_size;
+
+        /* Threads racing on the same block come to the same conclusion */
+        state = crc32c(0, blocks->base + offset, len) == blocks->crc[n] ?
+                CRC32C_BLOCK_GOOD : CRC32C_BLOCK_BAD;
+        __atomic_store_n(&blocks->state[n], state, __ATOMIC_RELEASE);
+
+        if (state == CRC32C_BLOCK_BAD &&
+            !__atomic_exchange_n(&blocks->failed, 1, __ATOMIC_ACQ_REL)) {
+            warning("corrupt cache block %u%s%s", n,
+                    blocks->path ? ", removing " : "", blocks->path ? blocks->path : "");
+            /* The mapping stays valid; the next open builds a new cache */
+            if (blocks->path)
+                unlink(blocks->path);
+        }
+    }
+
+    return state == CRC32C_BLOCK_GOOD;
+}
+
+int crc32c_blocks_verify_string(struct crc32c_blocks_t *blocks, const char *str)
+{
+    const uint8_t *p = (const uint8_t *)str;
+    const uint8_t *end;
+    uint64_t n;
+
+    if (!blocks || p < blocks->base || p >= blocks->base + blocks->size)
+        return 1;
+
+    /* Block by block, so nothing is read past the NUL before its block
+     * has been checked */
+    for (n = (uint64_t)(p - blocks->base) / blocks->block_size; n < blocks->nblocks; n++) {
+        if (!crc32c_blocks_verify(blocks, blocks->base + n * blocks->block_size, 1))
+            return 0;
+
+        end = blocks->base + (n + 1) * blocks->block_size;
+        if (end > blocks->base + blocks->size)
+            end = blocks->base + blocks->size;
+        if (memchr(p, '\0', end - p))
+            return 1;
+        p = end;
+    }
+
+    /* Runs off the end of the blocks; whatever follows isn't covered */
+    return 1;
+}
+
+void crc32c_blocks_free(struct crc32c_blocks_t *blocks)
+{
+    if (!blocks)
+        return;
+
+    free(blocks->state);
+    free(blocks->path);
+    free(blocks);
+}
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -0,0 +1,87 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef CRC32C_
+#define CRC32C_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bytes covered by each CRC of a struct crc32c_blocks_t */
+#define CRC32C_BLOCK_SIZE (64 * 1024)
+
+/* CRC-32C (Castagnoli) of len bytes at data, continuing from crc; pass 0 to
+ * start. Uses the SSE4.2 or ARMv8 CRC instructions when the CPU has them,
+ * and a slicing-by-8 table otherwise. */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+/* Fill crc[] with the CRC of every block_size bytes of data; the last block
+ * may be short. */
+void crc32c_blocks_compute(const void *data, uint64_t size, uint32_t block_size, uint32_t *crc);
+
+enum {
+    CRC32C_BLOCK_UNCHECKED = 0,
+    CRC32C_BLOCK_GOOD,
+    CRC32C_BLOCK_BAD,
+};
+
+/* The block CRCs of size bytes at base, usually part of a mapped file,
+ * checked the first time a block is used rather than all at once. Safe to
+ * share between threads. */
+struct crc32c_blocks_t {
+    const uint8_t *base;
+    uint64_t size;
+    uint32_t block_size;
+    uint32_t nblocks;
+    const uint32_t *crc;
+    uint8_t *state;
+
+    /* Removed on the first bad block, so that it's built again */
+    char *path;
+    int failed;
+};
+
+/* crc has (size + block_size - 1) / block_size entries and must outlive
+ * the result; path may be NULL */
+struct crc32c_blocks_t *crc32c_blocks_create(const void *base, uint64_t size, uint32_t block_size,
+                                             const uint32_t *crc, const char *path);
+
+/* Check block n if that hasn't been done yet. Returns 1 if it is intact. */
+int crc32c_blocks_check(struct crc32c_blocks_t *blocks, uint32_t n);
+
+/* Returns 1 if every block holding part of [ptr, ptr + len) is intact.
+ * Bytes outside of the blocks, and a NULL blocks, are always intact. */
+static inline int crc32c_blocks_verify(struct crc32c_blocks_t *blocks, const void *ptr, size_t len)
+{
+    const uint8_t *p = ptr;
+    uint64_t start, end;
+    uint32_t n;
+
+    if (!blocks || len == 0 || p < blocks->base || p >= blocks->base + blocks->size)
+        return 1;
+
+    start = (uint64_t)(p - blocks->base);
+    end = start + len > blocks->size ? blocks->size : start + len;
+    for (n = start / blocks->block_size; (uint64_t)n * blocks->block_size < end; n++) {
+        if (__atomic_load_n(&blocks->state[n], __ATOMIC_ACQUIRE) != CRC32C_BLOCK_GOOD &&
+            !crc32c_blocks_check(blocks, n))
+            return 0;
+    }
+    return 1;
+}
+
+/* Same as crc32c_blocks_verify() for the NUL-terminated string at str */
+int crc32c_blocks_verify_string(struct crc32c_blocks_t *blocks, const char *str);
+
+void crc32c_blocks_free(struct crc32c_blocks_t *blocks);
+
+#endif /* CRC32C_ */
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
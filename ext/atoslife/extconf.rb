@@ -4,6 +4,7 @@ extension_name = 'atoslife/atoslife'
 
 abort "missing malloc()" unless have_func "malloc"
 abort "missing free()"   unless have_func "free"
+abort "missing pthread_create()" unless have_library("pthread", "pthread_create", "pthread.h")
 
 
 LIBDWARF_TARBALL_FILENAME = 'libdwarf_feb_7_2019.tar.gz'
@@ -66,6 +67,18 @@ end
 
 puts "✅  libdwarf installed"
 
+# Search layout for the address indexes, see addrindex.h. Pass e.g.
+# `--with-address-index=btree --with-cflags=-mavx2` to pick one.
+case address_index = with_config('address-index', 'sorted')
+when 'sorted'
+when 'eytzinger'
+  $defs << '-DADDR_INDEX_LAYOUT=ADDR_INDEX_EYTZINGER'
+when 'btree'
+  $defs << '-DADDR_INDEX_LAYOUT=ADDR_INDEX_BTREE'
+else
+  abort "unknown address index layout `#{address_index}' (sorted, eytzinger or btree)"
+end
+
 dir_config(extension_name)
 create_makefile(extension_name)
 
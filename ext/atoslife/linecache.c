@@ -0,0 +1,423 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <dwarf.h>
+#include <libdwarf.h>
+
+#include "linecache.h"
+#include "common.h"
+
+struct line_row_t {
+    Dwarf_Addr pc;
+    uint32_t line;
+    uint32_t file;
+    uint32_t seq;
+};
+
+/* Rows are sorted by address. Sequences don't overlap, but one may start
+ * where the previous one ended, so at equal addresses the end of sequence
+ * row goes first and the lookup lands on the row that follows it. */
+static int compare_rows(const void *a, const void *b)
+{
+    const struct line_row_t *row_a = a;
+    const struct line_row_t *row_b = b;
+    int end_a = row_a->file == LINETABLE_END_SEQUENCE;
+    int end_b = row_b->file == LINETABLE_END_SEQUENCE;
+
+    if (row_a->pc != row_b->pc)
+        return row_a->pc < row_b->pc ? -1 : 1;
+    if (end_a != end_b)
+        return end_a ? -1 : 1;
+    if (row_a->seq != row_b->seq)
+        return row_a->seq < row_b->seq ? -1 : 1;
+    return 0;
+}
+
+static uint32_t add_string(struct dwarf_linetable_t *table, size_t *capacity, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    uint32_t offset = (uint32_t)table->strings_size;
+
+    if (table->strings_size + len > *capacity) {
+        while (table->strings_size + len > *capacity)
+            *capacity = *capacity ? *capacity * 2 : 256;
+        table->strings = realloc(table->strings, *capacity);
+        if (!table->strings)
+            fatal("unable to allocate memory");
+    }
+
+    memcpy(table->strings + offset, str, len);
+    table->strings_size += len;
+
+    return offset;
+}
+
+/* A corrupt line program costs the lookups in its CU their lines, not the
+ * process its life: the error is warned about and the table left empty */
+#define LINE_ASSERT(dbg, ret, err, failed) \
+    do { \
+        if ((ret) == DW_DLV_ERROR) { \
+            warning("dwarf_errmsg: %s", dwarf_errmsg(err)); \
+            dwarf_dealloc(dbg, err, DW_DLA_ERROR); \
+            failed = 1; \
+        } \
+    } while (0)
+
+struct dwarf_linetable_t *linetable_decode(Dwarf_Debug dbg, Dwarf_Off cu_offset)
+{
+    struct dwarf_linetable_t *table;
+    struct line_row_t *rows = NULL;
+    uint32_t *files = NULL;
+    Dwarf_Unsigned nfiles = 0;
+    size_t strings_capacity = 0;
+    Dwarf_Die cu_die = NULL;
+    Dwarf_Line *linebuf = NULL;
+    Dwarf_Signed linecount = 0;
+    Dwarf_Signed nrows;
+    Dwarf_Signed i;
+    int failed = 0;
+    int ret;
+    Dwarf_Error err;
+
+    table = malloc(sizeof(*table));
+    if (!table)
+        fatal("unable to allocate memory");
+    memset(table, 0, sizeof(*table));
+    table->cu_offset = cu_offset;
+
+    ret = dwarf_offdie(dbg, cu_offset, &cu_die, &err);
+    LINE_ASSERT(dbg, ret, err, failed);
+    if (ret != DW_DLV_OK)
+        cu_die = NULL;
+
+    if (cu_die) {
+        ret = dwarf_srclines(cu_die, &linebuf, &linecount, &err);
+        LINE_ASSERT(dbg, ret, err, failed);
+        if (ret != DW_DLV_OK) {
+            linebuf = NULL;
+            linecount = 0;
+        }
+    }
+
+    rows = malloc(sizeof(*rows) * (linecount + 1));
+    if (!rows)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < linecount; i++) {
+        struct line_row_t *row = &rows[i];
+        Dwarf_Bool end_sequence = 0;
+        Dwarf_Unsigned lineno = 0;
+        Dwarf_Unsigned fileno = 0;
+
+        ret = dwarf_lineaddr(linebuf[i], &row->pc, &err);
+        LINE_ASSERT(dbg, ret, err, failed);
+        ret = dwarf_lineendsequence(linebuf[i], &end_sequence, &err);
+        LINE_ASSERT(dbg, ret, err, failed);
+        if (failed)
+            break;
+        row->seq = (uint32_t)i;
+
+        if (end_sequence) {
+            row->line = 0;
+            row->file = LINETABLE_END_SEQUENCE;
+            continue;
+        }
+
+        ret = dwarf_lineno(linebuf[i], &lineno, &err);
+        LINE_ASSERT(dbg, ret, err, failed);
+        row->line = (uint32_t)lineno;
+
+        /* Many rows share a handful of files; resolve each file number to
+         * a path once */
+        ret = dwarf_line_srcfileno(linebuf[i], &fileno, &err);
+        LINE_ASSERT(dbg, ret, err, failed);
+        if (failed)
+            break;
+        if (fileno >= nfiles) {
+            Dwarf_Unsigned j;
+            Dwarf_Unsigned n = fileno + 16;
+
+            files = realloc(files, sizeof(*files) * n);
+            if (!files)
+                fatal("unable to allocate memory");
+            for (j = nfiles; j < n; j++)
+                files[j] = UINT32_MAX;
+            nfiles = n;
+        }
+
+        if (files[fileno] == UINT32_MAX) {
+            char *filename;
+
+            ret = dwarf_linesrc(linebuf[i], &filename, &err);
+            LINE_ASSERT(dbg, ret, err, failed);
+            if (failed)
+                break;
+            if (ret == DW_DLV_OK) {
+                files[fileno] = add_string(table, &strings_capacity, filename);
+                dwarf_dealloc(dbg, filename, DW_DLA_STRING);
+            } else {
+                files[fileno] = add_string(table, &strings_capacity, "");
+            }
+        }
+        row->file = files[fileno];
+    }
+
+    if (linebuf)
+        dwarf_srclines_dealloc(dbg, linebuf, linecount);
+    if (cu_die)
+        dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+    free(files);
+
+    nrows = failed ? 0 : linecount;
+    qsort(rows, nrows, sizeof(*rows), compare_rows);
+
+    table->count = (uint32_t)nrows;
+    table->pc = malloc(sizeof(Dwarf_Addr) * (nrows + 1));
+    table->line = malloc(sizeof(uint32_t) * (nrows + 1));
+    table->file = malloc(sizeof(uint32_t) * (nrows + 1));
+    if (!table->pc || !table->line || !table->file)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < nrows; i++) {
+        table->pc[i] = rows[i].pc;
+        table->line[i] = rows[i].line;
+        table->file[i] = rows[i].file;
+    }
+    free(rows);
+
+    addr_index_build(&table->index, table->pc, table->count);
+
+    table->memsize = sizeof(*table) +
+                     (sizeof(Dwarf_Addr) + 2 * sizeof(uint32_t)) * (table->count + 1) +
+                     addr_index_memsize(&table->index) +
+                     strings_capacity;
+
+    return table;
+}
+
+void linetable_free(struct dwarf_linetable_t *table)
+{
+    addr_index_free(&table->index);
+    free(table->pc);
+    free(table->line);
+    free(table->file);
+    free(table->strings);
+    free(table);
+}
+
+int32_t linetable_lookup(const struct dwarf_linetable_t *table, Dwarf_Addr addr)
+{
+    int32_t i;
+
+    /* The last row at or before addr covers it unless it ends a sequence,
+     * in which case addr falls in a gap between sequences */
+    i = (int32_t)addr_index_rank(&table->index, addr) - 1;
+    if (i < 0 || table->file[i] == LINETABLE_END_SEQUENCE)
+        return -1;
+
+    return i;
+}
+
+/* Open addressing on the CU offset, with linear probing */
+
+static uint32_t bucket_for(const struct dwarf_linecache_t *cache, Dwarf_Off cu_offset)
+{
+    uint64_t hash = (uint64_t)cu_offset * 0x9e3779b97f4a7c15ULL;
+    return (uint32_t)(hash >> 32) & (cache->nbuckets - 1);
+}
+
+static void bucket_insert(struct dwarf_linecache_t *cache, struct dwarf_linetable_t *table)
+{
+    uint32_t i = bucket_for(cache, table->cu_offset);
+
+    while (cache->buckets[i])
+        i = (i + 1) & (cache->nbuckets - 1);
+    cache->buckets[i] = table;
+}
+
+static void bucket_grow(struct dwarf_linecache_t *cache)
+{
+    struct dwarf_linetable_t **old = cache->buckets;
+    uint32_t nold = cache->nbuckets;
+    uint32_t i;
+
+    cache->nbuckets = nold ? nold * 2 : 64;
+    cache->buckets = calloc(cache->nbuckets, sizeof(*cache->buckets));
+    if (!cache->buckets)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < nold; i++) {
+        if (old[i])
+            bucket_insert(cache, old[i]);
+    }
+    free(old);
+}
+
+static void bucket_remove(struct dwarf_linecache_t *cache, struct dwarf_linetable_t *table)
+{
+    uint32_t mask = cache->nbuckets - 1;
+    uint32_t i = bucket_for(cache, table->cu_offset);
+    uint32_t j;
+
+    while (cache->buckets[i] != table)
+        i = (i + 1) & mask;
+
+    /* Shift later entries of the probe run back so lookups don't stop at
+     * the hole */
+    for (j = (i + 1) & mask; cache->buckets[j]; j = (j + 1) & mask) {
+        uint32_t home = bucket_for(cache, cache->buckets[j]->cu_offset);
+
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cache->buckets[i] = cache->buckets[j];
+            i = j;
+        }
+    }
+    cache->buckets[i] = NULL;
+}
+
+static void lru_unlink(struct dwarf_linecache_t *cache, struct dwarf_linetable_t *table)
+{
+    if (table->prev)
+        table->prev->next = table->next;
+    else
+        cache->lru_head = table->next;
+    if (table->next)
+        table->next->prev = table->prev;
+    else
+        cache->lru_tail = table->prev;
+    table->prev = table->next = NULL;
+}
+
+static void lru_push(struct dwarf_linecache_t *cache, struct dwarf_linetable_t *table)
+{
+    table->prev = cache->lru_tail;
+    table->next = NULL;
+    if (cache->lru_tail)
+        cache->lru_tail->next = table;
+    else
+        cache->lru_head = table;
+    cache->lru_tail = table;
+}
+
+/* Drop least recently used tables until the cache fits, skipping the ones
+ * that are in use */
+static void linecache_evict(struct dwarf_linecache_t *cache)
+{
+    struct dwarf_linetable_t *table = cache->lru_head;
+
+    while (cache->memsize > cache->limit && table) {
+        struct dwarf_linetable_t *next = table->next;
+
+        if (table->pins) {
+            table = next;
+            continue;
+        }
+
+        lru_unlink(cache, table);
+        bucket_remove(cache, table);
+        cache->count--;
+        cache->memsize -= table->memsize;
+        cache->evictions++;
+        linetable_free(table);
+        table = next;
+    }
+}
+
+struct dwarf_linecache_t *linecache_create(Dwarf_Debug dbg, size_t limit)
+{
+    struct dwarf_linecache_t *cache = malloc(sizeof(*cache));
+
+    if (!cache)
+        fatal("unable to allocate memory");
+    memset(cache, 0, sizeof(*cache));
+
+    cache->dbg = dbg;
+    cache->limit = limit;
+    pthread_mutex_init(&cache->lock, NULL);
+    bucket_grow(cache);
+
+    return cache;
+}
+
+const struct dwarf_linetable_t *linecache_get(struct dwarf_linecache_t *cache,
+                                              Dwarf_Off cu_offset)
+{
+    struct dwarf_linetable_t *table;
+    uint32_t i;
+
+    pthread_mutex_lock(&cache->lock);
+
+    i = bucket_for(cache, cu_offset);
+    for (; (table = cache->buckets[i]); i = (i + 1) & (cache->nbuckets - 1)) {
+        if (table->cu_offset == cu_offset) {
+            cache->hits++;
+            table->pins++;
+            if (table != cache->lru_tail) {
+                lru_unlink(cache, table);
+                lru_push(cache, table);
+            }
+            pthread_mutex_unlock(&cache->lock);
+            return table;
+        }
+    }
+
+    cache->misses++;
+    table = linetable_decode(cache->dbg, cu_offset);
+
+    /* Keep the load factor under 1/2 */
+    if (2 * (cache->count + 1) > cache->nbuckets)
+        bucket_grow(cache);
+    bucket_insert(cache, table);
+    lru_push(cache, table);
+    cache->count++;
+    cache->memsize += table->memsize;
+    table->pins++;
+
+    linecache_evict(cache);
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return table;
+}
+
+void linecache_release(struct dwarf_linecache_t *cache, const struct dwarf_linetable_t *table)
+{
+    if (!table)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    /* Tables are only ever handed out through linecache_get() */
+    ((struct dwarf_linetable_t *)table)->pins--;
+    linecache_evict(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void linecache_free(struct dwarf_linecache_t *cache)
+{
+    struct dwarf_linetable_t *table;
+
+    if (!cache)
+        return;
+
+    while ((table = cache->lru_head)) {
+        cache->lru_head = table->next;
+        linetable_free(table);
+    }
+    free(cache->buckets);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
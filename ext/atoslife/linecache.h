@@ -0,0 +1,99 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef LINECACHE_
+#define LINECACHE_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libdwarf.h>
+
+#include "addrindex.h"
+
+#define LINECACHE_DEFAULT_LIMIT (64 * 1024 * 1024)
+
+/* file[] value of the row that ends a sequence */
+#define LINETABLE_END_SEQUENCE UINT32_MAX
+
+/* The decoded line program of one compilation unit, sorted by pc. Row i
+ * covers [pc[i], pc[i + 1]); file[i] is an offset into strings. */
+struct dwarf_linetable_t {
+    Dwarf_Off cu_offset;
+    uint32_t count;
+    Dwarf_Addr *pc;
+    uint32_t *line;
+    uint32_t *file;
+    struct addr_index_t index;
+
+    char *strings;
+    size_t strings_size;
+
+    size_t memsize;
+    /* Number of linecache_get() callers still using the table */
+    uint32_t pins;
+
+    /* Least recently used first */
+    struct dwarf_linetable_t *prev;
+    struct dwarf_linetable_t *next;
+};
+
+/* Line tables of the CUs looked up so far, keyed by CU offset. Whole tables
+ * are evicted, least recently used first, once they take up more than limit
+ * bytes; tables that are still in use are never evicted. The cache can be
+ * shared between threads, and decodes tables (the only libdwarf calls made
+ * while symbolicating) under its lock. */
+struct dwarf_linecache_t {
+    Dwarf_Debug dbg;
+    pthread_mutex_t lock;
+
+    struct dwarf_linetable_t **buckets;
+    uint32_t nbuckets;
+    uint32_t count;
+
+    struct dwarf_linetable_t *lru_head;
+    struct dwarf_linetable_t *lru_tail;
+
+    size_t memsize;
+    size_t limit;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+struct dwarf_linecache_t *linecache_create(Dwarf_Debug dbg, size_t limit);
+
+/* Line table of the CU whose DIE is at cu_offset, decoding it on a miss.
+ * The table stays valid until it is handed back with linecache_release(). */
+const struct dwarf_linetable_t *linecache_get(struct dwarf_linecache_t *cache,
+                                              Dwarf_Off cu_offset);
+
+void linecache_release(struct dwarf_linecache_t *cache, const struct dwarf_linetable_t *table);
+
+void linecache_free(struct dwarf_linecache_t *cache);
+
+/* Decode the line table of the CU whose DIE is at cu_offset, outside of
+ * any cache */
+struct dwarf_linetable_t *linetable_decode(Dwarf_Debug dbg, Dwarf_Off cu_offset);
+void linetable_free(struct dwarf_linetable_t *table);
+
+/* Row covering addr, or -1 */
+int32_t linetable_lookup(const struct dwarf_linetable_t *table, Dwarf_Addr addr);
+
+static inline const char *linetable_file(const struct dwarf_linetable_t *table, int32_t row)
+{
+    return table->strings + table->file[row];
+}
+
+#endif /* LINECACHE_ */
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -0,0 +1,548 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <dwarf.h>
+#include <libdwarf.h>
+
+#include "linetab.h"
+#include "linecache.h"
+#include "common.h"
+
+/* The buffer starts with this header; every offset is from the start of
+ * the buffer and 8-byte aligned */
+struct linetab_header_t {
+    uint32_t nrows;
+    uint32_t nblocks;
+    uint32_t nfiles;
+    uint32_t reserved;
+    uint64_t block_addr_offset;     /* Dwarf_Addr[nblocks] */
+    uint64_t block_data_offset;     /* uint32_t[nblocks + 1] */
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t file_offset;           /* uint32_t[nfiles] */
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t size;
+};
+
+#define LINETAB_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+/* file value of a row that ends a sequence */
+#define LINETAB_END 0
+
+struct linetab_row_t {
+    Dwarf_Addr pc;
+    uint32_t file;
+    uint32_t line;
+    uint32_t seq;
+};
+
+/* Same order as the rows of a single CU, see linecache.c */
+static int compare_rows(const void *a, const void *b)
+{
+    const struct linetab_row_t *row_a = a;
+    const struct linetab_row_t *row_b = b;
+    int end_a = row_a->file == LINETAB_END;
+    int end_b = row_b->file == LINETAB_END;
+
+    if (row_a->pc != row_b->pc)
+        return row_a->pc < row_b->pc ? -1 : 1;
+    if (end_a != end_b)
+        return end_a ? -1 : 1;
+    if (row_a->seq != row_b->seq)
+        return row_a->seq < row_b->seq ? -1 : 1;
+    return 0;
+}
+
+struct linetab_builder_t {
+    struct linetab_row_t *rows;
+    uint32_t nrows;
+    uint32_t rows_capacity;
+
+    /* File names, deduplicated through an open addressing hash of ids */
+    uint32_t *file;
+    uint32_t nfiles;
+    uint32_t files_capacity;
+    uint32_t *buckets;
+    uint32_t nbuckets;
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+
+    uint8_t *data;
+    size_t data_size;
+    size_t data_capacity;
+};
+
+static void add_row(struct linetab_builder_t *builder, Dwarf_Addr pc, uint32_t file, uint32_t line)
+{
+    struct linetab_row_t *row;
+
+    if (builder->nrows == builder->rows_capacity) {
+        builder->rows_capacity = builder->rows_capacity ? builder->rows_capacity * 2 : 1024;
+        builder->rows = realloc(builder->rows, sizeof(*builder->rows) * builder->rows_capacity);
+        if (!builder->rows)
+            fatal("unable to allocate memory");
+    }
+
+    row = &builder->rows[builder->nrows];
+    row->pc = pc;
+    row->file = file;
+    row->line = line;
+    row->seq = builder->nrows++;
+}
+
+static uint32_t hash_string(const char *str)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*str)
+        hash = (hash ^ (uint8_t)*str++) * 16777619u;
+    return hash;
+}
+
+static void grow_buckets(struct linetab_builder_t *builder)
+{
+    uint32_t i;
+
+    free(builder->buckets);
+    builder->nbuckets = builder->nbuckets ? builder->nbuckets * 2 : 256;
+    builder->buckets = malloc(sizeof(*builder->buckets) * builder->nbuckets);
+    if (!builder->buckets)
+        fatal("unable to allocate memory");
+    memset(builder->buckets, 0, sizeof(*builder->buckets) * builder->nbuckets);
+
+    for (i = 0; i < builder->nfiles; i++) {
+        uint32_t j = hash_string(builder->strings + builder->file[i]) & (builder->nbuckets - 1);
+
+        while (builder->buckets[j])
+            j = (j + 1) & (builder->nbuckets - 1);
+        builder->buckets[j] = i + 1;
+    }
+}
+
+/* File id (1-based) of name, adding it if it is new */
+static uint32_t intern_file(struct linetab_builder_t *builder, const char *name)
+{
+    size_t len = strlen(name) + 1;
+    uint32_t j;
+
+    if (2 * (builder->nfiles + 1) > builder->nbuckets)
+        grow_buckets(builder);
+
+    j = hash_string(name) & (builder->nbuckets - 1);
+    for (; builder->buckets[j]; j = (j + 1) & (builder->nbuckets - 1)) {
+        if (strcmp(builder->strings + builder->file[builder->buckets[j] - 1], name) == 0)
+            return builder->buckets[j];
+    }
+
+    if (builder->nfiles == builder->files_capacity) {
+        builder->files_capacity = builder->files_capacity ? builder->files_capacity * 2 : 64;
+        builder->file = realloc(builder->file, sizeof(*builder->file) * builder->files_capacity);
+        if (!builder->file)
+            fatal("unable to allocate memory");
+    }
+    while (builder->strings_size + len > builder->strings_capacity) {
+        builder->strings_capacity = builder->strings_capacity ? builder->strings_capacity * 2 : 4096;
+        builder->strings = realloc(builder->strings, builder->strings_capacity);
+        if (!builder->strings)
+            fatal("unable to allocate memory");
+    }
+
+    builder->file[builder->nfiles] = (uint32_t)builder->strings_size;
+    memcpy(builder->strings + builder->strings_size, name, len);
+    builder->strings_size += len;
+    builder->buckets[j] = ++builder->nfiles;
+
+    return builder->nfiles;
+}
+
+/* Global file id of row, caching ids by the CU table's string offset */
+static uint32_t row_file(struct linetab_builder_t *builder, const struct dwarf_linetable_t *table,
+                         uint32_t *ids, int32_t row)
+{
+    uint32_t offset = table->file[row];
+
+    if (!ids[offset])
+        ids[offset] = intern_file(builder, linetable_file(table, row));
+    return ids[offset];
+}
+
+/* The rows of table that answer lookups in [start, end): the row covering
+ * start, the rows after it up to end, and an end of sequence at end */
+static void add_range(struct linetab_builder_t *builder, const struct dwarf_linetable_t *table,
+                      uint32_t *ids, Dwarf_Addr start, Dwarf_Addr end)
+{
+    int32_t row = linetable_lookup(table, start);
+    uint32_t i;
+
+    if (row >= 0)
+        add_row(builder, start, row_file(builder, table, ids, row), table->line[row]);
+
+    for (i = addr_index_rank(&table->index, start); i < table->count && table->pc[i] < end; i++) {
+        if (table->file[i] == LINETABLE_END_SEQUENCE)
+            add_row(builder, table->pc[i], LINETAB_END, 0);
+        else
+            add_row(builder, table->pc[i], row_file(builder, table, ids, i), table->line[i]);
+    }
+
+    add_row(builder, end, LINETAB_END, 0);
+}
+
+static void put_byte(struct linetab_builder_t *builder, uint8_t byte)
+{
+    if (builder->data_size == builder->data_capacity) {
+        builder->data_capacity = builder->data_capacity ? builder->data_capacity * 2 : 4096;
+        builder->data = realloc(builder->data, builder->data_capacity);
+        if (!builder->data)
+            fatal("unable to allocate memory");
+    }
+    builder->data[builder->data_size++] = byte;
+}
+
+static void put_varint(struct linetab_builder_t *builder, uint64_t value)
+{
+    while (value >= 0x80) {
+        put_byte(builder, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    put_byte(builder, (uint8_t)value);
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+struct arange_ref_t {
+    Dwarf_Off cu_offset;
+    uint32_t index;
+};
+
+static int compare_by_cu(const void *a, const void *b)
+{
+    const struct arange_ref_t *ref_a = a;
+    const struct arange_ref_t *ref_b = b;
+
+    if (ref_a->cu_offset != ref_b->cu_offset)
+        return ref_a->cu_offset < ref_b->cu_offset ? -1 : 1;
+    return ref_a->index < ref_b->index ? -1 : ref_a->index > ref_b->index;
+}
+
+/* Lay the encoded rows out in a single buffer, see struct linetab_header_t */
+static struct dwarf_linetab_t *builder_finish(struct linetab_builder_t *builder)
+{
+    struct linetab_header_t header;
+    struct dwarf_linetab_t *linetab;
+    Dwarf_Addr *block_addr;
+    uint32_t *block_data;
+    char *buffer;
+    Dwarf_Addr prev_pc = 0;
+    uint32_t prev_line = 0;
+    uint32_t i;
+
+    qsort(builder->rows, builder->nrows, sizeof(*builder->rows), compare_rows);
+
+    memset(&header, 0, sizeof(header));
+    header.nrows = builder->nrows;
+    header.nblocks = (builder->nrows + LINETAB_BLOCK_ROWS - 1) / LINETAB_BLOCK_ROWS;
+    header.nfiles = builder->nfiles;
+
+    block_addr = malloc(sizeof(*block_addr) * (header.nblocks + 1));
+    block_data = malloc(sizeof(*block_data) * (header.nblocks + 1));
+    if (!block_addr || !block_data)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < builder->nrows; i++) {
+        const struct linetab_row_t *row = &builder->rows[i];
+
+        if (i % LINETAB_BLOCK_ROWS == 0) {
+            block_addr[i / LINETAB_BLOCK_ROWS] = row->pc;
+            block_data[i / LINETAB_BLOCK_ROWS] = (uint32_t)builder->data_size;
+            prev_pc = row->pc;
+            prev_line = 0;
+        }
+
+        put_varint(builder, row->pc - prev_pc);
+        put_varint(builder, row->file);
+        if (row->file != LINETAB_END) {
+            put_varint(builder, zigzag((int64_t)row->line - prev_line));
+            prev_line = row->line;
+        }
+        prev_pc = row->pc;
+    }
+    block_data[header.nblocks] = (uint32_t)builder->data_size;
+
+    header.block_addr_offset = LINETAB_ALIGN(sizeof(header));
+    header.block_data_offset = LINETAB_ALIGN(header.block_addr_offset +
+                                             sizeof(Dwarf_Addr) * (uint64_t)header.nblocks);
+    header.data_offset = LINETAB_ALIGN(header.block_data_offset +
+                                       sizeof(uint32_t) * ((uint64_t)header.nblocks + 1));
+    header.data_size = builder->data_size;
+    header.file_offset = LINETAB_ALIGN(header.data_offset + header.data_size);
+    header.strings_offset = LINETAB_ALIGN(header.file_offset +
+                                          sizeof(uint32_t) * (uint64_t)header.nfiles);
+    header.strings_size = builder->strings_size + 1;
+    header.size = LINETAB_ALIGN(header.strings_offset + header.strings_size);
+
+    buffer = calloc(1, header.size);
+    if (!buffer)
+        fatal("unable to allocate memory");
+
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + header.block_addr_offset, block_addr, sizeof(Dwarf_Addr) * header.nblocks);
+    memcpy(buffer + header.block_data_offset, block_data, sizeof(uint32_t) * (header.nblocks + 1));
+    if (builder->data_size)
+        memcpy(buffer + header.data_offset, builder->data, builder->data_size);
+    if (builder->nfiles)
+        memcpy(buffer + header.file_offset, builder->file, sizeof(uint32_t) * builder->nfiles);
+    if (builder->strings_size)
+        memcpy(buffer + header.strings_offset, builder->strings, builder->strings_size);
+
+    free(block_addr);
+    free(block_data);
+    free(builder->rows);
+    free(builder->file);
+    free(builder->buckets);
+    free(builder->strings);
+    free(builder->data);
+    memset(builder, 0, sizeof(*builder));
+
+    linetab = linetab_open(buffer, header.size, NULL);
+    if (!linetab)
+        fatal("built an invalid line table");
+    linetab->owned = 1;
+
+    return linetab;
+}
+
+struct dwarf_linetab_t *linetab_build(Dwarf_Debug dbg, const struct dwarf_aranges_t *aranges,
+                                      const volatile int *interrupted)
+{
+    struct linetab_builder_t builder;
+    struct dwarf_linetable_t *table = NULL;
+    struct arange_ref_t *order = NULL;
+    uint32_t *ids = NULL;
+    uint32_t count = aranges ? aranges->count : 0;
+    uint32_t i;
+
+    memset(&builder, 0, sizeof(builder));
+
+    /* Visit the ranges CU by CU so that every line table is decoded once */
+    order = malloc(sizeof(*order) * (count + 1));
+    if (!order)
+        fatal("unable to allocate memory");
+    for (i = 0; i < count; i++) {
+        order[i].cu_offset = aranges->cu_offset[i];
+        order[i].index = i;
+    }
+    qsort(order, count, sizeof(*order), compare_by_cu);
+
+    for (i = 0; i < count; i++) {
+        uint32_t j = order[i].index;
+
+        if (interrupted && *interrupted)
+            break;
+
+        if (!table || table->cu_offset != aranges->cu_offset[j]) {
+            if (table)
+                linetable_free(table);
+            free(ids);
+
+            table = linetable_decode(dbg, aranges->cu_offset[j]);
+            ids = calloc(table->strings_size + 1, sizeof(*ids));
+            if (!ids)
+                fatal("unable to allocate memory");
+        }
+
+        add_range(&builder, table, ids, aranges->start[j], aranges->end[j]);
+    }
+
+    if (table)
+        linetable_free(table);
+    free(ids);
+    free(order);
+
+    if (i < count) {
+        free(builder.rows);
+        free(builder.file);
+        free(builder.buckets);
+        free(builder.strings);
+        return NULL;
+    }
+
+    return builder_finish(&builder);
+}
+
+/* A region of count elements of size bytes at offset, inside the buffer */
+static int region_valid(const struct linetab_header_t *header, uint64_t offset,
+                        uint64_t count, uint64_t size)
+{
+    return offset % 8 == 0 &&
+           offset >= sizeof(*header) &&
+           offset <= header->size &&
+           count <= (header->size - offset) / size;
+}
+
+struct dwarf_linetab_t *linetab_open(const void *buffer, size_t size,
+                                     struct crc32c_blocks_t *blocks)
+{
+    const struct linetab_header_t *header = buffer;
+    const char *base = buffer;
+    struct dwarf_linetab_t *linetab;
+
+    if (size < sizeof(*header) || !crc32c_blocks_verify(blocks, header, sizeof(*header)) ||
+        header->size != size)
+        return NULL;
+
+    if (header->nblocks != (header->nrows + LINETAB_BLOCK_ROWS - 1) / LINETAB_BLOCK_ROWS ||
+        !region_valid(header, header->block_addr_offset, header->nblocks, sizeof(Dwarf_Addr)) ||
+        !region_valid(header, header->block_data_offset, (uint64_t)header->nblocks + 1,
+                      sizeof(uint32_t)) ||
+        !region_valid(header, header->data_offset, header->data_size, 1) ||
+        !region_valid(header, header->file_offset, header->nfiles, sizeof(uint32_t)) ||
+        !region_valid(header, header->strings_offset, header->strings_size, 1) ||
+        header->strings_size == 0)
+        return NULL;
+
+    /* What every lookup goes through */
+    if (!crc32c_blocks_verify(blocks, base + header->block_addr_offset,
+                              header->nblocks * sizeof(Dwarf_Addr)) ||
+        !crc32c_blocks_verify(blocks, base + header->block_data_offset,
+                              (header->nblocks + 1) * sizeof(uint32_t)) ||
+        !crc32c_blocks_verify(blocks, base + header->strings_offset + header->strings_size - 1, 1))
+        return NULL;
+
+    if (base[header->strings_offset + header->strings_size - 1] != '\0' ||
+        ((const uint32_t *)(base + header->block_data_offset))[header->nblocks] !=
+            header->data_size)
+        return NULL;
+
+    linetab = malloc(sizeof(*linetab));
+    if (!linetab)
+        fatal("unable to allocate memory");
+    memset(linetab, 0, sizeof(*linetab));
+
+    linetab->nrows = header->nrows;
+    linetab->nblocks = header->nblocks;
+    linetab->block_addr = (const Dwarf_Addr *)(base + header->block_addr_offset);
+    linetab->block_data = (const uint32_t *)(base + header->block_data_offset);
+    linetab->data = (const uint8_t *)(base + header->data_offset);
+    linetab->nfiles = header->nfiles;
+    linetab->file = (const uint32_t *)(base + header->file_offset);
+    linetab->strings = base + header->strings_offset;
+    linetab->strings_size = header->strings_size;
+    linetab->buffer = buffer;
+    linetab->size = size;
+    linetab->blocks = blocks;
+
+    addr_index_build(&linetab->index, linetab->block_addr, linetab->nblocks);
+
+    return linetab;
+}
+
+static uint64_t get_varint(const uint8_t **p, const uint8_t *end)
+{
+    uint64_t value = 0;
+    int shift = 0;
+
+    while (*p < end && shift < 64) {
+        uint8_t byte = *(*p)++;
+
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+        shift += 7;
+    }
+    return value;
+}
+
+static void decode_block(const struct dwarf_linetab_t *linetab, int32_t block,
+                         struct linetab_cursor_t *cursor)
+{
+    const uint8_t *p = linetab->data + linetab->block_data[block];
+    const uint8_t *end = linetab->data + linetab->block_data[block + 1];
+    Dwarf_Addr pc = linetab->block_addr[block];
+    uint32_t line = 0;
+    uint32_t count = linetab->nrows - (uint32_t)block * LINETAB_BLOCK_ROWS;
+    uint32_t i;
+
+    if (count > LINETAB_BLOCK_ROWS)
+        count = LINETAB_BLOCK_ROWS;
+
+    cursor->block = block;
+    if (!crc32c_blocks_verify(linetab->blocks, p, end - p))
+        count = 0;
+
+    for (i = 0; i < count; i++) {
+        pc += get_varint(&p, end);
+        cursor->pc[i] = pc;
+        cursor->file[i] = (uint32_t)get_varint(&p, end);
+        if (cursor->file[i] != LINETAB_END)
+            line += (uint32_t)unzigzag(get_varint(&p, end));
+        cursor->line[i] = line;
+    }
+
+    cursor->count = count;
+}
+
+int linetab_lookup(const struct dwarf_linetab_t *linetab, struct linetab_cursor_t *cursor,
+                   Dwarf_Addr addr, uint32_t *line, const char **file)
+{
+    int32_t block = (int32_t)addr_index_rank(&linetab->index, addr) - 1;
+    int32_t i;
+    uint32_t id;
+
+    if (block < 0)
+        return -1;
+
+    if (cursor->block != block)
+        decode_block(linetab, block, cursor);
+    if (cursor->count == 0)
+        return -1;
+
+    /* The first row of the block is at or before addr */
+    for (i = cursor->count - 1; i > 0 && cursor->pc[i] > addr; i--)
+        ;
+
+    id = cursor->file[i];
+    if (id == LINETAB_END || id > linetab->nfiles ||
+        !crc32c_blocks_verify(linetab->blocks, &linetab->file[id - 1], sizeof(uint32_t)) ||
+        linetab->file[id - 1] >= linetab->strings_size ||
+        !crc32c_blocks_verify_string(linetab->blocks, linetab->strings + linetab->file[id - 1]))
+        return -1;
+
+    *line = cursor->line[i];
+    *file = linetab->strings + linetab->file[id - 1];
+    return 0;
+}
+
+void linetab_free(struct dwarf_linetab_t *linetab)
+{
+    if (!linetab)
+        return;
+
+    addr_index_free(&linetab->index);
+    if (linetab->owned)
+        free((void *)linetab->buffer);
+    free(linetab);
+}
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -0,0 +1,98 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef LINETAB_
+#define LINETAB_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libdwarf.h>
+
+#include "addrindex.h"
+#include "common.h"
+#include "crc32c.h"
+
+/* Rows per encoded block */
+#define LINETAB_BLOCK_ROWS 32
+
+/* Every address -> (file, line) row of the image in one compact table, for
+ * the persistent cache. Rows are sorted by address and encoded in blocks of
+ * LINETAB_BLOCK_ROWS: per row, the address as a varint delta from the
+ * previous row, the file id (0 for the end of a sequence) and the line as a
+ * zigzag varint delta. block_addr holds the first address of every block
+ * and block_data where it starts in data, so a lookup searches block_addr
+ * and decodes a single block.
+ *
+ * The table is one position-independent buffer, the same in memory and in
+ * the cache file; all the pointers below point into it. */
+struct dwarf_linetab_t {
+    uint32_t nrows;
+    uint32_t nblocks;
+    const Dwarf_Addr *block_addr;
+    const uint32_t *block_data;
+    const uint8_t *data;
+
+    /* File id n names strings + file[n - 1] */
+    uint32_t nfiles;
+    const uint32_t *file;
+    const char *strings;
+    size_t strings_size;
+
+    struct addr_index_t index;
+
+    const void *buffer;
+    size_t size;
+    /* buffer is ours to free, rather than part of a mapped cache */
+    int owned;
+    /* CRCs of the mapped cache, checked before a block of rows or a file
+     * name is used */
+    struct crc32c_blocks_t *blocks;
+};
+
+/* The rows of the last block looked at, so that a sorted batch of lookups
+ * decodes every block once */
+struct linetab_cursor_t {
+    int32_t block;
+    uint32_t count;
+    Dwarf_Addr pc[LINETAB_BLOCK_ROWS];
+    uint32_t file[LINETAB_BLOCK_ROWS];
+    uint32_t line[LINETAB_BLOCK_ROWS];
+};
+
+/* Decode the line table of every CU covered by aranges, clipped to the
+ * ranges, so that a lookup gives the same row as going through aranges and
+ * the CU's own table. Returns NULL if *interrupted becomes non-zero. */
+struct dwarf_linetab_t *linetab_build(Dwarf_Debug dbg, const struct dwarf_aranges_t *aranges,
+                                      const volatile int *interrupted);
+
+/* Use size bytes at buffer, as written from a built table, in place.
+ * Returns NULL if they don't hold a valid table. The header and the block
+ * index are checked against blocks right away, everything else as lookups
+ * get to it; blocks may be NULL. */
+struct dwarf_linetab_t *linetab_open(const void *buffer, size_t size,
+                                     struct crc32c_blocks_t *blocks);
+
+static inline void linetab_cursor_init(struct linetab_cursor_t *cursor)
+{
+    cursor->block = -1;
+    cursor->count = 0;
+}
+
+/* Line and file name of the row covering addr. Returns -1 if there is none,
+ * or if the cache it comes from is corrupt. */
+int linetab_lookup(const struct dwarf_linetab_t *linetab, struct linetab_cursor_t *cursor,
+                   Dwarf_Addr addr, uint32_t *line, const char **file);
+
+void linetab_free(struct dwarf_linetab_t *linetab);
+
+#endif /* LINETAB_ */
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -18,8 +18,6 @@
 
 #include "macho.h"
 
-char *project_name;
-
 static struct die_info * read_die_and_children (char *info_ptr, struct dwarf2_cu *cu, char **new_info_ptr, struct die_info *parent);
 static struct die_info * read_die_and_siblings (char *info_ptr, struct dwarf2_cu *cu, char **new_info_ptr, struct die_info *parent);
 
@@ -2730,7 +2728,7 @@ int lookup_by_address_in_symtable(struct thin_macho *tm, CORE_ADDR integer_addre
     //select_symbol_by_address(local_syms, tm->symbolInformation.numLocalSymbols, integer_address, &found_symbol, &offset);
     select_symbol_by_address(tm->all_symbols, tm->nsyms, integer_address, &found_symbol, &offset);
     if(found_symbol){
-        printf("%s (in %s) + %d\n", tm->strings + found_symbol->n_un.n_strx, project_name, offset);
+        printf("%s (in %s) + %d\n", tm->strings + found_symbol->n_un.n_strx, tm->project_name, offset);
         return 0;
     }else{
         return -1;
@@ -2813,7 +2811,7 @@ int lookup_by_address_in_dwarf(struct thin_macho *thin_macho, CORE_ADDR integer_
     //print_line_vector(current_subfile);
     int lineno = get_lineno_for_address(current_subfile, address);
     debug("lineno: %d\n",lineno);
-    printf("%s (in %s) (%s:%d)\n", target_subprogram_name, project_name, target_program_name, lineno);
+    printf("%s (in %s) (%s:%d)\n", target_subprogram_name, thin_macho->project_name, target_program_name, lineno);
     free_sub_file(current_subfile);
     free_line_header(lh);
 
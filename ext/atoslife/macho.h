@@ -519,6 +519,8 @@ struct thin_macho{
     struct nlist_64 *all_symbols64;
     uint32_t nsyms;
     uint32_t strsize;
+    /* Image name printed with each result */
+    const char *project_name;
     /* * The binary image's dynamic symbol information, if any. */
     struct {
         /* * Symbol table index for global symbols. */
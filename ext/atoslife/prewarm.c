@@ -0,0 +1,262 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "prewarm.h"
+#include "subprograms.h"
+#include "common.h"
+
+struct prewarm_job_t {
+    struct atosl_prewarm_result_t result;
+    off_t size;
+};
+
+struct prewarm_t {
+    struct prewarm_job_t *jobs;
+    uint32_t count;
+    uint32_t capacity;
+
+    const struct atosl_image_options_t *options;
+    /* Next job for a worker to take */
+    uint32_t next;
+};
+
+static void add_file(struct prewarm_t *prewarm, const char *path, off_t size)
+{
+    struct atosl_slice_t slices[ATOSL_MAX_SLICES];
+    int count = atosl_image_slices(path, slices, ATOSL_MAX_SLICES);
+    uint32_t j;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        struct prewarm_job_t *job;
+
+        /* The executable has the UUID of its dSYM, but nothing to cache */
+        if (!slices[i].has_dwarf)
+            continue;
+
+        for (j = 0; j < prewarm->count; j++) {
+            const struct atosl_slice_t *slice = &prewarm->jobs[j].result.slice;
+
+            if (slice->cputype == slices[i].cputype && slice->cpusubtype == slices[i].cpusubtype &&
+                memcmp(slice->uuid, slices[i].uuid, UUID_LEN) == 0)
+                break;
+        }
+        if (j < prewarm->count)
+            continue;
+
+        if (prewarm->count == prewarm->capacity) {
+            prewarm->capacity = prewarm->capacity ? prewarm->capacity * 2 : 64;
+            prewarm->jobs = realloc(prewarm->jobs, sizeof(*prewarm->jobs) * prewarm->capacity);
+            if (!prewarm->jobs)
+                fatal("unable to allocate memory");
+        }
+
+        job = &prewarm->jobs[prewarm->count++];
+        memset(job, 0, sizeof(*job));
+        job->result.path = strdup(path);
+        if (!job->result.path)
+            fatal("unable to allocate memory");
+        job->result.slice = slices[i];
+        job->size = size;
+    }
+}
+
+/* Add the slices of path, or of every file below it. Symbolic links to
+ * directories are only followed when given as is, so there are no cycles. */
+static void add_path(struct prewarm_t *prewarm, const char *path, int given)
+{
+    struct dirent *dirent;
+    struct stat st;
+    DIR *d;
+
+    if ((given ? stat(path, &st) : lstat(path, &st)) < 0) {
+        warning("unable to stat %s: %s", path, strerror(errno));
+        return;
+    }
+    if (S_ISLNK(st.st_mode) && (stat(path, &st) < 0 || S_ISDIR(st.st_mode)))
+        return;
+
+    if (S_ISREG(st.st_mode)) {
+        add_file(prewarm, path, st.st_size);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode))
+        return;
+
+    d = opendir(path);
+    if (!d) {
+        warning("unable to open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    while ((dirent = readdir(d))) {
+        char *child;
+
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+            continue;
+
+        child = malloc(strlen(path) + strlen(dirent->d_name) + 2);
+        if (!child)
+            fatal("unable to allocate memory");
+        sprintf(child, "%s/%s", path, dirent->d_name);
+        add_path(prewarm, child, 0);
+        free(child);
+    }
+
+    closedir(d);
+}
+
+/* Largest first, so that no thread is left with a big one at the end */
+static int compare_jobs(const void *a, const void *b)
+{
+    const struct prewarm_job_t *job_a = a;
+    const struct prewarm_job_t *job_b = b;
+
+    if (job_a->size != job_b->size)
+        return job_a->size > job_b->size ? -1 : 1;
+    return strcmp(job_a->result.path, job_b->result.path);
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *prewarm_worker(void *ptr)
+{
+    struct prewarm_t *prewarm = ptr;
+    const struct atosl_image_options_t *options = prewarm->options;
+    const volatile int *interrupted = options->interrupted;
+    struct atosl_image_t image;
+    uint32_t i;
+
+    while (!(interrupted && *interrupted) &&
+           (i = __atomic_fetch_add(&prewarm->next, 1, __ATOMIC_RELAXED)) < prewarm->count) {
+        struct atosl_prewarm_result_t *result = &prewarm->jobs[i].result;
+        struct subprograms_options_t opts = {
+            .cache_dir = options->cache_dir,
+            .cputype = result->slice.cputype,
+            .cpusubtype = result->slice.cpusubtype,
+        };
+        enum subprograms_type_t type = options->use_globals ? SUBPROGRAMS_GLOBALS :
+                                                              SUBPROGRAMS_CUS;
+        struct timespec start;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        if (subprograms_cached(result->slice.uuid, type, &opts, options->cache_lines)) {
+            result->status = ATOSL_PREWARM_CACHED;
+        } else if (atosl_image_open(&image, result->slice.arch, result->path, options) == 0) {
+            atosl_image_close(&image);
+            /* The table is built even when the directory, the lock or the
+             * disk let the cache down, so look for what was written */
+            result->status = subprograms_cached(result->slice.uuid, type, &opts,
+                                                options->cache_lines) ?
+                             ATOSL_PREWARM_BUILT : ATOSL_PREWARM_FAILED;
+        } else if (!(interrupted && *interrupted)) {
+            /* Given up on because of the interrupt, it is still pending */
+            result->status = ATOSL_PREWARM_FAILED;
+        }
+
+        result->seconds = elapsed(&start);
+    }
+
+    return NULL;
+}
+
+int atosl_prewarm(const char *paths[], int npaths, const struct atosl_image_options_t *options,
+                  int nthreads, struct atosl_prewarm_result_t **results)
+{
+    static const struct atosl_image_options_t default_options = ATOSL_IMAGE_OPTIONS_DEFAULT;
+    struct atosl_image_options_t image_options = options ? *options : default_options;
+    struct prewarm_t prewarm = { NULL };
+    pthread_t *threads;
+    uint32_t j;
+    int ret;
+    int i;
+
+    image_options.use_cache = 1;
+    prewarm.options = &image_options;
+
+    for (i = 0; i < npaths; i++)
+        add_path(&prewarm, paths[i], 1);
+
+    qsort(prewarm.jobs, prewarm.count, sizeof(*prewarm.jobs), compare_jobs);
+
+    if ((uint32_t)nthreads > prewarm.count)
+        nthreads = (int)prewarm.count;
+    if (nthreads < 1)
+        nthreads = 1;
+    /* The images are what runs in parallel, rather than a CU walk per
+     * image on top of that */
+    if (nthreads > 1)
+        image_options.index_threads = 1;
+
+    threads = malloc(sizeof(*threads) * nthreads);
+    if (!threads)
+        fatal("unable to allocate memory");
+
+    /* The calling thread is a worker too */
+    for (i = 1; i < nthreads; i++) {
+        int err = pthread_create(&threads[i], NULL, prewarm_worker, &prewarm);
+        if (err != 0)
+            fatal("unable to create thread: %s", strerror(err));
+    }
+    prewarm_worker(&prewarm);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    *results = malloc(sizeof(**results) * (prewarm.count ? prewarm.count : 1));
+    if (!*results)
+        fatal("unable to allocate memory");
+    ret = prewarm.count;
+    for (j = 0; j < prewarm.count; j++) {
+        (*results)[j] = prewarm.jobs[j].result;
+        if (prewarm.jobs[j].result.status == ATOSL_PREWARM_PENDING)
+            ret = -1;
+    }
+    free(prewarm.jobs);
+
+    if (ret < 0) {
+        atosl_prewarm_free(*results, prewarm.count);
+        *results = NULL;
+    }
+
+    return ret;
+}
+
+void atosl_prewarm_free(struct atosl_prewarm_result_t *results, int count)
+{
+    int i;
+
+    if (!results)
+        return;
+    for (i = 0; i < count; i++)
+        free(results[i].path);
+    free(results);
+}
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -0,0 +1,54 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef PREWARM_
+#define PREWARM_
+
+#include "atosl.h"
+
+/* Building the caches of a batch of dSYMs ahead of the first lookup, so
+ * that no crash report pays for the CU walk. */
+
+enum atosl_prewarm_status_t {
+    /* Not reached before the run was interrupted */
+    ATOSL_PREWARM_PENDING,
+    ATOSL_PREWARM_BUILT,
+    /* There was a usable cache already */
+    ATOSL_PREWARM_CACHED,
+    /* The image could not be opened, its table built or its cache written */
+    ATOSL_PREWARM_FAILED,
+};
+
+struct atosl_prewarm_result_t {
+    char *path;
+    struct atosl_slice_t slice;
+    enum atosl_prewarm_status_t status;
+    /* Time taken by this slice alone */
+    double seconds;
+};
+
+/* Build the cache of every slice with DWARF found in paths, each either a
+ * file or a directory that is walked recursively, on up to nthreads
+ * threads. A UUID found more than once is built once. options is as for
+ * atosl_image_open(), with use_cache implied; with more than one thread,
+ * each image is indexed on a single one.
+ *
+ * Returns the number of results stored in *results, largest file first,
+ * to be freed with atosl_prewarm_free(), a slice that failed among them;
+ * or -1 if options->interrupted was set, in which case the caches already
+ * saved are kept. */
+int atosl_prewarm(const char *paths[], int npaths, const struct atosl_image_options_t *options,
+                  int nthreads, struct atosl_prewarm_result_t **results);
+
+void atosl_prewarm_free(struct atosl_prewarm_result_t *results, int count);
+
+#endif /* PREWARM_ */
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
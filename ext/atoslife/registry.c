@@ -0,0 +1,308 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "registry.h"
+#include "common.h"
+
+/* How often a caller waiting for someone else to open an image checks its
+ * interrupted flag, in milliseconds */
+#define REGISTRY_WAIT_POLL 50
+
+struct registry_entry_t {
+    /* First, so that atosl_registry_release() can find the entry */
+    struct atosl_image_t image;
+
+    uint8_t uuid[UUID_LEN];
+    int32_t cputype;
+    int32_t cpusubtype;
+
+    uint32_t refs;
+    /* Being opened by the caller that registered it */
+    int loading;
+    /* Not in the list: an image without a UUID, for one caller */
+    int registered;
+    size_t memsize;
+
+    /* Least recently used first */
+    struct registry_entry_t *prev;
+    struct registry_entry_t *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;
+
+    struct registry_entry_t *head;
+    struct registry_entry_t *tail;
+    uint32_t count;
+
+    size_t memsize;
+    size_t limit;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .loaded = PTHREAD_COND_INITIALIZER,
+    .limit = ATOSL_REGISTRY_DEFAULT_LIMIT,
+};
+
+static void registry_unlink(struct registry_entry_t *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        registry.head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        registry.tail = entry->prev;
+    entry->prev = entry->next = NULL;
+    registry.count--;
+}
+
+static void registry_append(struct registry_entry_t *entry)
+{
+    entry->prev = registry.tail;
+    entry->next = NULL;
+    if (registry.tail)
+        registry.tail->next = entry;
+    else
+        registry.head = entry;
+    registry.tail = entry;
+    registry.count++;
+}
+
+static struct registry_entry_t *registry_find(const uint8_t uuid[UUID_LEN],
+                                              int32_t cputype, int32_t cpusubtype)
+{
+    struct registry_entry_t *entry;
+
+    for (entry = registry.tail; entry; entry = entry->prev) {
+        if (entry->cputype == cputype && entry->cpusubtype == cpusubtype &&
+            memcmp(entry->uuid, uuid, UUID_LEN) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/* Take unused images off the list, least recently used first, until the
+ * rest fit. Called with the lock held; returns the images to close once
+ * it is dropped. */
+static struct registry_entry_t *registry_evict(void)
+{
+    struct registry_entry_t *evicted = NULL;
+    struct registry_entry_t *entry = registry.head;
+
+    while (entry && registry.memsize > registry.limit) {
+        struct registry_entry_t *next = entry->next;
+
+        if (entry->refs == 0 && !entry->loading) {
+            registry_unlink(entry);
+            registry.memsize -= entry->memsize;
+            registry.evictions++;
+            entry->next = evicted;
+            evicted = entry;
+        }
+        entry = next;
+    }
+
+    return evicted;
+}
+
+static void close_entries(struct registry_entry_t *entry)
+{
+    while (entry) {
+        struct registry_entry_t *next = entry->next;
+
+        atosl_image_close(&entry->image);
+        free(entry);
+        entry = next;
+    }
+}
+
+static void wait_loaded(void)
+{
+    struct timespec deadline;
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec;
+    deadline.tv_nsec = now.tv_usec * 1000 + REGISTRY_WAIT_POLL * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&registry.loaded, &registry.lock, &deadline);
+}
+
+struct atosl_image_t *atosl_registry_acquire(const char *arch, const char *filename,
+                                             const struct atosl_image_options_t *options)
+{
+    const volatile int *interrupted = options ? options->interrupted : NULL;
+    struct atosl_image_options_t shared_options;
+    struct registry_entry_t *entry;
+    struct registry_entry_t *evicted;
+    uint8_t uuid[UUID_LEN];
+    int32_t cputype, cpusubtype;
+    int ret;
+
+    /* A shared image has to serve any address */
+    if (options && options->addresses) {
+        shared_options = *options;
+        shared_options.addresses = NULL;
+        shared_options.naddresses = 0;
+        options = &shared_options;
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry)
+        fatal("unable to allocate memory");
+
+    if (atosl_image_uuid(arch, filename, uuid, &cputype, &cpusubtype) < 0) {
+        if (atosl_image_open(&entry->image, arch, filename, options) < 0) {
+            free(entry);
+            return NULL;
+        }
+        entry->image.options.interrupted = NULL;
+        return &entry->image;
+    }
+
+    pthread_mutex_lock(&registry.lock);
+    for (;;) {
+        struct registry_entry_t *found = registry_find(uuid, cputype, cpusubtype);
+
+        if (!found)
+            break;
+        if (!found->loading) {
+            found->refs++;
+            registry_unlink(found);
+            registry_append(found);
+            registry.hits++;
+            pthread_mutex_unlock(&registry.lock);
+            free(entry);
+            return &found->image;
+        }
+
+        if (interrupted && *interrupted) {
+            pthread_mutex_unlock(&registry.lock);
+            free(entry);
+            return NULL;
+        }
+        wait_loaded();
+    }
+
+    memcpy(entry->uuid, uuid, UUID_LEN);
+    entry->cputype = cputype;
+    entry->cpusubtype = cpusubtype;
+    entry->refs = 1;
+    entry->loading = 1;
+    entry->registered = 1;
+    registry_append(entry);
+    registry.misses++;
+    pthread_mutex_unlock(&registry.lock);
+
+    /* Without the lock: this is the slow part */
+    ret = atosl_image_open(&entry->image, arch, filename, options);
+
+    pthread_mutex_lock(&registry.lock);
+    entry->loading = 0;
+    if (ret < 0) {
+        registry_unlink(entry);
+        pthread_cond_broadcast(&registry.loaded);
+        pthread_mutex_unlock(&registry.lock);
+        free(entry);
+        return NULL;
+    }
+    /* The flag belongs to this caller; every later one brings its own */
+    entry->image.options.interrupted = NULL;
+    entry->memsize = atosl_image_memsize(&entry->image);
+    registry.memsize += entry->memsize;
+    evicted = registry_evict();
+    pthread_cond_broadcast(&registry.loaded);
+    pthread_mutex_unlock(&registry.lock);
+
+    close_entries(evicted);
+
+    return &entry->image;
+}
+
+void atosl_registry_release(struct atosl_image_t *image)
+{
+    struct registry_entry_t *entry = (struct registry_entry_t *)image;
+    struct registry_entry_t *evicted;
+    size_t memsize;
+
+    if (!image)
+        return;
+
+    if (!entry->registered) {
+        atosl_image_close(&entry->image);
+        free(entry);
+        return;
+    }
+
+    /* Line tables decoded meanwhile count too */
+    memsize = atosl_image_memsize(image);
+
+    pthread_mutex_lock(&registry.lock);
+    registry.memsize += memsize - entry->memsize;
+    entry->memsize = memsize;
+    entry->refs--;
+    evicted = registry_evict();
+    pthread_mutex_unlock(&registry.lock);
+
+    close_entries(evicted);
+}
+
+void atosl_registry_set_limit(size_t limit)
+{
+    struct registry_entry_t *evicted;
+
+    pthread_mutex_lock(&registry.lock);
+    registry.limit = limit;
+    evicted = registry_evict();
+    pthread_mutex_unlock(&registry.lock);
+
+    close_entries(evicted);
+}
+
+void atosl_registry_stats(struct atosl_registry_stats_t *stats)
+{
+    struct registry_entry_t *entry;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&registry.lock);
+    for (entry = registry.head; entry; entry = entry->next) {
+        if (!entry->loading)
+            stats->entries++;
+        if (entry->refs)
+            stats->in_use++;
+    }
+    stats->bytes = registry.memsize;
+    stats->limit = registry.limit;
+    stats->hits = registry.hits;
+    stats->misses = registry.misses;
+    stats->evictions = registry.evictions;
+    pthread_mutex_unlock(&registry.lock);
+}
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
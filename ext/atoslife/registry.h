@@ -0,0 +1,60 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef REGISTRY_
+#define REGISTRY_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atosl.h"
+
+#define ATOSL_REGISTRY_DEFAULT_LIMIT (1024 * 1024 * 1024)
+
+/* Open images shared by everyone in the process, keyed by the UUID and
+ * architecture of the slice, so that an image is parsed and indexed once
+ * however many callers want it. Images are reference counted; ones nobody
+ * holds stay open until, least recently used first, they are closed to keep
+ * the estimated memory of all images (see atosl_image_memsize()) within
+ * the limit.
+ *
+ * The first caller to acquire an image opens it, with its own path and
+ * options; callers that come along meanwhile wait for it. A shared image
+ * may be used by several threads at once, each passing its own interrupted
+ * flag to atosl_image_symbolicate_parallel(). */
+
+struct atosl_registry_stats_t {
+    uint32_t entries;
+    /* Held by at least one caller */
+    uint32_t in_use;
+    size_t bytes;
+    size_t limit;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+/* The image for arch of filename, opened with options if it isn't
+ * registered yet. Returns NULL if options->interrupted becomes non-zero
+ * while it is opened or waited for. Images without a UUID are opened for
+ * the caller alone. */
+struct atosl_image_t *atosl_registry_acquire(const char *arch, const char *filename,
+                                             const struct atosl_image_options_t *options);
+
+void atosl_registry_release(struct atosl_image_t *image);
+
+/* Close unused images right away if they no longer fit */
+void atosl_registry_set_limit(size_t limit);
+
+void atosl_registry_stats(struct atosl_registry_stats_t *stats);
+
+#endif /* REGISTRY_ */
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
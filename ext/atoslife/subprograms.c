@@ -9,12 +9,16 @@
  */
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <libgen.h>
@@ -23,8 +27,14 @@
 #include <libdwarf.h>
 
 #include "subprograms.h"
+#include "aranges.h"
+#include "linetab.h"
+#include "crc32c.h"
+#include "cachedir.h"
 #include "common.h"
 
+/* Version 1: the header is followed by n_entries entries, each followed by
+ * its name. Only read, to migrate old caches. */
 struct atosl_cache_header_t {
     unsigned int magic;
     unsigned int version;
@@ -39,7 +49,411 @@ struct atosl_cache_entry_t {
     /* char *name follows the struct */
 };
 
-unsigned int checksum(int cksum, unsigned char *data, size_t len)
+/* Version 2 and later are a struct dwarf_subprograms_t as it sits in
+ * memory, so that a mapped file can be searched in place: the header is
+ * followed by the parallel arrays and the string pool, each at the 8-byte
+ * aligned offset recorded in the header. Everything is in host byte order; a
+ * cache from a host of the other byte order fails the magic check. Version 3
+ * adds an optional struct dwarf_linetab_t.
+ *
+ * Version 4 adds CRC-32C checksums: one for every block_size bytes from
+ * blocks_offset up to the table of nblocks CRCs at crc_offset, and
+ * header_crc over the header (with header_crc itself 0) followed by that
+ * table. A reader checks the header up front and each block the first time
+ * it uses something in it.
+ *
+ * Version 5 adds inlined subroutines, with their call_file and call_line
+ * arrays. */
+struct atosl_cache_mapped_header_t {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t uuid[UUID_LEN];
+    int32_t cputype;
+    int32_t cpusubtype;
+    /* How the table was built: the enum subprograms_type_t and
+     * sizeof(Dwarf_Addr) */
+    uint32_t type;
+    uint32_t addr_size;
+
+    uint32_t count;
+    uint32_t header_crc;
+    uint64_t lowpc_offset;      /* Dwarf_Addr[count], sorted */
+    uint64_t highpc_offset;     /* Dwarf_Addr[count] */
+    uint64_t name_offset;       /* uint32_t[count], into the string pool */
+    uint64_t parent_offset;     /* int32_t[count] */
+    uint64_t call_file_offset;  /* uint32_t[count], into the string pool */
+    uint64_t call_line_offset;  /* uint32_t[count] */
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t lines_offset;      /* 0 when the cache has no line table */
+    uint64_t lines_size;
+    uint32_t block_size;
+    uint32_t nblocks;
+    uint64_t blocks_offset;
+    uint64_t crc_offset;        /* uint32_t[nblocks] */
+    uint64_t file_size;
+};
+
+#define CACHE_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+/* Entries are collected unsorted while the DWARF (or the cache) is read and
+ * turned into a struct dwarf_subprograms_t once everything is known. */
+struct subprogram_entry_t {
+    Dwarf_Addr lowpc;
+    Dwarf_Addr highpc;
+    uint32_t name;
+    uint32_t seq;
+    uint32_t call_file;
+    uint32_t call_line;
+};
+
+/* A string of the pool, by the hash of its contents */
+#define POOL_SLOT_FREE UINT32_MAX
+struct pool_string_t {
+    uint32_t offset;
+    uint32_t hash;
+};
+
+/* Strings are added to the pool once: a name that comes up again, like the
+ * signature of a Swift overload or a C++ inline function emitted in every
+ * CU that uses it, gets the offset of the first copy. A string is built at
+ * the end of the pool with builder_append(), from where builder_end_string()
+ * either keeps it or drops it for the copy already there. */
+struct subprograms_builder_t {
+    struct subprogram_entry_t *entries;
+    uint32_t count;
+    uint32_t capacity;
+
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+
+    struct pool_string_t *pool;
+    uint32_t pool_count;
+    uint32_t pool_capacity;
+};
+
+static void builder_free(struct subprograms_builder_t *builder)
+{
+    free(builder->entries);
+    free(builder->strings);
+    free(builder->pool);
+}
+
+static void builder_append(struct subprograms_builder_t *builder, const char *str, size_t len)
+{
+    if (builder->strings_size + len > builder->strings_capacity) {
+        while (builder->strings_size + len > builder->strings_capacity)
+            builder->strings_capacity = builder->strings_capacity ?
+                                        builder->strings_capacity * 2 : 64 * 1024;
+        builder->strings = realloc(builder->strings, builder->strings_capacity);
+        if (!builder->strings)
+            fatal("unable to allocate memory");
+    }
+
+    memcpy(builder->strings + builder->strings_size, str, len);
+    builder->strings_size += len;
+}
+
+/* FNV-1a */
+static uint32_t string_hash(const char *str, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        hash = (hash ^ (uint8_t)str[i]) * 16777619u;
+    return hash;
+}
+
+/* Slot of the string of len bytes at str in the pool, free if it isn't
+ * there yet */
+static struct pool_string_t *pool_slot(const struct subprograms_builder_t *builder,
+                                       const char *str, size_t len, uint32_t hash)
+{
+    uint32_t mask = builder->pool_capacity - 1;
+    uint32_t i = hash & mask;
+
+    for (;; i = (i + 1) & mask) {
+        struct pool_string_t *slot = &builder->pool[i];
+
+        if (slot->offset == POOL_SLOT_FREE)
+            return slot;
+        if (slot->hash == hash && memcmp(builder->strings + slot->offset, str, len) == 0 &&
+            builder->strings[slot->offset + len] == '\0')
+            return slot;
+    }
+}
+
+/* Terminate the string appended since the pool was start bytes long.
+ * Returns the offset of the first copy of it in the pool. */
+static uint32_t builder_end_string(struct subprograms_builder_t *builder, size_t start)
+{
+    size_t len = builder->strings_size - start;
+    const char *str;
+    struct pool_string_t *slot;
+    uint32_t hash;
+
+    builder_append(builder, "", 1);
+    str = builder->strings + start;
+    hash = string_hash(str, len);
+
+    /* At most half full */
+    if (2 * (builder->pool_count + 1) > builder->pool_capacity) {
+        struct pool_string_t *old = builder->pool;
+        uint32_t capacity = builder->pool_capacity;
+        uint32_t i;
+
+        builder->pool_capacity = capacity ? capacity * 2 : 1024;
+        builder->pool = malloc(sizeof(*builder->pool) * builder->pool_capacity);
+        if (!builder->pool)
+            fatal("unable to allocate memory");
+        for (i = 0; i < builder->pool_capacity; i++)
+            builder->pool[i].offset = POOL_SLOT_FREE;
+        for (i = 0; i < capacity; i++) {
+            uint32_t mask = builder->pool_capacity - 1;
+            uint32_t j;
+
+            if (old[i].offset == POOL_SLOT_FREE)
+                continue;
+            j = old[i].hash & mask;
+            while (builder->pool[j].offset != POOL_SLOT_FREE)
+                j = (j + 1) & mask;
+            builder->pool[j] = old[i];
+        }
+        free(old);
+    }
+
+    slot = pool_slot(builder, str, len, hash);
+    if (slot->offset != POOL_SLOT_FREE) {
+        builder->strings_size = start;
+        return slot->offset;
+    }
+
+    slot->offset = start;
+    slot->hash = hash;
+    builder->pool_count++;
+    return start;
+}
+
+/* Copy str into the string pool, unless it is there already, returning
+ * its offset */
+static uint32_t builder_add_string(struct subprograms_builder_t *builder, const char *str)
+{
+    size_t start = builder->strings_size;
+
+    builder_append(builder, str, strlen(str));
+    return builder_end_string(builder, start);
+}
+
+static void builder_add_entry(struct subprograms_builder_t *builder,
+                              Dwarf_Addr lowpc, Dwarf_Addr highpc, uint32_t name)
+{
+    struct subprogram_entry_t *entry;
+
+    if (builder->count == builder->capacity) {
+        builder->capacity = builder->capacity ? builder->capacity * 2 : 1024;
+        builder->entries = realloc(builder->entries,
+                                   builder->capacity * sizeof(*builder->entries));
+        if (!builder->entries)
+            fatal("unable to allocate memory");
+    }
+
+    entry = &builder->entries[builder->count];
+    entry->lowpc = lowpc;
+    entry->highpc = highpc;
+    entry->name = name;
+    entry->seq = builder->count;
+    entry->call_file = SUBPROGRAMS_NOT_INLINED;
+    entry->call_line = 0;
+    builder->count++;
+}
+
+static void builder_add(struct subprograms_builder_t *builder,
+                        Dwarf_Addr lowpc, Dwarf_Addr highpc, const char *name)
+{
+    builder_add_entry(builder, lowpc, highpc, builder_add_string(builder, name));
+}
+
+/* A range of addresses of a function, [start, end) */
+struct addr_range_t {
+    Dwarf_Addr start;
+    Dwarf_Addr end;
+};
+
+/* One entry per range of a function, all with the name at offset name of
+ * the pool */
+static void builder_add_ranges(struct subprograms_builder_t *builder,
+                               const struct addr_range_t *ranges, uint32_t count,
+                               uint32_t name)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++)
+        builder_add_entry(builder, ranges[i].start, ranges[i].end, name);
+}
+
+/* Sort by lowpc, then by highpc descending so that enclosing ranges come
+ * before the ranges they contain. Identical ranges keep the order they
+ * were read in, and the lookup prefers the later one. */
+static int compare_entries(const void *a, const void *b)
+{
+    const struct subprogram_entry_t *entry_a = a;
+    const struct subprogram_entry_t *entry_b = b;
+
+    if (entry_a->lowpc != entry_b->lowpc)
+        return entry_a->lowpc < entry_b->lowpc ? -1 : 1;
+    if (entry_a->highpc != entry_b->highpc)
+        return entry_a->highpc > entry_b->highpc ? -1 : 1;
+    if (entry_a->seq != entry_b->seq)
+        return entry_a->seq < entry_b->seq ? -1 : 1;
+    return 0;
+}
+
+/* Same as builder_finish(), for entries that are sorted already */
+static struct dwarf_subprograms_t *builder_finish_sorted(struct subprograms_builder_t *builder)
+{
+    struct dwarf_subprograms_t *subprograms;
+    int32_t *stack;
+    uint32_t depth = 0;
+    uint32_t i;
+
+    subprograms = malloc(sizeof(*subprograms));
+    if (!subprograms)
+        fatal("unable to allocate memory");
+    memset(subprograms, 0, sizeof(*subprograms));
+
+    subprograms->count = builder->count;
+    subprograms->lowpc = malloc(sizeof(Dwarf_Addr) * (builder->count + 1));
+    subprograms->highpc = malloc(sizeof(Dwarf_Addr) * (builder->count + 1));
+    subprograms->name = malloc(sizeof(uint32_t) * (builder->count + 1));
+    subprograms->parent = malloc(sizeof(int32_t) * (builder->count + 1));
+    subprograms->call_file = malloc(sizeof(uint32_t) * (builder->count + 1));
+    subprograms->call_line = malloc(sizeof(uint32_t) * (builder->count + 1));
+    stack = malloc(sizeof(int32_t) * (builder->count + 1));
+    if (!subprograms->lowpc || !subprograms->highpc || !subprograms->name ||
+        !subprograms->parent || !subprograms->call_file || !subprograms->call_line || !stack)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < builder->count; i++) {
+        struct subprogram_entry_t *entry = &builder->entries[i];
+
+        subprograms->lowpc[i] = entry->lowpc;
+        subprograms->highpc[i] = entry->highpc;
+        subprograms->name[i] = entry->name;
+        subprograms->call_file[i] = entry->call_file;
+        subprograms->call_line[i] = entry->call_line;
+
+        /* Ranges that closed before this one starts can't enclose it, or
+         * anything after it */
+        while (depth && subprograms->highpc[stack[depth - 1]] <= entry->lowpc)
+            depth--;
+        subprograms->parent[i] = depth ? stack[depth - 1] : -1;
+        stack[depth++] = i;
+    }
+
+    free(stack);
+    free(builder->entries);
+    free(builder->pool);
+
+    addr_index_build(&subprograms->index, subprograms->lowpc, subprograms->count);
+
+    subprograms->strings = builder->strings;
+    subprograms->strings_size = builder->strings_size;
+
+    memset(builder, 0, sizeof(*builder));
+
+    return subprograms;
+}
+
+static struct dwarf_subprograms_t *builder_finish(struct subprograms_builder_t *builder)
+{
+    qsort(builder->entries, builder->count, sizeof(*builder->entries), compare_entries);
+    return builder_finish_sorted(builder);
+}
+
+/* Whether everything about entry i of a mapped cache is intact. lowpc is
+ * checked as a whole when the cache is opened. */
+static int entry_intact(const struct dwarf_subprograms_t *subprograms, int32_t i)
+{
+    struct crc32c_blocks_t *blocks = subprograms->blocks;
+
+    return !blocks ||
+           (crc32c_blocks_verify(blocks, &subprograms->highpc[i], sizeof(Dwarf_Addr)) &&
+            crc32c_blocks_verify(blocks, &subprograms->parent[i], sizeof(int32_t)) &&
+            crc32c_blocks_verify(blocks, &subprograms->name[i], sizeof(uint32_t)) &&
+            crc32c_blocks_verify(blocks, &subprograms->call_file[i], sizeof(uint32_t)) &&
+            crc32c_blocks_verify(blocks, &subprograms->call_line[i], sizeof(uint32_t)) &&
+            subprograms->name[i] < subprograms->strings_size &&
+            crc32c_blocks_verify_string(blocks, subprograms_name(subprograms, i)) &&
+            (!subprograms_inlined(subprograms, i) ||
+             (subprograms->call_file[i] < subprograms->strings_size &&
+              crc32c_blocks_verify_string(blocks, subprograms_call_file(subprograms, i)))));
+}
+
+int32_t subprograms_lookup(const struct dwarf_subprograms_t *subprograms, Dwarf_Addr addr)
+{
+    int32_t i;
+
+    /* Find the last entry starting at or before addr, then walk outwards
+     * until one actually contains it */
+    i = (int32_t)addr_index_rank(&subprograms->index, addr) - 1;
+    for (; i >= 0; i = subprograms->parent[i]) {
+        if (!entry_intact(subprograms, i))
+            return -1;
+        if (addr < subprograms->highpc[i])
+            return i;
+    }
+
+    return -1;
+}
+
+int32_t subprograms_caller(const struct dwarf_subprograms_t *subprograms, int32_t index)
+{
+    int32_t parent;
+
+    if (!subprograms_inlined(subprograms, index))
+        return -1;
+
+    parent = subprograms->parent[index];
+    if (parent < 0 || !entry_intact(subprograms, parent))
+        return -1;
+    return parent;
+}
+
+int32_t subprograms_concrete(const struct dwarf_subprograms_t *subprograms, int32_t index)
+{
+    int32_t caller;
+
+    while ((caller = subprograms_caller(subprograms, index)) >= 0)
+        index = caller;
+    return index;
+}
+
+void subprograms_free(struct dwarf_subprograms_t *subprograms)
+{
+    if (!subprograms)
+        return;
+
+    addr_index_free(&subprograms->index);
+    crc32c_blocks_free(subprograms->blocks);
+    if (subprograms->map) {
+        munmap(subprograms->map, subprograms->map_size);
+        free(subprograms);
+        return;
+    }
+    free(subprograms->lowpc);
+    free(subprograms->highpc);
+    free(subprograms->name);
+    free(subprograms->parent);
+    free(subprograms->call_file);
+    free(subprograms->call_line);
+    free(subprograms->strings);
+    free(subprograms);
+}
+
+/* Version 1's checksum, only used to read old caches */
+static unsigned int checksum(int cksum, unsigned char *data, size_t len)
 {
     int  i;
     for (i = 0; i < len; ++i)
@@ -47,38 +461,101 @@ unsigned int checksum(int cksum, unsigned char *data, size_t len)
     return cksum;
 }
 
+/* A function name in the pool, keyed by the offset of the DIE it was
+ * read from; 0 marks a free slot, since no DIE sits at offset 0 */
+struct origin_name_t {
+    Dwarf_Off offset;
+    uint32_t name;
+};
+
+/* What the DIEs of one CU share while it is read. The file names of its
+ * line table and the names of the functions inlined in it are added to the
+ * pool the first time they are needed, so that an inline used all over the
+ * CU costs one copy of each. */
+struct cu_state_t {
+    Dwarf_Unsigned language;
+
+    int files_loaded;
+    char **files;
+    Dwarf_Signed nfiles;
+    /* Pool offsets of files, SUBPROGRAMS_NOT_INLINED until added; [0] is
+     * the empty name for DW_AT_call_file 0 and anything out of range */
+    uint32_t *file_names;
+
+    struct origin_name_t *origins;
+    uint32_t norigins;
+    uint32_t origins_capacity;
+
+    /* A libdwarf call failed: the CU, and the walk, are given up on */
+    int failed;
+};
+
+static void cu_state_free(Dwarf_Debug dbg, struct cu_state_t *cu)
+{
+    Dwarf_Signed i;
+
+    if (cu->files) {
+        for (i = 0; i < cu->nfiles; i++)
+            dwarf_dealloc(dbg, cu->files[i], DW_DLA_STRING);
+        dwarf_dealloc(dbg, cu->files, DW_DLA_LIST);
+    }
+    free(cu->file_names);
+    free(cu->origins);
+}
+
+/* A libdwarf error while a CU is read: warned about and recorded in cu,
+ * for the walk to give up without exiting. Without a CU, as when the
+ * globals are read, it is fatal as ever. */
+static void cu_error(struct cu_state_t *cu, Dwarf_Debug dbg, Dwarf_Error err)
+{
+    if (!cu)
+        fatal("dwarf_errmsg: %s", dwarf_errmsg(err));
+    if (!cu->failed)
+        warning("dwarf_errmsg: %s", dwarf_errmsg(err));
+    cu->failed = 1;
+    dwarf_dealloc(dbg, err, DW_DLA_ERROR);
+}
+
+/* DWARF_ASSERT for reading a CU: the caller carries on as if ret were
+ * DW_DLV_NO_ENTRY, and stops at the next DIE */
+#define CU_ASSERT(cu, dbg, ret, err) \
+    do { \
+        if ((ret) == DW_DLV_ERROR) \
+            cu_error(cu, dbg, err); \
+    } while (0)
+
 /* The following function concatenates function parameters to the function name.
- in case we symbolicate a Swift compilation unit, since Swift enables mutliple overloads for the same function name */
-static char* get_function_name_with_params(char *die_name, Dwarf_Die the_die, Dwarf_Debug dbg)
+ in case we symbolicate a Swift compilation unit, since Swift enables mutliple overloads for the same function name.
+ The name is built in place at the end of the string pool, from one pass over the children of the DIE, and
+ returned as its offset there: "name (a, b)", leaving out the "self" parameter. */
+static uint32_t add_function_name_with_params(struct subprograms_builder_t *builder,
+                                              const char *die_name, Dwarf_Die the_die,
+                                              Dwarf_Debug dbg, struct cu_state_t *cu)
 {
+    size_t start = builder->strings_size;
+    int nparams = 0;
     int rc;
     Dwarf_Error err;
 
-    /* Allocate symbol name string buffer */
-    int symbol_name_buffer_length = (strlen(die_name) + 2) * 32; /* Buffer size */
-    char *symbol_name = malloc(symbol_name_buffer_length);
-    if (!symbol_name)
-        fatal("unable to allocate memory");
-    
-    /* Concatenate subprogram name and " (" */
-    strcpy(symbol_name, die_name);
-    strcat(symbol_name, " (");
-    int symbol_name_length = strlen(symbol_name); /* Actual string length */
+    builder_append(builder, die_name, strlen(die_name));
+    builder_append(builder, " (", 2);
 
     /* Get subprogram children */
     Dwarf_Die child_die = NULL;
     Dwarf_Die next_die;
     rc = dwarf_child(the_die, &child_die, &err);
-    DWARF_ASSERT(rc, err);
-
+    CU_ASSERT(cu, dbg, rc, err);
     if (rc == DW_DLV_OK && child_die){
         do {
             /* Get child tag */
             Dwarf_Half child_tag;
             rc = dwarf_tag(child_die, &child_tag, &err);
-            if (rc != DW_DLV_OK)
-                fatal("unable to parse dwarf tag");
-            
+            if (rc != DW_DLV_OK) {
+                CU_ASSERT(cu, dbg, rc, err);
+                dwarf_dealloc(dbg, child_die, DW_DLA_DIE);
+                break;
+            }
+
             /* Check if child is a parameter */
             if (child_tag == DW_TAG_formal_parameter) {
                 char* param_name = 0;
@@ -86,43 +563,174 @@ static char* get_function_name_with_params(char *die_name, Dwarf_Die the_die, Dw
                 /* Get param name (child die name), ignoring the "self" parameter */
                 rc = dwarf_diename(child_die, &param_name, &err);
                 if (rc == DW_DLV_OK && strcmp(param_name, "self") != 0) {
-                
-                    /* Update actual symbol name string length */
-                    symbol_name_length += strlen(param_name) + 2;
-                    
-                    /* Check if symbol name string buffer needs expansion */
-                    if (symbol_name_length >= symbol_name_buffer_length - 1)
-                        
-                        /* Expand (reallocate) symbol name string buffer */
-                        symbol_name = realloc(symbol_name, symbol_name_buffer_length *= 2);
-                    
-                    /* Concatenate param name and ", " */
-                    strcat(symbol_name, param_name);
-                    strcat(symbol_name, ", ");
+                    if (nparams++)
+                        builder_append(builder, ", ", 2);
+                    builder_append(builder, param_name, strlen(param_name));
                 }
             }
 
             /* Move to next sibling (param) */
             rc = dwarf_siblingof(dbg, child_die, &next_die, &err);
-            DWARF_ASSERT(rc, err);
+            CU_ASSERT(cu, dbg, rc, err);
             dwarf_dealloc(dbg, child_die, DW_DLA_DIE);
-            
+
             child_die = next_die;
-        } while (rc != DW_DLV_NO_ENTRY);
+        } while (rc == DW_DLV_OK);
+    }
+
+    builder_append(builder, ")", 1);
+
+    return builder_end_string(builder, start);
+}
+
+
+/* The ranges in the DW_AT_ranges list of die, whose entries are relative
+ * to base until the list selects another. Returns how many there are, in
+ * *ranges for the caller to free; 0 if there is no list, or it is in
+ * .debug_rnglists (DWARF 5), which this libdwarf can't read. */
+static uint32_t read_ranges(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Addr base,
+                            struct addr_range_t **ranges, struct cu_state_t *cu)
+{
+    Dwarf_Attribute attrib = 0;
+    Dwarf_Half form = 0;
+    Dwarf_Off offset = 0;
+    Dwarf_Unsigned value = 0;
+    Dwarf_Ranges *list = NULL;
+    Dwarf_Signed length = 0;
+    Dwarf_Unsigned bytes = 0;
+    Dwarf_Error err;
+    uint32_t count = 0;
+    Dwarf_Signed i;
+    int ret;
+
+    *ranges = NULL;
+
+    ret = dwarf_attr(die, DW_AT_ranges, &attrib, &err);
+    CU_ASSERT(cu, dbg, ret, err);
+    if (ret != DW_DLV_OK)
+        return 0;
+
+    ret = dwarf_whatform(attrib, &form, &err);
+    CU_ASSERT(cu, dbg, ret, err);
+    if (ret != DW_DLV_OK) {
+        /* Given up on, along with the rest of the CU */
+    } else if (form == DW_FORM_sec_offset) {
+        ret = dwarf_global_formref(attrib, &offset, &err);
+        CU_ASSERT(cu, dbg, ret, err);
+    } else if (form == DW_FORM_data4 || form == DW_FORM_data8) {
+        /* DWARF 2 and 3 */
+        ret = dwarf_formudata(attrib, &value, &err);
+        CU_ASSERT(cu, dbg, ret, err);
+        offset = value;
+    } else {
+        ret = DW_DLV_NO_ENTRY;
+    }
+    dwarf_dealloc(dbg, attrib, DW_DLA_ATTR);
+    if (ret != DW_DLV_OK)
+        return 0;
+
+    /* A bad list only costs the function its entries, as before ranges
+     * were read at all */
+    ret = dwarf_get_ranges_a(dbg, offset, die, &list, &length, &bytes, &err);
+    if (ret == DW_DLV_ERROR) {
+        warning("unable to read ranges at 0x%llx: %s",
+                (unsigned long long)offset, dwarf_errmsg(err));
+        dwarf_dealloc(dbg, err, DW_DLA_ERROR);
+        return 0;
+    }
+    if (ret != DW_DLV_OK)
+        return 0;
+
+    *ranges = malloc(sizeof(**ranges) * (length ? length : 1));
+    if (!*ranges)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < length && list[i].dwr_type != DW_RANGES_END; i++) {
+        if (list[i].dwr_type == DW_RANGES_ADDRESS_SELECTION) {
+            base = list[i].dwr_addr2;
+        } else if (list[i].dwr_addr2 > list[i].dwr_addr1) {
+            (*ranges)[count].start = base + list[i].dwr_addr1;
+            (*ranges)[count].end = base + list[i].dwr_addr2;
+            count++;
+        }
+    }
+    dwarf_ranges_dealloc(dbg, list, length);
+
+    if (!count) {
+        free(*ranges);
+        *ranges = NULL;
+    }
+    return count;
+}
+
+/* The code of a subprogram or CU DIE: low_pc and high_pc, stored in
+ * *range, or else DW_AT_ranges, relative to the low_pc of cu_die. *ranges
+ * points at the result, and has to be freed unless it is range. Returns
+ * the number of ranges, 0 if the DIE says nothing about its code. */
+static uint32_t die_ranges(Dwarf_Debug dbg, Dwarf_Die cu_die, Dwarf_Die die,
+                           struct addr_range_t *range, struct addr_range_t **ranges,
+                           struct cu_state_t *cu)
+{
+    Dwarf_Addr lowpc = 0;
+    Dwarf_Addr highpc = 0;
+    Dwarf_Addr base = 0;
+    Dwarf_Half form = 0;
+    enum Dwarf_Form_Class class = 0;
+    Dwarf_Error err;
+    int rc;
+
+    *ranges = range;
+
+    rc = dwarf_lowpc(die, &lowpc, &err);
+    CU_ASSERT(cu, dbg, rc, err);
+
+    rc = dwarf_highpc_b(die, &highpc, &form, &class, &err);
+    CU_ASSERT(cu, dbg, rc, err);
+
+    if (class == DW_FORM_CLASS_CONSTANT) {
+        highpc += lowpc;
     }
 
-    /* Remove trailing ", " if needed */
-    int len = strlen(symbol_name);
-    if (symbol_name[len - 1] == ' ') {
-        symbol_name[len - 1] = 0;
-        symbol_name[len - 2] = 0;
+    /* TODO: when would these not be defined? */
+    if (lowpc && highpc) {
+        range->start = lowpc;
+        range->end = highpc;
+        return 1;
     }
-    
-    strcat (symbol_name, ")");
 
-    return symbol_name;
+    /* Hot/cold splitting and outlining leave functions in pieces */
+    if (cu_die == die) {
+        base = lowpc;
+    } else {
+        rc = dwarf_lowpc(cu_die, &base, &err);
+        CU_ASSERT(cu, dbg, rc, err);
+    }
+    return read_ranges(dbg, die, base, ranges, cu);
 }
 
+/* Whether any of the sorted addresses is in one of the ranges */
+static int ranges_hold_any(const struct addr_range_t *ranges, uint32_t count,
+                           const Dwarf_Addr *addresses, uint32_t naddresses)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; i++) {
+        uint32_t lo = 0, hi = naddresses;
+
+        /* First address at or after the start */
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+
+            if (addresses[mid] < ranges[i].start)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < naddresses && addresses[lo] < ranges[i].end)
+            return 1;
+    }
+    return 0;
+}
 
 /* This method walks the compilation units to find the symbols. It's faster
  * than caching the globals, but it requires a little more manual work and
@@ -130,200 +738,810 @@ static char* get_function_name_with_params(char *die_name, Dwarf_Die the_die, Dw
  * only faster because of how slow dwarf_offdie is. It's probably best to
  * switch to cache_globals if we fix that */
 
-/* List a function if it's in the given DIE.
+/* Pool offset of the name of the file that DW_AT_call_file index refers
+ * to: 1-based in the file table of the CU's line program (DWARF 4 and
+ * earlier), 0 for none */
+static uint32_t call_file_name(struct subprograms_builder_t *builder, Dwarf_Debug dbg,
+                               Dwarf_Die cu_die, struct cu_state_t *cu, Dwarf_Unsigned index)
+{
+    Dwarf_Error err;
+    Dwarf_Signed i;
+    int ret;
+
+    if (!cu->files_loaded) {
+        cu->files_loaded = 1;
+        ret = dwarf_srcfiles(cu_die, &cu->files, &cu->nfiles, &err);
+        CU_ASSERT(cu, dbg, ret, err);
+        if (ret != DW_DLV_OK) {
+            cu->files = NULL;
+            cu->nfiles = 0;
+        }
+
+        cu->file_names = malloc(sizeof(uint32_t) * (cu->nfiles + 1));
+        if (!cu->file_names)
+            fatal("unable to allocate memory");
+        for (i = 0; i <= cu->nfiles; i++)
+            cu->file_names[i] = SUBPROGRAMS_NOT_INLINED;
+    }
+
+    if (index > (Dwarf_Unsigned)cu->nfiles)
+        index = 0;
+    if (cu->file_names[index] == SUBPROGRAMS_NOT_INLINED)
+        cu->file_names[index] = builder_add_string(builder, index ? cu->files[index - 1] : "");
+
+    return cu->file_names[index];
+}
+
+/* Slot of offset in the names of the CU, free if it has no name yet */
+static struct origin_name_t *origin_slot(struct cu_state_t *cu, Dwarf_Off offset)
+{
+    uint32_t mask = cu->origins_capacity - 1;
+    uint32_t i = (uint32_t)(offset * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+
+    while (cu->origins[i].offset && cu->origins[i].offset != offset)
+        i = (i + 1) & mask;
+    return &cu->origins[i];
+}
+
+static void origin_add(struct cu_state_t *cu, Dwarf_Off offset, uint32_t name)
+{
+    struct origin_name_t *slot;
+
+    /* At most half full */
+    if (2 * (cu->norigins + 1) > cu->origins_capacity) {
+        struct origin_name_t *old = cu->origins;
+        uint32_t capacity = cu->origins_capacity;
+        uint32_t i;
+
+        cu->origins_capacity = capacity ? capacity * 2 : 64;
+        cu->origins = calloc(cu->origins_capacity, sizeof(*cu->origins));
+        if (!cu->origins)
+            fatal("unable to allocate memory");
+        for (i = 0; i < capacity; i++) {
+            if (old[i].offset)
+                *origin_slot(cu, old[i].offset) = old[i];
+        }
+        free(old);
+    }
+
+    slot = origin_slot(cu, offset);
+    slot->offset = offset;
+    slot->name = name;
+    cu->norigins++;
+}
+
+/* The DIE that attribute attr of die refers to, at *offset, or NULL */
+static Dwarf_Die die_ref(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Half attr, Dwarf_Off *offset,
+                         struct cu_state_t *cu)
+{
+    Dwarf_Attribute attrib = 0;
+    Dwarf_Die ref = NULL;
+    Dwarf_Error err;
+    int ret;
+
+    ret = dwarf_attr(die, attr, &attrib, &err);
+    CU_ASSERT(cu, dbg, ret, err);
+    if (ret != DW_DLV_OK)
+        return NULL;
+
+    ret = dwarf_global_formref(attrib, offset, &err);
+    CU_ASSERT(cu, dbg, ret, err);
+    dwarf_dealloc(dbg, attrib, DW_DLA_ATTR);
+    if (ret != DW_DLV_OK)
+        return NULL;
+
+    ret = dwarf_offdie(dbg, *offset, &ref, &err);
+    CU_ASSERT(cu, dbg, ret, err);
+    return ret == DW_DLV_OK ? ref : NULL;
+}
+
+/* Pool offset of the name of the function that die is an instance of, for
+ * an inlined subroutine or an out-of-line copy without a name of its own:
+ * that of its DW_AT_abstract_origin, or of the declaration a
+ * DW_AT_specification points to. Returns 0 if there is none. */
+static int origin_name(struct subprograms_builder_t *builder, Dwarf_Debug dbg,
+                       Dwarf_Die die, struct cu_state_t *cu, uint32_t *name)
+{
+    Dwarf_Die origin = NULL;
+    Dwarf_Die named = NULL;
+    Dwarf_Off offset = 0;
+    Dwarf_Off ref_offset;
+    struct origin_name_t *slot;
+    Dwarf_Error err;
+    char *die_name = NULL;
+    int hops;
+    int ret;
+
+    origin = die_ref(dbg, die, DW_AT_abstract_origin, &offset, cu);
+    if (!origin)
+        origin = die_ref(dbg, die, DW_AT_specification, &offset, cu);
+    if (!origin)
+        return 0;
+
+    if (cu->origins_capacity) {
+        slot = origin_slot(cu, offset);
+        if (slot->offset) {
+            dwarf_dealloc(dbg, origin, DW_DLA_DIE);
+            *name = slot->name;
+            return 1;
+        }
+    }
+
+    /* An abstract instance may itself only specify a declaration */
+    named = origin;
+    for (hops = 0; hops < 3; hops++) {
+        Dwarf_Die next;
+
+        ret = dwarf_diename(named, &die_name, &err);
+        CU_ASSERT(cu, dbg, ret, err);
+        if (ret == DW_DLV_OK)
+            break;
+        die_name = NULL;
+
+        next = die_ref(dbg, named, DW_AT_specification, &ref_offset, cu);
+        if (!next)
+            next = die_ref(dbg, named, DW_AT_abstract_origin, &ref_offset, cu);
+        if (named != origin)
+            dwarf_dealloc(dbg, named, DW_DLA_DIE);
+        named = next;
+        if (!named)
+            break;
+    }
+
+    if (die_name) {
+        /* Named as the function itself would be, parameters and all */
+        if (cu->language == DW_LANG_Swift)
+            *name = add_function_name_with_params(builder, die_name, origin, dbg, cu);
+        else
+            *name = builder_add_string(builder, die_name);
+        origin_add(cu, offset, *name);
+    }
+
+    if (named && named != origin)
+        dwarf_dealloc(dbg, named, DW_DLA_DIE);
+    dwarf_dealloc(dbg, origin, DW_DLA_DIE);
+
+    return die_name != NULL;
+}
+
+/* Add the ranges of an inlined subroutine DIE, as entries that record
+ * where they were called from */
+static void read_inlined_entry(
+        struct subprograms_builder_t *builder,
+        Dwarf_Debug dbg, Dwarf_Die cu_die, Dwarf_Die the_die, struct cu_state_t *cu)
+{
+    struct addr_range_t range;
+    struct addr_range_t *ranges;
+    Dwarf_Attribute attrib = 0;
+    Dwarf_Unsigned file = 0;
+    Dwarf_Unsigned line = 0;
+    uint32_t nranges;
+    uint32_t call_file;
+    uint32_t name;
+    uint32_t i;
+    Dwarf_Error err;
+    int rc;
+
+    nranges = die_ranges(dbg, cu_die, the_die, &range, &ranges, cu);
+    if (nranges && origin_name(builder, dbg, the_die, cu, &name)) {
+        rc = dwarf_attr(the_die, DW_AT_call_file, &attrib, &err);
+        CU_ASSERT(cu, dbg, rc, err);
+        if (rc == DW_DLV_OK) {
+            rc = dwarf_formudata(attrib, &file, &err);
+            CU_ASSERT(cu, dbg, rc, err);
+            dwarf_dealloc(dbg, attrib, DW_DLA_ATTR);
+        }
+
+        rc = dwarf_attr(the_die, DW_AT_call_line, &attrib, &err);
+        CU_ASSERT(cu, dbg, rc, err);
+        if (rc == DW_DLV_OK) {
+            rc = dwarf_formudata(attrib, &line, &err);
+            CU_ASSERT(cu, dbg, rc, err);
+            dwarf_dealloc(dbg, attrib, DW_DLA_ATTR);
+        }
+
+        call_file = call_file_name(builder, dbg, cu_die, cu, file);
+        for (i = 0; i < nranges; i++) {
+            builder_add_entry(builder, ranges[i].start, ranges[i].end, name);
+            builder->entries[builder->count - 1].call_file = call_file;
+            builder->entries[builder->count - 1].call_line = (uint32_t)line;
+        }
+    }
+    if (ranges != &range)
+        free(ranges);
+}
+
+/* List the function of the given subprogram DIE, if it has code.
 */
-static struct dwarf_subprogram_t *read_cu_entry(
-        struct dwarf_subprogram_t *subprograms,
-        Dwarf_Debug dbg, Dwarf_Die cu_die, Dwarf_Die the_die, Dwarf_Unsigned language)
+static void read_cu_entry(
+        struct subprograms_builder_t *builder,
+        Dwarf_Debug dbg, Dwarf_Die cu_die, Dwarf_Die the_die, struct cu_state_t *cu)
 {
     char* die_name = 0;
     Dwarf_Error err;
-    Dwarf_Half tag;
-    Dwarf_Addr lowpc = 0;
-    Dwarf_Addr highpc = 0;
+    struct addr_range_t range;
+    struct addr_range_t *ranges;
+    uint32_t nranges;
     char *filename;
-    struct dwarf_subprogram_t *subprogram = NULL;
     int rc;
     Dwarf_Attribute attrib = 0;
 
-    rc = dwarf_tag(the_die, &tag, &err);
-    if (rc != DW_DLV_OK)
-        fatal("unable to parse dwarf tag");
+    rc = dwarf_diename(the_die, &die_name, &err);
+    if (rc == DW_DLV_ERROR) {
+        cu_error(cu, dbg, err);
+        return;
+    }
+
+    /* The out-of-line copy of a function that is inlined elsewhere */
+    if (rc == DW_DLV_NO_ENTRY) {
+        uint32_t name;
+
+        nranges = die_ranges(dbg, cu_die, the_die, &range, &ranges, cu);
+        if (nranges && origin_name(builder, dbg, the_die, cu, &name)) {
+            uint32_t i;
+
+            for (i = 0; i < nranges; i++)
+                builder_add_entry(builder, ranges[i].start, ranges[i].end, name);
+        }
+        if (ranges != &range)
+            free(ranges);
+        return;
+    }
+
+    rc = dwarf_attr(cu_die, DW_AT_name, &attrib, &err);
+    CU_ASSERT(cu, dbg, rc, err);
+
+    if (rc == DW_DLV_OK) {
+        rc = dwarf_formstring(attrib, &filename, &err);
+        CU_ASSERT(cu, dbg, rc, err);
+
+        dwarf_dealloc(dbg, attrib, DW_DLA_ATTR);
+    }
+
+    nranges = die_ranges(dbg, cu_die, the_die, &range, &ranges, cu);
+    if (nranges) {
+        uint32_t name;
+
+        /* Concatenate function params in case this is Swift */
+        if (cu->language == DW_LANG_Swift)
+            name = add_function_name_with_params(builder, die_name, the_die, dbg, cu);
+        else
+            name = builder_add_string(builder, die_name);
+        builder_add_ranges(builder, ranges, nranges, name);
+    }
+    if (ranges != &range)
+        free(ranges);
+}
+
+
+/* DIEs that may have functions with code among their descendants: Swift
+ * defines methods inside the types, and C++ puts functions in namespaces
+ * and local classes in functions. Nothing else is descended into, so the
+ * members, parameters, enumerators and so on of everything else are
+ * never turned into DIEs; dwarf_siblingof() steps over them, with
+ * DW_AT_sibling when there is one. */
+static int may_contain_functions(Dwarf_Half tag)
+{
+    switch (tag) {
+        case DW_TAG_subprogram:
+        case DW_TAG_inlined_subroutine:
+        case DW_TAG_lexical_block:
+        case DW_TAG_namespace:
+        case DW_TAG_module:
+        case DW_TAG_class_type:
+        case DW_TAG_structure_type:
+        case DW_TAG_union_type:
+        case DW_TAG_enumeration_type:
+        case DW_TAG_interface_type:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void handle_die(
+        struct subprograms_builder_t *builder,
+        Dwarf_Debug dbg, Dwarf_Die cu_die, Dwarf_Die the_die, struct cu_state_t *cu)
+{
+    int rc;
+    Dwarf_Error err;
+    Dwarf_Die current_die = the_die;
+    Dwarf_Die child_die = NULL;
+    Dwarf_Die next_die;
+    Dwarf_Half tag;
+
+    do {
+        rc = dwarf_tag(current_die, &tag, &err);
+        if (rc != DW_DLV_OK) {
+            CU_ASSERT(cu, dbg, rc, err);
+            dwarf_dealloc(dbg, current_die, DW_DLA_DIE);
+            return;
+        }
+
+        /* Only interested in functions here, and where they were inlined */
+        if (tag == DW_TAG_subprogram)
+            read_cu_entry(builder, dbg, cu_die, current_die, cu);
+        else if (tag == DW_TAG_inlined_subroutine)
+            read_inlined_entry(builder, dbg, cu_die, current_die, cu);
+
+        /* Recursive call handle_die with child, to continue searching within child dies */
+        if (may_contain_functions(tag) && !cu->failed) {
+            rc = dwarf_child(current_die, &child_die, &err);
+            CU_ASSERT(cu, dbg, rc, err);
+            if (rc == DW_DLV_OK && child_die)
+                handle_die(builder, dbg, cu_die, child_die, cu);
+        }
+
+        if (cu->failed) {
+            dwarf_dealloc(dbg, current_die, DW_DLA_DIE);
+            return;
+        }
+
+        rc = dwarf_siblingof(dbg, current_die, &next_die, &err);
+        CU_ASSERT(cu, dbg, rc, err);
+
+        dwarf_dealloc(dbg, current_die, DW_DLA_DIE);
+
+        current_die = next_die;
+    } while (rc == DW_DLV_OK);
+}
+
+/* Read the functions of the CU whose header dwarf_next_cu_header() just
+ * returned. With addresses, a CU whose ranges hold none of them is
+ * skipped; one that doesn't give its ranges is read all the same.
+ * Returns -1 if libdwarf failed on it. */
+static int read_cu(struct subprograms_builder_t *builder, Dwarf_Debug dbg,
+                   const Dwarf_Addr *addresses, uint32_t naddresses)
+{
+    Dwarf_Error err;
+    Dwarf_Die no_die = 0, cu_die, child_die;
+    struct cu_state_t cu = {0};
+    Dwarf_Attribute language_attr = 0;
+    int ret;
+
+    /* Expect the CU to have a single sibling - a DIE */
+    ret = dwarf_siblingof(dbg, no_die, &cu_die, &err);
+    /* If there's either an error in obtaining the die, or no entry exits for the current CU, skip it */
+    if (ret != DW_DLV_OK)
+        return 0;
+
+    if (addresses) {
+        struct addr_range_t range;
+        struct addr_range_t *ranges;
+        uint32_t nranges = die_ranges(dbg, cu_die, cu_die, &range, &ranges, &cu);
+        int skip = nranges && !ranges_hold_any(ranges, nranges, addresses, naddresses);
+
+        if (ranges != &range)
+            free(ranges);
+        if (skip) {
+            dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+            return 0;
+        }
+    }
+
+    /* Get compilation unit language attribute */
+    ret = dwarf_attr(cu_die, DW_AT_language, &language_attr, &err);
+    CU_ASSERT(&cu, dbg, ret, err);
+    if (ret == DW_DLV_OK) {
+        /* Get language attribute data */
+        ret = dwarf_formudata(language_attr, &cu.language, &err);
+        CU_ASSERT(&cu, dbg, ret, err);
+        dwarf_dealloc(dbg, language_attr, DW_DLA_ATTR);
+    }
+
+    /* Expect the CU DIE to have children */
+    if (!cu.failed) {
+        ret = dwarf_child(cu_die, &child_die, &err);
+        CU_ASSERT(&cu, dbg, ret, err);
+        if (ret == DW_DLV_OK)
+            handle_die(builder, dbg, cu_die, child_die, &cu);
+    }
+
+    cu_state_free(dbg, &cu);
+    dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+
+    return cu.failed ? -1 : 0;
+}
+
+/* A run of consecutive CUs, those starting in [start, end) of .debug_info,
+ * read by one thread into a builder of its own */
+struct cu_chunk_t {
+    Dwarf_Unsigned start;
+    Dwarf_Unsigned end;
+    struct subprograms_builder_t builder;
+};
+
+struct cu_walk_t {
+    Dwarf_Obj_Access_Interface *object;
+    struct cu_chunk_t *chunks;
+    uint32_t nchunks;
+    /* Next chunk for a thread to take */
+    uint32_t next;
+    /* See subprograms_options_t */
+    const Dwarf_Addr *addresses;
+    uint32_t naddresses;
+    const volatile int *interrupted;
+    /* Set by the first thread that libdwarf fails on; the others stop */
+    int failed;
+};
+
+/* Read chunks on dbg, one after the other, until there are none left.
+ * Chunks are taken in ascending order, so a thread only ever moves forward
+ * through the CU headers, skipping the CUs of chunks taken by others. */
+static void walk_cus(struct cu_walk_t *walk, Dwarf_Debug dbg)
+{
+    Dwarf_Unsigned cu_header_length, abbrev_offset, next_cu_header;
+    Dwarf_Half version_stamp, address_size;
+    Dwarf_Unsigned offset = 0;
+    struct cu_chunk_t *chunk = NULL;
+    Dwarf_Error err;
+    uint32_t n;
+    int ret;
+
+    for (;;) {
+        if ((walk->interrupted && *walk->interrupted) ||
+            __atomic_load_n(&walk->failed, __ATOMIC_RELAXED))
+            return;
+
+        ret = dwarf_next_cu_header(
+                dbg,
+                &cu_header_length,
+                &version_stamp,
+                &abbrev_offset,
+                &address_size,
+                &next_cu_header,
+                &err);
+        if (ret == DW_DLV_ERROR) {
+            warning("dwarf_errmsg: %s", dwarf_errmsg(err));
+            dwarf_dealloc(dbg, err, DW_DLA_ERROR);
+            __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        if (ret == DW_DLV_NO_ENTRY)
+            break;
+
+        while (!chunk || offset >= chunk->end) {
+            if (chunk)
+                qsort(chunk->builder.entries, chunk->builder.count,
+                      sizeof(*chunk->builder.entries), compare_entries);
+
+            n = __atomic_fetch_add(&walk->next, 1, __ATOMIC_RELAXED);
+            if (n >= walk->nchunks)
+                return;
+            chunk = &walk->chunks[n];
+        }
+
+        if (offset >= chunk->start &&
+            read_cu(&chunk->builder, dbg, walk->addresses, walk->naddresses) < 0) {
+            __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        offset = next_cu_header;
+    }
+
+    if (chunk)
+        qsort(chunk->builder.entries, chunk->builder.count,
+              sizeof(*chunk->builder.entries), compare_entries);
+}
+
+static void *walk_cus_thread(void *ptr)
+{
+    struct cu_walk_t *walk = ptr;
+    Dwarf_Debug dbg;
+    Dwarf_Error err;
+    int ret;
+
+    /* libdwarf isn't thread-safe, but separate instances over the same
+     * object are. With no handler, every error comes back through err. */
+    ret = dwarf_object_init(walk->object, NULL, NULL, &dbg, &err);
+    if (ret != DW_DLV_OK) {
+        if (ret == DW_DLV_ERROR)
+            warning("dwarf_errmsg: %s", dwarf_errmsg(err));
+        else
+            warning("no DWARF to walk");
+        __atomic_store_n(&walk->failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    walk_cus(walk, dbg);
+
+    dwarf_object_finish(dbg, &err);
+    return NULL;
+}
+
+/* Offsets of the CUs in .debug_info, from the length at the start of each
+ * header, and the size of the section. Returns the number of CUs, 0 if
+ * there is no .debug_info. */
+static uint32_t find_cus(Dwarf_Obj_Access_Interface *object, Dwarf_Unsigned **offsets,
+                         Dwarf_Unsigned *size)
+{
+    const Dwarf_Obj_Access_Methods *methods = object->methods;
+    Dwarf_Obj_Access_Section section;
+    Dwarf_Small *data = NULL;
+    Dwarf_Unsigned offset;
+    Dwarf_Unsigned i;
+    uint32_t count = 0, capacity = 0;
+    int error;
+
+    *offsets = NULL;
+    *size = 0;
+
+    for (i = 0; i < methods->get_section_count(object->object); i++) {
+        if (methods->get_section_info(object->object, i, &section, &error) == DW_DLV_OK &&
+            strcmp(section.name, ".debug_info") == 0) {
+            if (methods->load_section(object->object, i, &data, &error) != DW_DLV_OK)
+                data = NULL;
+            break;
+        }
+    }
+    if (!data)
+        return 0;
+
+    for (offset = 0; offset + sizeof(uint32_t) <= section.size; ) {
+        uint32_t length32;
+        uint64_t length;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            *offsets = realloc(*offsets, sizeof(**offsets) * capacity);
+            if (!*offsets)
+                fatal("unable to allocate memory");
+        }
+        (*offsets)[count++] = offset;
+
+        /* The 64-bit DWARF format escapes the length */
+        memcpy(&length32, data + offset, sizeof(length32));
+        if (length32 == 0xffffffff) {
+            if (offset + sizeof(uint32_t) + sizeof(uint64_t) > section.size)
+                break;
+            memcpy(&length, data + offset + sizeof(uint32_t), sizeof(length));
+            offset += sizeof(uint32_t) + sizeof(uint64_t);
+        } else {
+            length = length32;
+            offset += sizeof(uint32_t);
+        }
+        if (length > section.size - offset)
+            break;
+        offset += length;
+    }
+
+    *size = section.size;
+    return count;
+}
 
-    /* Only interested in subprogram DIEs here */
-    if (tag != DW_TAG_subprogram)
-        return subprograms;
+/* Order of two chunk heads in the merge; chunks are in CU order, so with
+ * identical ranges the entry of the earlier chunk comes first, as it would
+ * had everything been read by one thread */
+static int compare_heads(const struct cu_chunk_t *chunks, const uint32_t *pos,
+                         uint32_t a, uint32_t b)
+{
+    int ret = compare_entries(&chunks[a].builder.entries[pos[a]],
+                              &chunks[b].builder.entries[pos[b]]);
 
-    rc = dwarf_diename(the_die, &die_name, &err);
-    if (rc == DW_DLV_ERROR)
-        fatal("unable to parse dwarf diename");
+    if (ret == 0)
+        return a < b ? -1 : 1;
+    return ret;
+}
 
-    if (rc == DW_DLV_NO_ENTRY)
-        return subprograms;
+static void sift_down(const struct cu_chunk_t *chunks, const uint32_t *pos,
+                      uint32_t *heap, uint32_t count, uint32_t i)
+{
+    for (;;) {
+        uint32_t least = i;
+        uint32_t child = 2 * i + 1;
+        uint32_t swap;
+
+        if (child < count && compare_heads(chunks, pos, heap[child], heap[least]) < 0)
+            least = child;
+        if (child + 1 < count && compare_heads(chunks, pos, heap[child + 1], heap[least]) < 0)
+            least = child + 1;
+        if (least == i)
+            return;
+
+        swap = heap[i];
+        heap[i] = heap[least];
+        heap[least] = swap;
+        i = least;
+    }
+}
 
-    rc = dwarf_attr(cu_die, DW_AT_name, &attrib, &err);
-    DWARF_ASSERT(rc, err);
+/* Index of offset in the sorted offsets of the strings of a chunk */
+static uint32_t find_string(const size_t *offsets, uint32_t count, uint32_t offset)
+{
+    uint32_t lo = 0, hi = count;
 
-    if (rc != DW_DLV_NO_ENTRY) {
-        rc = dwarf_formstring(attrib, &filename, &err);
-        DWARF_ASSERT(rc, err);
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
 
-        dwarf_dealloc(dbg, attrib, DW_DLA_ATTR);
+        if (offsets[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    rc = dwarf_lowpc(the_die, &lowpc, &err);
-    DWARF_ASSERT(rc, err);
+/* Add the strings of chunk to the pool of merged, in order, pointing its
+ * entries at them. Taken chunk by chunk this leaves the pool as a single
+ * builder walking every CU would have, however the CUs were split. */
+static void merge_strings(struct subprograms_builder_t *merged,
+                          struct subprograms_builder_t *chunk)
+{
+    size_t *offsets, *merged_offsets;
+    uint32_t count = 0;
+    size_t offset;
+    uint32_t i;
+
+    offsets = malloc(sizeof(*offsets) * (chunk->pool_count ? chunk->pool_count : 1));
+    merged_offsets = malloc(sizeof(*merged_offsets) * (chunk->pool_count ? chunk->pool_count : 1));
+    if (!offsets || !merged_offsets)
+        fatal("unable to allocate memory");
 
-    Dwarf_Half form = NULL;
-    enum Dwarf_Form_Class class = 0;
-    rc = dwarf_highpc_b(the_die, &highpc, &form, &class, &err);
-    DWARF_ASSERT(rc, err);
+    for (offset = 0; offset < chunk->strings_size; count++) {
+        size_t len = strlen(chunk->strings + offset);
+        size_t start = merged->strings_size;
 
-    if (class == DW_FORM_CLASS_CONSTANT) {
-        highpc += lowpc;
+        builder_append(merged, chunk->strings + offset, len);
+        offsets[count] = offset;
+        merged_offsets[count] = builder_end_string(merged, start);
+        offset += len + 1;
     }
 
-    /* TODO: when would these not be defined? */
-    if (lowpc && highpc) {
-        subprogram = malloc(sizeof(*subprogram));
-        if (!subprogram)
-            fatal("unable to allocate memory");
-        memset(subprogram, 0, sizeof(*subprogram));
-
-        char* symbol_name = die_name;
-
-        /* Concatenate function params in case this is Swift */
-        if (language == DW_LANG_Swift)
-            symbol_name = get_function_name_with_params(die_name, the_die, dbg);
-        
-        subprogram->lowpc = lowpc;
-        subprogram->highpc = highpc;
-        subprogram->name = symbol_name;
+    for (i = 0; i < chunk->count; i++) {
+        struct subprogram_entry_t *entry = &chunk->entries[i];
 
-        subprogram->next = subprograms;
-        subprograms = subprogram;
+        entry->name = merged_offsets[find_string(offsets, count, entry->name)];
+        if (entry->call_file != SUBPROGRAMS_NOT_INLINED)
+            entry->call_file = merged_offsets[find_string(offsets, count, entry->call_file)];
     }
 
-    return subprograms;
+    free(merged_offsets);
+    free(offsets);
 }
 
-
-static void handle_die(
-        struct dwarf_subprogram_t **subprograms,
-        Dwarf_Debug dbg, Dwarf_Die cu_die, Dwarf_Die the_die, Dwarf_Unsigned language)
+/* K-way merge of the sorted chunks into one table, with the strings of
+ * each chunk interned again into a single pool, in chunk order */
+static struct dwarf_subprograms_t *merge_chunks(struct cu_chunk_t *chunks, uint32_t nchunks)
 {
-    int rc;
-    Dwarf_Error err;
-    Dwarf_Die current_die = the_die;
-    Dwarf_Die child_die = NULL;
-    Dwarf_Die next_die;
+    struct subprograms_builder_t merged = {0};
+    uint32_t *heap, *pos;
+    uint32_t count = 0;
+    uint32_t i;
+
+    heap = malloc(sizeof(*heap) * nchunks);
+    pos = calloc(nchunks, sizeof(*pos));
+    if (!heap || !pos)
+        fatal("unable to allocate memory");
 
-    do {
-        *subprograms = read_cu_entry(*subprograms, dbg, cu_die, current_die, language);
-        /* Recursive call handle_die with child, to continue searching within child dies */
-        rc = dwarf_child(current_die, &child_die, &err);
-        DWARF_ASSERT(rc, err);
-        if (rc == DW_DLV_OK && child_die)
-            handle_die(subprograms, dbg, cu_die, child_die, language);
+    for (i = 0; i < nchunks; i++) {
+        merged.count += chunks[i].builder.count;
+        merge_strings(&merged, &chunks[i].builder);
+        if (chunks[i].builder.count)
+            heap[count++] = i;
+    }
 
-        rc = dwarf_siblingof(dbg, current_die, &next_die, &err);
-        DWARF_ASSERT(rc, err);
+    merged.entries = malloc(sizeof(*merged.entries) * (merged.count ? merged.count : 1));
+    if (!merged.entries)
+        fatal("unable to allocate memory");
 
-        dwarf_dealloc(dbg, current_die, DW_DLA_DIE);
+    for (i = count; i-- > 0; )
+        sift_down(chunks, pos, heap, count, i);
 
-        current_die = next_die;
-    } while (rc != DW_DLV_NO_ENTRY);
-}
+    for (i = 0; count; i++) {
+        uint32_t n = heap[0];
 
-static struct dwarf_subprogram_t *read_from_cus(Dwarf_Debug dbg)
-{
-    Dwarf_Unsigned cu_header_length, abbrev_offset, next_cu_header;
-    Dwarf_Half version_stamp, address_size;
-    Dwarf_Error err;
-    Dwarf_Die no_die = 0, cu_die, child_die;
-    int ret = DW_DLV_OK;
-    struct dwarf_subprogram_t *subprograms = NULL;
-    Dwarf_Unsigned language = 0;
-    Dwarf_Attribute language_attr = 0;
+        merged.entries[i] = chunks[n].builder.entries[pos[n]];
 
-    while (ret == DW_DLV_OK) {
-        ret = dwarf_next_cu_header(
-                dbg,
-                &cu_header_length,
-                &version_stamp,
-                &abbrev_offset,
-                &address_size,
-                &next_cu_header,
-                &err);
-        DWARF_ASSERT(ret, err);
+        if (++pos[n] == chunks[n].builder.count)
+            heap[0] = heap[--count];
+        sift_down(chunks, pos, heap, count, 0);
+    }
 
-        if (ret == DW_DLV_NO_ENTRY)
-            continue;
+    free(pos);
+    free(heap);
 
-        /* TODO: If the CU can provide an address range then we can skip over
-         * all the entire die if none of our addresses match */
+    return builder_finish_sorted(&merged);
+}
 
-        /* Expect the CU to have a single sibling - a DIE */
-        ret = dwarf_siblingof(dbg, no_die, &cu_die, &err);
-        /* If there's either an error in obtaining the die, or no entry exits for the current CU, continue */
-        if (ret != DW_DLV_OK) {
-            continue;
+static struct dwarf_subprograms_t *read_from_cus(Dwarf_Debug dbg,
+                                                 const struct subprograms_options_t *options)
+{
+    struct cu_walk_t walk = {
+        /* A cache has to hold every function */
+        .addresses = options->persistent ? NULL : options->addresses,
+        .naddresses = options->naddresses,
+        .interrupted = options->interrupted,
+    };
+    struct dwarf_subprograms_t *subprograms = NULL;
+    Dwarf_Unsigned *offsets = NULL;
+    Dwarf_Unsigned size = 0;
+    uint32_t ncus = 0;
+    int nthreads = 1;
+    pthread_t *threads;
+    uint32_t i, k;
+    int t;
+
+    if (options->object) {
+        ncus = find_cus(options->object, &offsets, &size);
+
+        nthreads = options->nthreads;
+        if (nthreads <= 0) {
+            nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+            if (nthreads > SUBPROGRAMS_MAX_THREADS)
+                nthreads = SUBPROGRAMS_MAX_THREADS;
+            if ((Dwarf_Unsigned)nthreads > size / SUBPROGRAMS_MIN_THREAD_SIZE)
+                nthreads = (int)(size / SUBPROGRAMS_MIN_THREAD_SIZE);
         }
-        DWARF_ASSERT(ret, err);
+        if (nthreads > 0 && (uint32_t)nthreads > ncus)
+            nthreads = (int)ncus;
+        if (nthreads < 1)
+            nthreads = 1;
+    }
 
-        /* Get compilation unit language attribute */
-        ret = dwarf_attr(cu_die, DW_AT_language, &language_attr, &err);
-        DWARF_ASSERT(ret, err);
-        if (ret != DW_DLV_NO_ENTRY) {
-            /* Get language attribute data */
-            ret = dwarf_formudata(language_attr, &language, &err);
-            DWARF_ASSERT(ret, err);
-            dwarf_dealloc(dbg, language_attr, DW_DLA_ATTR);
+    /* Cut the CUs into runs of about the same size */
+    walk.nchunks = nthreads > 1 ? nthreads * SUBPROGRAMS_CHUNKS_PER_THREAD : 1;
+    if (walk.nchunks > ncus && ncus)
+        walk.nchunks = ncus;
+    walk.chunks = calloc(walk.nchunks, sizeof(*walk.chunks));
+    if (!walk.chunks)
+        fatal("unable to allocate memory");
+    for (i = 1, k = 0; i < ncus && k + 1 < walk.nchunks; i++) {
+        if (offsets[i] >= size * (k + 1) / walk.nchunks) {
+            walk.chunks[k].end = offsets[i];
+            walk.chunks[++k].start = offsets[i];
         }
+    }
+    /* Whatever libdwarf finds past the last header read here */
+    walk.chunks[k].end = (Dwarf_Unsigned)-1;
+    walk.nchunks = k + 1;
+    free(offsets);
+
+    if (nthreads == 1) {
+        walk_cus(&walk, dbg);
+    } else {
+        walk.object = options->object;
+
+        threads = malloc(sizeof(*threads) * nthreads);
+        if (!threads)
+            fatal("unable to allocate memory");
 
-        /* Expect the CU DIE to have children */
-        ret = dwarf_child(cu_die, &child_die, &err);
-        DWARF_ASSERT(ret, err);
+        /* The calling thread reads chunks too, without touching dbg, which
+         * may still be used by whoever opened it */
+        for (t = 1; t < nthreads; t++) {
+            int err = pthread_create(&threads[t], NULL, walk_cus_thread, &walk);
+            if (err != 0)
+                fatal("unable to create thread: %s", strerror(err));
+        }
+        walk_cus_thread(&walk);
+        for (t = 1; t < nthreads; t++)
+            pthread_join(threads[t], NULL);
+        free(threads);
+    }
 
-        handle_die(&subprograms, dbg, cu_die, child_die, language);  
+    /* A table with CUs missing would be cached as if complete */
+    if (!(walk.interrupted && *walk.interrupted) && !walk.failed)
+        subprograms = walk.nchunks == 1 ? builder_finish_sorted(&walk.chunks[0].builder) :
+                                          merge_chunks(walk.chunks, walk.nchunks);
 
-        dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
-    }
+    for (i = 0; i < walk.nchunks; i++)
+        builder_free(&walk.chunks[i].builder);
+    free(walk.chunks);
 
     return subprograms;
 }
 
-static char *get_cache_filename(struct subprograms_options_t *options,
-                                uint8_t uuid[UUID_LEN])
+static char *get_cache_filename(const char *dir, uint8_t uuid[UUID_LEN])
 {
+    char *filename = malloc(strlen(dir) + strlen("/") + UUID_LEN * 2 + 1);
+    char *p;
     int i;
-    int max_dirlen  =
-        MAX(strlen(getenv("HOME")) + strlen("/") + strlen(SUBPROGRAMS_CACHE_PATH),
-            options->cache_dir ? strlen(options->cache_dir) : 0);
-    size_t filename_len =
-        max_dirlen + strlen("/") + (UUID_LEN * sizeof(char) * 2) + 1;
-
-    char *filename = malloc(sizeof(char) * filename_len);
-    memset(filename, 0, filename_len);
 
-    /* First generate the directory */
-    if (options->cache_dir)
-        sprintf(filename, "%s/", options->cache_dir);
-    else
-        sprintf(filename, "%s/" SUBPROGRAMS_CACHE_PATH, getenv("HOME"));
-
-    if (access(filename, F_OK) != 0) {
-        if (errno == ENOENT) {
-            int ret = mkdir(filename, 0777);
-
-            if (ret < 0)
-                fatal("unable to create %s: %s", filename, strerror(errno));
-        }
-    }
+    if (!filename)
+        fatal("unable to allocate memory");
 
-    /* Then add the filename (ascii version of uuid) */
-    filename = strcat(filename, "/");
-    char *p = filename + strlen(filename);
+    /* The ascii version of the uuid */
+    p = filename + sprintf(filename, "%s/", dir);
     for (i = 0; i < UUID_LEN; i++)
         p += sprintf(p, "%.02x", uuid[i]);
 
@@ -331,19 +1549,20 @@ static char *get_cache_filename(struct subprograms_options_t *options,
 }
 
 /* simple but too slow */
-struct dwarf_subprogram_t *read_from_globals(Dwarf_Debug dbg)
+struct dwarf_subprograms_t *read_from_globals(Dwarf_Debug dbg)
 {
     Dwarf_Global *globals = NULL;
     Dwarf_Signed nglobals;
     Dwarf_Off die_off, cu_off; // (Appsee modification, see below)
     Dwarf_Die die, cu_die; // (Appsee modification, see below)
-    Dwarf_Addr lowpc = 0;
-    Dwarf_Addr highpc = 0;
+    struct addr_range_t range;
+    struct addr_range_t *ranges;
+    uint32_t nranges;
     Dwarf_Error err;
     Dwarf_Attribute attrib = 0;
-    struct dwarf_subprogram_t *subprograms = NULL;
-    struct dwarf_subprogram_t *subprogram = NULL;
+    struct subprograms_builder_t builder = {0};
     char *name;
+    uint32_t name_offset;
     int i;
     int ret;
     Dwarf_Unsigned language = 0;
@@ -366,25 +1585,11 @@ struct dwarf_subprogram_t *read_from_globals(Dwarf_Debug dbg)
         ret = dwarf_offdie(dbg, die_off, &die, &err);
         DWARF_ASSERT(ret, err);
 
-        ret = dwarf_lowpc(die, &lowpc, &err);
-        DWARF_ASSERT(ret, err);
-
-        Dwarf_Half form = NULL;
-        enum Dwarf_Form_Class class = 0;
-        ret = dwarf_highpc_b(die, &highpc, &form, &class, &err);
+        ret = dwarf_offdie(dbg, cu_off, &cu_die, &err);
         DWARF_ASSERT(ret, err);
-        
-        if (class == DW_FORM_CLASS_CONSTANT) {
-            highpc += lowpc;
-        }
-
-        /* TODO: when would these not be defined? */
-        if (lowpc && highpc) {
-            subprogram = malloc(sizeof(*subprogram));
-            if (!subprogram)
-                fatal("unable to allocate memory for subprogram");
-            memset(subprogram, 0, sizeof(*subprogram));
 
+        nranges = die_ranges(dbg, cu_die, die, &range, &ranges, NULL);
+        if (nranges) {
             ///////////////////////////////
             // Appsee modification:
             // Make sure subprogram->name returned from "read_from_globals" will be the same one as "read_cu_entry"
@@ -399,9 +1604,6 @@ struct dwarf_subprogram_t *read_from_globals(Dwarf_Debug dbg)
             //     DWARF_ASSERT(ret, err);
             // }
 
-            ret = dwarf_offdie(dbg, cu_off, &cu_die, &err);
-            DWARF_ASSERT(ret, err);
-
             /* Get compilation unit language attribute */
             ret = dwarf_attr(cu_die, DW_AT_language, &language_attr, &err);
             DWARF_ASSERT(ret, err);
@@ -417,10 +1619,6 @@ struct dwarf_subprogram_t *read_from_globals(Dwarf_Debug dbg)
 
             name = die_name;
 
-            /* Concatenate function params in case this is Swift */
-            if (language == DW_LANG_Swift && die_name)
-                name = get_function_name_with_params(die_name, die, dbg);
-
             /* if name is null set the name as it was before Appsee modification */
             if (!name) {
                 ret = dwarf_attr(die, DW_AT_MIPS_linkage_name, &attrib, &err);
@@ -437,113 +1635,405 @@ struct dwarf_subprogram_t *read_from_globals(Dwarf_Debug dbg)
             // End of Appsee modification
             ///////////////////////////////
 
-            subprogram->lowpc = lowpc;
-            subprogram->highpc = highpc;
-            subprogram->name = name;
-
-            subprogram->next = subprograms;
-            subprograms = subprogram;
+            /* Concatenate function params in case this is Swift */
+            if (language == DW_LANG_Swift && die_name)
+                name_offset = add_function_name_with_params(&builder, die_name, die, dbg, NULL);
+            else
+                name_offset = builder_add_string(&builder, name);
+            builder_add_ranges(&builder, ranges, nranges, name_offset);
         }
+        if (ranges != &range)
+            free(ranges);
 
+        dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
         dwarf_dealloc(dbg, die, DW_DLA_DIE);
     }
 
-    return subprograms;
+    return builder_finish(&builder);
 }
 
-static struct dwarf_subprogram_t *load_subprograms(const char *filename)
+static struct dwarf_subprograms_t *load_subprograms_v1(int fd)
 {
     ssize_t ret;
-    int i;
+    unsigned int i;
     struct atosl_cache_header_t cache_header = {0};
     struct atosl_cache_entry_t cache_entry;
-    struct dwarf_subprogram_t *subprograms = NULL;
-    int fd;
+    struct subprograms_builder_t builder = {0};
     unsigned int cksum = 0;
-
-    struct dwarf_subprogram_t *subprogram;
-
-    fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        warning("unable to open cache for reading at %s: %s",
-                filename, strerror(errno));
-        goto error;
-    }
+    char *name = NULL;
 
     ret = _read(fd, &cache_header, sizeof(cache_header));
-    if (ret < 0) {
+    if (ret < (ssize_t)sizeof(cache_header)) {
         warning("unable to read data from cache: %s", strerror(errno));
         goto error;
     }
 
-    if (cache_header.magic != SUBPROGRAMS_CACHE_MAGIC) {
-        warning("Wrong file magic: expected %x, read %x",
-                SUBPROGRAMS_CACHE_MAGIC, cache_header.magic);
-        goto error;
-    }
-
-    if (cache_header.version != SUBPROGRAMS_CACHE_VERSION) {
-        warning("Unable to handle cache version %d", cache_header.version);
-        goto error;
-    }
-
     for (i = 0; i < cache_header.n_entries; i++) {
+        int namelen;
+
         ret = _read(fd, &cache_entry, sizeof(cache_entry));
-        if (ret < 0) {
+        if (ret < (ssize_t)sizeof(cache_entry)) {
             warning("unable to read data from cache: %s", strerror(errno));
             goto error;
         }
         cksum = checksum(cksum, (unsigned char *)&cache_entry, sizeof(cache_entry));
 
-        subprogram = malloc(sizeof(*subprogram));
-        if (!subprogram)
+        /* Copied, as the reads below may as well have changed cache_entry */
+        namelen = cache_entry.namelen;
+        if (namelen <= 0) {
+            warning("invalid name length in cache: %d", namelen);
+            goto error;
+        }
+        name = realloc(name, namelen);
+        if (!name)
             fatal("unable to allocate memory");
-        memset(subprogram, 0, sizeof(*subprogram));
-
-        subprogram->lowpc = cache_entry.lowpc;
-        subprogram->highpc = cache_entry.highpc;
-        subprogram->name = malloc(sizeof(char)*cache_entry.namelen);
-        ret = _read(fd, (char *)subprogram->name, cache_entry.namelen);
-        if (ret < 0) {
+        ret = _read(fd, name, namelen);
+        if (ret < namelen) {
             warning("unable to read data from cache: %s", strerror(errno));
             goto error;
         }
-        cksum = checksum(cksum, (unsigned char *)subprogram->name, cache_entry.namelen);
+        name[namelen - 1] = '\0';
+        cksum = checksum(cksum, (unsigned char *)name, namelen);
 
-        subprogram->next = subprograms;
-        subprograms = subprogram;
+        builder_add(&builder, cache_entry.lowpc, cache_entry.highpc, name);
     }
 
-    close(fd);
+    free(name);
 
     if (cache_header.cksum != cksum) {
         warning("Invalid checksum: expected %x, read %x",
                 cache_header.cksum, cksum);
-        goto error;
+        builder_free(&builder);
+        return NULL;
     }
 
-    return subprograms;
+    return builder_finish(&builder);
 
 error:
-    if (fd > 0)
-        close(fd);
-
-    warning("can't read cache from %s", filename);
+    free(name);
+    builder_free(&builder);
     return NULL;
 }
 
-static void save_subprograms(const char *filename, struct dwarf_subprogram_t *subprograms)
+/* A region of count elements of size bytes at offset, inside the file */
+static int cache_region_valid(const struct atosl_cache_mapped_header_t *header,
+                              uint64_t offset, uint64_t count, uint64_t size)
+{
+    return offset % 8 == 0 &&
+           offset >= sizeof(*header) &&
+           offset <= header->file_size &&
+           count <= (header->file_size - offset) / size;
+}
+
+/* CRC of the header, as if header_crc were 0, and of the block CRCs after
+ * it */
+static uint32_t header_crc(const struct atosl_cache_mapped_header_t *header)
 {
+    struct atosl_cache_mapped_header_t copy = *header;
+    uint32_t crc;
+
+    copy.header_crc = 0;
+    crc = crc32c(0, &copy, sizeof(copy));
+    return crc32c(crc, (const char *)header + header->crc_offset,
+                  sizeof(uint32_t) * (uint64_t)header->nblocks);
+}
+
+static int cache_header_valid(const struct atosl_cache_mapped_header_t *header, size_t file_size,
+                              uint8_t uuid[UUID_LEN], enum subprograms_type_t type,
+                              const struct subprograms_options_t *options)
+{
+    if (header->file_size != file_size) {
+        warning("truncated cache: expected %llu bytes, found %zu",
+                (unsigned long long)header->file_size, file_size);
+        return 0;
+    }
+
+    if (header->block_size == 0 ||
+        header->blocks_offset < sizeof(*header) || header->blocks_offset > header->crc_offset ||
+        !cache_region_valid(header, header->crc_offset, header->nblocks, sizeof(uint32_t)) ||
+        header->nblocks != (header->crc_offset - header->blocks_offset + header->block_size - 1) /
+                           header->block_size) {
+        warning("invalid cache layout");
+        return 0;
+    }
+
+    if (header_crc(header) != header->header_crc) {
+        warning("corrupt cache header");
+        return 0;
+    }
+
+    /* The file name is the UUID, so this only fails on corruption */
+    if (memcmp(header->uuid, uuid, UUID_LEN) != 0) {
+        warning("cache is for another UUID");
+        return 0;
+    }
+
+    /* Not errors, but the table has to be built again */
+    if (header->cputype != options->cputype || header->cpusubtype != options->cpusubtype ||
+        header->type != type || header->addr_size != sizeof(Dwarf_Addr))
+        return 0;
+
+    if (!cache_region_valid(header, header->lowpc_offset, header->count, sizeof(Dwarf_Addr)) ||
+        !cache_region_valid(header, header->highpc_offset, header->count, sizeof(Dwarf_Addr)) ||
+        !cache_region_valid(header, header->name_offset, header->count, sizeof(uint32_t)) ||
+        !cache_region_valid(header, header->parent_offset, header->count, sizeof(int32_t)) ||
+        !cache_region_valid(header, header->call_file_offset, header->count, sizeof(uint32_t)) ||
+        !cache_region_valid(header, header->call_line_offset, header->count, sizeof(uint32_t)) ||
+        !cache_region_valid(header, header->strings_offset, header->strings_size, 1) ||
+        header->strings_size == 0) {
+        warning("invalid cache layout");
+        return 0;
+    }
+
+    if (header->lines_offset &&
+        !cache_region_valid(header, header->lines_offset, header->lines_size, 1)) {
+        warning("invalid cache layout");
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Map a cache and point a struct dwarf_subprograms_t, and the line table if
+ * there is one, into it. Nothing is read or copied up front; pages are
+ * faulted in as lookups touch them. */
+static struct dwarf_subprograms_t *map_subprograms(const char *filename, int fd,
+                                                   uint8_t uuid[UUID_LEN],
+                                                   enum subprograms_type_t type,
+                                                   const struct subprograms_options_t *options,
+                                                   struct dwarf_linetab_t **linetab)
+{
+    struct stat st;
+    const struct atosl_cache_mapped_header_t *header;
+    struct dwarf_subprograms_t *subprograms;
+    struct crc32c_blocks_t *blocks;
+    char *map;
+
+    if (fstat(fd, &st) < 0) {
+        warning("unable to stat cache: %s", strerror(errno));
+        return NULL;
+    }
+    if (st.st_size < (off_t)sizeof(*header)) {
+        warning("truncated cache header");
+        return NULL;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        warning("unable to map cache: %s", strerror(errno));
+        return NULL;
+    }
+
+    header = (const struct atosl_cache_mapped_header_t *)map;
+    if (!cache_header_valid(header, st.st_size, uuid, type, options)) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    blocks = crc32c_blocks_create(map + header->blocks_offset,
+                                  header->crc_offset - header->blocks_offset, header->block_size,
+                                  (const uint32_t *)(map + header->crc_offset), filename);
+
+    /* lowpc is searched by every lookup, so all of it is checked now. The
+     * last byte of the pool is checked so that it can stop every name. */
+    if (!crc32c_blocks_verify(blocks, map + header->lowpc_offset,
+                              sizeof(Dwarf_Addr) * (uint64_t)header->count) ||
+        !crc32c_blocks_verify(blocks, map + header->strings_offset + header->strings_size - 1, 1) ||
+        map[header->strings_offset + header->strings_size - 1] != '\0') {
+        warning("invalid cache string pool or addresses");
+        crc32c_blocks_free(blocks);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    if (linetab && header->lines_offset) {
+        *linetab = linetab_open(map + header->lines_offset, header->lines_size, blocks);
+        if (!*linetab)
+            warning("invalid line table in cache");
+    }
+
+    subprograms = malloc(sizeof(*subprograms));
+    if (!subprograms)
+        fatal("unable to allocate memory");
+    memset(subprograms, 0, sizeof(*subprograms));
+
+    subprograms->count = header->count;
+    subprograms->lowpc = (Dwarf_Addr *)(map + header->lowpc_offset);
+    subprograms->highpc = (Dwarf_Addr *)(map + header->highpc_offset);
+    subprograms->name = (uint32_t *)(map + header->name_offset);
+    subprograms->parent = (int32_t *)(map + header->parent_offset);
+    subprograms->call_file = (uint32_t *)(map + header->call_file_offset);
+    subprograms->call_line = (uint32_t *)(map + header->call_line_offset);
+    subprograms->strings = map + header->strings_offset;
+    subprograms->strings_size = header->strings_size;
+    subprograms->map = map;
+    subprograms->map_size = st.st_size;
+    subprograms->blocks = blocks;
+
+    cachedir_touch(fd);
+
+    /* No work for the default sorted layout, which searches lowpc itself */
+    addr_index_build(&subprograms->index, subprograms->lowpc, subprograms->count);
+
+    return subprograms;
+}
+
+/* Load a cache of any version, and its line table into *linetab if there is
+ * one and linetab isn't NULL. *stale is set when the cache should be saved
+ * again, in the current version. */
+static struct dwarf_subprograms_t *load_subprograms(const char *filename, uint8_t uuid[UUID_LEN],
+                                                    enum subprograms_type_t type,
+                                                    const struct subprograms_options_t *options,
+                                                    struct dwarf_linetab_t **linetab,
+                                                    int *stale)
+{
+    struct dwarf_subprograms_t *subprograms = NULL;
+    uint32_t prefix[2];
     ssize_t ret;
-    off_t offset;
-    unsigned int cksum = 0;
-    struct atosl_cache_header_t cache_header = {
-        .magic = SUBPROGRAMS_CACHE_MAGIC,
-        .version = SUBPROGRAMS_CACHE_VERSION,
-    };
+    int fd;
 
-    struct atosl_cache_entry_t cache_entry;
+    *stale = 0;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        warning("unable to open cache for reading at %s: %s",
+                filename, strerror(errno));
+        return NULL;
+    }
+
+    /* All versions start with the magic and the version */
+    ret = _pread(fd, prefix, sizeof(prefix), 0);
+    if (ret < (ssize_t)sizeof(prefix)) {
+        warning("unable to read data from cache: %s", strerror(errno));
+    } else if (prefix[0] != SUBPROGRAMS_CACHE_MAGIC) {
+        warning("Wrong file magic: expected %x, read %x",
+                SUBPROGRAMS_CACHE_MAGIC, prefix[0]);
+    } else if (prefix[1] == 1) {
+        subprograms = load_subprograms_v1(fd);
+        *stale = 1;
+    } else if (prefix[1] == SUBPROGRAMS_CACHE_VERSION) {
+        subprograms = map_subprograms(filename, fd, uuid, type, options, linetab);
+    } else if (prefix[1] < SUBPROGRAMS_CACHE_VERSION) {
+        /* Versions 2 to 4 have a shorter header, and are simply built
+         * again */
+        *stale = 1;
+    } else {
+        /* Written by a newer atosl; left for it */
+        warning("Unable to handle cache version %d", prefix[1]);
+    }
+
+    close(fd);
+
+    return subprograms;
+}
+
+int subprograms_cached(uint8_t uuid[UUID_LEN], enum subprograms_type_t type,
+                       const struct subprograms_options_t *options, int lines)
+{
+    const struct atosl_cache_mapped_header_t *header;
+    struct stat st;
+    char *dir = cachedir_path(options->cache_dir, 0);
+    char *filename;
+    void *map = MAP_FAILED;
+    int cached = 0;
+    int fd;
+
+    if (!dir)
+        return 0;
+    filename = get_cache_filename(dir, uuid);
+
+    fd = open(filename, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(*header))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+        header = map;
+        /* Only the header: the rest is checked as it is used */
+        cached = header->magic == SUBPROGRAMS_CACHE_MAGIC &&
+                 header->version == SUBPROGRAMS_CACHE_VERSION &&
+                 cache_header_valid(header, st.st_size, uuid, type, options) &&
+                 (!lines || header->lines_offset);
+        munmap(map, st.st_size);
+    }
+
+    if (fd >= 0)
+        close(fd);
+    free(filename);
+    free(dir);
+
+    return cached;
+}
+
+static int write_cache_region(int fd, uint64_t offset, const void *data, uint64_t size)
+{
+    ssize_t ret = pwrite(fd, data, size, offset);
+
+    /* Regular files don't do short writes short of a full disk */
+    if (ret < 0 || (uint64_t)ret != size) {
+        warning("unable to write data to cache: %s", ret < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes the regions of a cache front to back, filling the gaps between
+ * them with zeros and taking the block CRCs as the bytes go by */
+struct cache_writer_t {
+    int fd;
+    uint64_t offset;
+    uint64_t blocks_offset;
+    uint32_t *crc;
+};
+
+static int cache_writer_put(struct cache_writer_t *writer, const void *data, uint64_t size)
+{
+    const uint8_t *p = data;
+
+    while (size) {
+        uint64_t pos = writer->offset - writer->blocks_offset;
+        uint64_t n = CRC32C_BLOCK_SIZE - pos % CRC32C_BLOCK_SIZE;
+        uint32_t *crc = &writer->crc[pos / CRC32C_BLOCK_SIZE];
+
+        if (n > size)
+            n = size;
+        *crc = crc32c(*crc, p, n);
+        if (write_cache_region(writer->fd, writer->offset, p, n) < 0)
+            return -1;
+        writer->offset += n;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int cache_writer_region(struct cache_writer_t *writer, uint64_t offset,
+                               const void *data, uint64_t size)
+{
+    static const uint8_t zeros[8];
+
+    /* Regions are 8-byte aligned, so gaps are short */
+    while (writer->offset < offset) {
+        if (cache_writer_put(writer, zeros, offset - writer->offset < sizeof(zeros) ?
+                                            offset - writer->offset : sizeof(zeros)) < 0)
+            return -1;
+    }
+    return cache_writer_put(writer, data, size);
+}
+
+/* Write the cache at filename through a temporary file next to it. A full
+ * disk, or anything else that stops it, is warned about and leaves no
+ * file behind. Returns 0 once the cache is in place, -1 otherwise. */
+static int save_subprograms(const char *filename, struct dwarf_subprograms_t *subprograms,
+                             const struct dwarf_linetab_t *linetab,
+                             uint8_t uuid[UUID_LEN], enum subprograms_type_t type,
+                             const struct subprograms_options_t *options)
+{
+    struct atosl_cache_mapped_header_t header;
+    struct cache_writer_t writer;
+    uint64_t offset;
     int fd;
+    int ret;
+    int failed;
 
     /* We want to put the tempfile in the same directory as the final file so we
      * can assure an atomic rename.
@@ -556,72 +2046,215 @@ static void save_subprograms(const char *filename, struct dwarf_subprogram_t *su
      * the basename
      */
     char *basename = dname + strlen(dname) + 1;
+    if (!tempfile || !pathbits)
+        fatal("unable to allocate memory");
     sprintf(tempfile, "%s/.%s.XXXXXX", dname, basename);
 
     fd = mkstemp(tempfile);
-    if (fd < 0)
-        fatal("unable to open cache for writing at %s: %s",
-              tempfile, strerror(errno));
+    if (fd < 0) {
+        warning("unable to open cache for writing at %s: %s",
+                tempfile, strerror(errno));
+        free(tempfile);
+        free(pathbits);
+        return -1;
+    }
 
-    offset = lseek(fd, sizeof(cache_header), SEEK_SET);
-    if (offset < 0)
-        fatal("unable to seek in cache: %s", strerror(errno));
+    memset(&header, 0, sizeof(header));
+    header.magic = SUBPROGRAMS_CACHE_MAGIC;
+    header.version = SUBPROGRAMS_CACHE_VERSION;
+    memcpy(header.uuid, uuid, UUID_LEN);
+    header.cputype = options->cputype;
+    header.cpusubtype = options->cpusubtype;
+    header.type = type;
+    header.addr_size = sizeof(Dwarf_Addr);
+    header.count = subprograms->count;
+
+    offset = CACHE_ALIGN(sizeof(header));
+    header.lowpc_offset = offset;
+    offset = CACHE_ALIGN(offset + sizeof(Dwarf_Addr) * (uint64_t)subprograms->count);
+    header.highpc_offset = offset;
+    offset = CACHE_ALIGN(offset + sizeof(Dwarf_Addr) * (uint64_t)subprograms->count);
+    header.name_offset = offset;
+    offset = CACHE_ALIGN(offset + sizeof(uint32_t) * (uint64_t)subprograms->count);
+    header.parent_offset = offset;
+    offset = CACHE_ALIGN(offset + sizeof(int32_t) * (uint64_t)subprograms->count);
+    header.call_file_offset = offset;
+    offset = CACHE_ALIGN(offset + sizeof(uint32_t) * (uint64_t)subprograms->count);
+    header.call_line_offset = offset;
+    offset = CACHE_ALIGN(offset + sizeof(uint32_t) * (uint64_t)subprograms->count);
+    header.strings_offset = offset;
+    /* An empty pool still gets its terminator, so the pool is never empty */
+    header.strings_size = subprograms->strings_size ? subprograms->strings_size : 1;
+    offset = CACHE_ALIGN(offset + header.strings_size);
+    if (linetab) {
+        header.lines_offset = offset;
+        header.lines_size = linetab->size;
+        offset += linetab->size;
+    }
+    header.block_size = CRC32C_BLOCK_SIZE;
+    header.blocks_offset = header.lowpc_offset;
+    header.crc_offset = CACHE_ALIGN(offset);
+    header.nblocks = (header.crc_offset - header.blocks_offset + CRC32C_BLOCK_SIZE - 1) /
+                     CRC32C_BLOCK_SIZE;
+    header.file_size = header.crc_offset + sizeof(uint32_t) * (uint64_t)header.nblocks;
+
+    writer.fd = fd;
+    writer.offset = header.blocks_offset;
+    writer.blocks_offset = header.blocks_offset;
+    writer.crc = calloc(header.nblocks + 1, sizeof(uint32_t));
+    if (!writer.crc)
+        fatal("unable to allocate memory");
 
-    struct dwarf_subprogram_t *subprogram = subprograms;
+    failed = cache_writer_region(&writer, header.lowpc_offset, subprograms->lowpc,
+                                 sizeof(Dwarf_Addr) * (uint64_t)subprograms->count) < 0 ||
+             cache_writer_region(&writer, header.highpc_offset, subprograms->highpc,
+                                 sizeof(Dwarf_Addr) * (uint64_t)subprograms->count) < 0 ||
+             cache_writer_region(&writer, header.name_offset, subprograms->name,
+                                 sizeof(uint32_t) * (uint64_t)subprograms->count) < 0 ||
+             cache_writer_region(&writer, header.parent_offset, subprograms->parent,
+                                 sizeof(int32_t) * (uint64_t)subprograms->count) < 0 ||
+             cache_writer_region(&writer, header.call_file_offset, subprograms->call_file,
+                                 sizeof(uint32_t) * (uint64_t)subprograms->count) < 0 ||
+             cache_writer_region(&writer, header.call_line_offset, subprograms->call_line,
+                                 sizeof(uint32_t) * (uint64_t)subprograms->count) < 0 ||
+             cache_writer_region(&writer, header.strings_offset,
+                                 subprograms->strings_size ? subprograms->strings : "",
+                                 header.strings_size) < 0 ||
+             (linetab &&
+              cache_writer_region(&writer, header.lines_offset, linetab->buffer,
+                                  linetab->size) < 0) ||
+             cache_writer_region(&writer, header.crc_offset, NULL, 0) < 0;
+
+    /* The header goes in last, once its CRC can be taken */
+    if (!failed) {
+        header.header_crc = crc32c(crc32c(0, &header, sizeof(header)), writer.crc,
+                                   sizeof(uint32_t) * (uint64_t)header.nblocks);
+        failed = write_cache_region(fd, header.crc_offset, writer.crc,
+                                    sizeof(uint32_t) * (uint64_t)header.nblocks) < 0 ||
+                 write_cache_region(fd, 0, &header, sizeof(header)) < 0;
+    }
+    free(writer.crc);
 
-    while (subprogram) {
-        cache_entry.lowpc = subprogram->lowpc;
-        cache_entry.highpc = subprogram->highpc;
-        cache_entry.namelen = strlen(subprogram->name)+1;
+    close(fd);
 
-        cksum = checksum(cksum, (unsigned char *)&cache_entry, sizeof(cache_entry));
-        ret = _write(fd, &cache_entry, sizeof(cache_entry));
-        if (ret < 0)
-            fatal("unable to write data to cache: %s", strerror(errno));
-        cksum = checksum(cksum, (unsigned char *)subprogram->name, cache_entry.namelen);
+    if (!failed) {
+        ret = rename(tempfile, filename);
+        if (ret < 0) {
+            warning("unable to rename cache from %s to %s: %s",
+                    tempfile, filename, strerror(errno));
+            failed = 1;
+        }
+    }
+    if (failed)
+        unlink(tempfile);
 
-        ret = _write(fd, subprogram->name, cache_entry.namelen);
-        if (ret < 0)
-            fatal("unable to write data to cache: %s", strerror(errno));
+    free(tempfile);
+    free(pathbits);
 
-        cache_header.n_entries++;
-        subprogram = subprogram->next;
-    }
+    return failed ? -1 : 0;
+}
 
-    cache_header.cksum = cksum;
+/* Take the build lock of a cache: an flock() on lockname, next to it. The
+ * kernel drops the lock when its holder goes away, however that happens, so
+ * the lock of a builder that died is simply taken again. Another holder is
+ * waited on for up to SUBPROGRAMS_CACHE_LOCK_TIMEOUT seconds. Returns the
+ * locked descriptor, or -1 if the lock couldn't be had, in which case the
+ * cache must be left alone. */
+static int lock_cache(const char *lockname, const volatile int *interrupted)
+{
+    time_t deadline = time(NULL) + SUBPROGRAMS_CACHE_LOCK_TIMEOUT;
+    struct stat locked, current;
+    int fd;
 
-    offset = lseek(fd, 0, SEEK_SET);
-    if (offset < 0)
-        fatal("unable to seek in cache: %s", strerror(errno));
+    for (;;) {
+        fd = open(lockname, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            warning("unable to open %s: %s", lockname, strerror(errno));
+            return -1;
+        }
 
-    ret = _write(fd, &cache_header, sizeof(cache_header));
-    if (ret < 0)
-        fatal("unable to write data to cache: %s", strerror(errno));
+        /* Polled rather than blocking, so that an interrupt gets through */
+        while (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+            if (errno != EWOULDBLOCK && errno != EINTR) {
+                warning("unable to lock %s: %s", lockname, strerror(errno));
+                goto error;
+            }
+            if (interrupted && *interrupted)
+                goto error;
+            if (time(NULL) >= deadline) {
+                warning("timed out waiting for %s, building without the cache", lockname);
+                goto error;
+            }
+            usleep(SUBPROGRAMS_CACHE_LOCK_POLL);
+        }
 
-    close(fd);
+        /* The holder we waited on removes the file as it unlocks; only a
+         * lock on the file that is still there counts */
+        if (fstat(fd, &locked) == 0 && stat(lockname, &current) == 0 &&
+            locked.st_dev == current.st_dev && locked.st_ino == current.st_ino)
+            return fd;
+        close(fd);
+    }
 
-    ret = rename(tempfile, filename);
-    if (ret < 0)
-        fatal("Unable to rename cache from %s to %s: %s",
-              tempfile, filename, strerror(errno));
+error:
+    close(fd);
+    return -1;
+}
 
-    free(tempfile);
-    free(pathbits);
+static void unlock_cache(const char *lockname, int fd)
+{
+    unlink(lockname);
+    close(fd);
 }
 
-struct dwarf_subprogram_t *subprograms_load(Dwarf_Debug dbg,
-                                            uint8_t uuid[UUID_LEN],
-                                            enum subprograms_type_t type,
-                                            struct subprograms_options_t *options)
+struct dwarf_subprograms_t *subprograms_load(Dwarf_Debug dbg,
+                                             uint8_t uuid[UUID_LEN],
+                                             enum subprograms_type_t type,
+                                             struct subprograms_options_t *options,
+                                             struct dwarf_linetab_t **linetab)
 {
-    struct dwarf_subprogram_t *subprograms = NULL;
+    struct dwarf_subprograms_t *subprograms = NULL;
+    char *dir = NULL;
     char *filename = NULL;
+    char *lockname = NULL;
+    int stale = 0;
+    int lock = -1;
 
-    if (options->persistent) {
-        filename = get_cache_filename(options, uuid);
+    if (linetab)
+        *linetab = NULL;
+
+    /* Without a directory for it the table is built as if there were no
+     * cache */
+    if (options->persistent && (dir = cachedir_path(options->cache_dir, 1))) {
+        filename = get_cache_filename(dir, uuid);
 
         if (access(filename, R_OK) == 0)
-            subprograms = load_subprograms(filename);
+            subprograms = load_subprograms(filename, uuid, type, options, linetab, &stale);
+
+        /* The cache has to be written: wait for anyone else doing that,
+         * then look again, since they may have saved what we need */
+        cachedir_record(subprograms && !stale && !(linetab && !*linetab));
+        if (!subprograms || stale || (linetab && !*linetab)) {
+            lockname = malloc(strlen(filename) + strlen(".lock") + 1);
+            if (!lockname)
+                fatal("unable to allocate memory");
+            sprintf(lockname, "%s.lock", filename);
+
+            lock = lock_cache(lockname, options->interrupted);
+            if (lock >= 0) {
+                if (linetab) {
+                    linetab_free(*linetab);
+                    *linetab = NULL;
+                }
+                subprograms_free(subprograms);
+                subprograms = NULL;
+                stale = 0;
+
+                if (access(filename, R_OK) == 0)
+                    subprograms = load_subprograms(filename, uuid, type, options, linetab,
+                                                   &stale);
+            }
+        }
     }
 
     if (!subprograms) {
@@ -630,18 +2263,37 @@ struct dwarf_subprogram_t *subprograms_load(Dwarf_Debug dbg,
                 subprograms = read_from_globals(dbg);
                 break;
             case SUBPROGRAMS_CUS:
-                subprograms = read_from_cus(dbg);
+                subprograms = read_from_cus(dbg, options);
                 break;
             default:
                 fatal("unknown cache type %d", type);
         }
+        stale = 1;
+    }
+
+    if (subprograms && linetab && !*linetab) {
+        struct dwarf_aranges_t *aranges = aranges_load(dbg);
+
+        *linetab = linetab_build(dbg, aranges, options->interrupted);
+        aranges_free(aranges);
+        if (!*linetab) {
+            subprograms_free(subprograms);
+            subprograms = NULL;
+        }
+        stale = 1;
+    }
 
-        if (options->persistent)
-            save_subprograms(filename, subprograms);
+    if (lock >= 0 && subprograms && stale) {
+        save_subprograms(filename, subprograms, linetab ? *linetab : NULL, uuid, type, options);
+        if (options->cache_limit)
+            cachedir_trim_async(dir, options->cache_limit);
     }
 
-    if (filename)
-        free(filename);
+    if (lock >= 0)
+        unlock_cache(lockname, lock);
+    free(lockname);
+    free(filename);
+    free(dir);
 
     return subprograms;
 }
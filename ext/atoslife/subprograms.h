@@ -14,13 +14,32 @@
 #include <stdint.h>
 
 #include <dwarf.h>
+#include <libdwarf.h>
 
 #include "common.h"
+#include "linetab.h"
 
 #define SUBPROGRAMS_CACHE_MAGIC   0xcaceecac
-#define SUBPROGRAMS_CACHE_VERSION 1
+#define SUBPROGRAMS_CACHE_VERSION 5
 #define SUBPROGRAMS_CACHE_PATH    ".atosl-cache"
 
+/* How long to wait for another process building the same cache, in
+ * seconds, before building without the cache */
+#define SUBPROGRAMS_CACHE_LOCK_TIMEOUT 600
+/* How often to check on it, in microseconds */
+#define SUBPROGRAMS_CACHE_LOCK_POLL    50000
+
+/* The CU walk uses at most this many threads unless told otherwise, and
+ * one per this many bytes of .debug_info */
+#define SUBPROGRAMS_MAX_THREADS        8
+#define SUBPROGRAMS_MIN_THREAD_SIZE    (1024 * 1024)
+/* Runs of CUs per thread, so that a thread done with its share early can
+ * take over more */
+#define SUBPROGRAMS_CHUNKS_PER_THREAD  4
+
+/* call_file of the entries that aren't inlined subroutines */
+#define SUBPROGRAMS_NOT_INLINED        UINT32_MAX
+
 #ifndef DW_LANG_Swift
 #define DW_LANG_Swift             0x1e
 #endif
@@ -33,12 +52,81 @@ enum subprograms_type_t {
 struct subprograms_options_t {
     int persistent:1;
     const char *cache_dir;
+    /* Once a new cache is saved, least recently used caches are removed
+     * from the directory until it is down to this many bytes; 0 for no
+     * limit. See cachedir.h. */
+    uint64_t cache_limit;
+    /* Architecture of the image, recorded in and checked against the
+     * cache */
+    int32_t cputype;
+    int32_t cpusubtype;
+    /* The object dbg was opened over. When set, the CU walk may be split
+     * between nthreads threads, each with a Dwarf_Debug of its own over
+     * object; 0 picks one per CPU, up to SUBPROGRAMS_MAX_THREADS. */
+    Dwarf_Obj_Access_Interface *object;
+    int nthreads;
+    /* Sorted addresses the table is built for, when they are known up
+     * front: CUs whose ranges hold none of them are left out. Ignored when
+     * persistent, since a cache has to hold every function. */
+    const Dwarf_Addr *addresses;
+    uint32_t naddresses;
+    /* When set, the CU walk stops as soon as *interrupted becomes non-zero
+     * and subprograms_load() returns NULL */
+    const volatile int *interrupted;
 };
 
-struct dwarf_subprogram_t *subprograms_load(Dwarf_Debug dbg,
-                                            uint8_t uuid[UUID_LEN],
-                                            enum subprograms_type_t type,
-                                            struct subprograms_options_t *options);
+/* The function table of the image, from the cache if options->persistent
+ * and there is a usable one. When linetab isn't NULL the line table of the
+ * image is wanted too, and stored in the cache alongside; it may point into
+ * the memory of the returned table, so free it first.
+ *
+ * A cache is built by one process at a time: the others wait for it and
+ * use what it saved, see lock_cache(). */
+struct dwarf_subprograms_t *subprograms_load(Dwarf_Debug dbg,
+                                             uint8_t uuid[UUID_LEN],
+                                             enum subprograms_type_t type,
+                                             struct subprograms_options_t *options,
+                                             struct dwarf_linetab_t **linetab);
+
+/* 1 if subprograms_load() would use the cache of uuid in options->cache_dir
+ * as it is, with a line table if lines is set, rather than build it */
+int subprograms_cached(uint8_t uuid[UUID_LEN], enum subprograms_type_t type,
+                       const struct subprograms_options_t *options, int lines);
+
+/* Index of the innermost function containing addr, which may be an
+ * inlined subroutine, or -1 */
+int32_t subprograms_lookup(const struct dwarf_subprograms_t *subprograms, Dwarf_Addr addr);
+
+/* The entry that the inlined subroutine at index was inlined into, or -1
+ * if index isn't one or nothing encloses it */
+int32_t subprograms_caller(const struct dwarf_subprograms_t *subprograms, int32_t index);
+
+/* The function whose code index is part of: index itself, or the closest
+ * enclosing entry that isn't an inlined subroutine (the outermost inlined
+ * one if none is) */
+int32_t subprograms_concrete(const struct dwarf_subprograms_t *subprograms, int32_t index);
+
+static inline const char *subprograms_name(const struct dwarf_subprograms_t *subprograms,
+                                           int32_t index)
+{
+    return subprograms->strings + subprograms->name[index];
+}
+
+static inline int subprograms_inlined(const struct dwarf_subprograms_t *subprograms,
+                                      int32_t index)
+{
+    return subprograms->call_file[index] != SUBPROGRAMS_NOT_INLINED;
+}
+
+/* Where the inlined subroutine at index was called from; an empty file
+ * name when the DWARF doesn't say */
+static inline const char *subprograms_call_file(const struct dwarf_subprograms_t *subprograms,
+                                                int32_t index)
+{
+    return subprograms->strings + subprograms->call_file[index];
+}
+
+void subprograms_free(struct dwarf_subprograms_t *subprograms);
 
 #endif /* SUBPROGRAMS_ */
 
@@ -0,0 +1,166 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "symtab.h"
+#include "common.h"
+
+struct symtab_entry_t {
+    Dwarf_Addr start;
+    Dwarf_Addr end;
+    uint32_t name;
+    uint32_t seq;
+};
+
+static int compare_symtab_entries(const void *a, const void *b)
+{
+    const struct symtab_entry_t *entry_a = a;
+    const struct symtab_entry_t *entry_b = b;
+
+    if (entry_a->start != entry_b->start)
+        return entry_a->start < entry_b->start ? -1 : 1;
+    if (entry_a->seq != entry_b->seq)
+        return entry_a->seq < entry_b->seq ? -1 : 1;
+    return 0;
+}
+
+/* Sort entries and split them into parallel arrays */
+static void split_entries(struct symtab_entry_t *entries, uint32_t count,
+                          Dwarf_Addr **start, Dwarf_Addr **end, uint32_t **name)
+{
+    uint32_t i;
+
+    qsort(entries, count, sizeof(*entries), compare_symtab_entries);
+
+    *start = malloc(sizeof(Dwarf_Addr) * (count + 1));
+    *name = malloc(sizeof(uint32_t) * (count + 1));
+    if (!*start || !*name)
+        fatal("unable to allocate memory");
+    if (end) {
+        *end = malloc(sizeof(Dwarf_Addr) * (count + 1));
+        if (!*end)
+            fatal("unable to allocate memory");
+    }
+
+    for (i = 0; i < count; i++) {
+        (*start)[i] = entries[i].start;
+        (*name)[i] = entries[i].name;
+        if (end)
+            (*end)[i] = entries[i].end;
+    }
+}
+
+struct symtab_index_t *symtab_index_build(const struct atosl_context_t *context)
+{
+    struct symtab_index_t *symtab;
+    struct symtab_entry_t *syms;
+    struct symtab_entry_t *funs;
+    uint32_t nsyms = 0;
+    uint32_t nfuns = 0;
+    int have_fun = 0;
+    uint32_t i;
+
+    symtab = malloc(sizeof(*symtab));
+    if (!symtab)
+        fatal("unable to allocate memory");
+    memset(symtab, 0, sizeof(*symtab));
+    symtab->strings = context->strtable;
+
+    syms = malloc(sizeof(*syms) * (context->nsymbols + 1));
+    funs = malloc(sizeof(*funs) * (context->nsymbols / 2 + 1));
+    if (!syms || !funs)
+        fatal("unable to allocate memory");
+
+    for (i = 0; i < context->nsymbols; i++) {
+        const struct symbol_t *symbol = &context->symlist[i];
+        uint32_t strx = symbol->name;
+        uint8_t type = symbol->type;
+        Dwarf_Addr value = symbol->addr;
+
+        /* See README.stabs: a function is described by a pair of N_FUN
+         * stabs, the first with its name and address, the second with its
+         * size. Anything in between breaks the pair. */
+        if (type == N_FUN) {
+            if (have_fun) {
+                funs[nfuns].end = funs[nfuns].start + value;
+                if (funs[nfuns].end > funs[nfuns].start)
+                    nfuns++;
+                have_fun = 0;
+            } else if (strx) {
+                funs[nfuns].start = value;
+                funs[nfuns].name = strx;
+                funs[nfuns].seq = i;
+                have_fun = 1;
+            }
+            continue;
+        }
+        have_fun = 0;
+
+        if (!(type & N_STAB) && (type & N_TYPE) == N_SECT && strx) {
+            syms[nsyms].start = value;
+            syms[nsyms].end = 0;
+            syms[nsyms].name = strx;
+            syms[nsyms].seq = i;
+            nsyms++;
+        }
+    }
+
+    symtab->count = nsyms;
+    split_entries(syms, nsyms, &symtab->addr, NULL, &symtab->name);
+    addr_index_build(&symtab->index, symtab->addr, symtab->count);
+
+    symtab->nfuns = nfuns;
+    split_entries(funs, nfuns, &symtab->fun_start, &symtab->fun_end, &symtab->fun_name);
+    addr_index_build(&symtab->fun_index, symtab->fun_start, symtab->nfuns);
+
+    free(syms);
+    free(funs);
+
+    return symtab;
+}
+
+int32_t symtab_index_lookup_fun(const struct symtab_index_t *symtab, Dwarf_Addr addr)
+{
+    int32_t i = (int32_t)addr_index_rank(&symtab->fun_index, addr) - 1;
+
+    if (i < 0 || addr >= symtab->fun_end[i])
+        return -1;
+    return i;
+}
+
+int32_t symtab_index_lookup(const struct symtab_index_t *symtab, Dwarf_Addr addr)
+{
+    uint32_t rank = addr_index_rank(&symtab->index, addr);
+
+    if (rank == 0 || rank == symtab->count)
+        return -1;
+    return (int32_t)rank - 1;
+}
+
+void symtab_index_free(struct symtab_index_t *symtab)
+{
+    if (!symtab)
+        return;
+
+    addr_index_free(&symtab->index);
+    free(symtab->addr);
+    free(symtab->name);
+    addr_index_free(&symtab->fun_index);
+    free(symtab->fun_start);
+    free(symtab->fun_end);
+    free(symtab->fun_name);
+    free(symtab);
+}
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -0,0 +1,35 @@
+/*
+ *  Copyright (c) 2013, Facebook, Inc.
+ *  All rights reserved.
+ *
+ *  This source code is licensed under the BSD-style license found in the
+ *  LICENSE file in the root directory of this source tree. An additional grant
+ *  of patent rights can be found in the PATENTS file in the same directory.
+ *
+ */
+
+#ifndef SYMTAB_
+#define SYMTAB_
+
+#include <stdint.h>
+
+#include <libdwarf.h>
+
+#include "atosl.h"
+#include "common.h"
+
+/* Build the index from the symbols parsed out of LC_SYMTAB */
+struct symtab_index_t *symtab_index_build(const struct atosl_context_t *context);
+
+/* Index of the N_FUN function containing addr, or -1 */
+int32_t symtab_index_lookup_fun(const struct symtab_index_t *symtab, Dwarf_Addr addr);
+
+/* Index of the last symbol at or before addr, or -1. Addresses past the
+ * last symbol have no known extent and aren't matched either. */
+int32_t symtab_index_lookup(const struct symtab_index_t *symtab, Dwarf_Addr addr);
+
+void symtab_index_free(struct symtab_index_t *symtab);
+
+#endif /* SYMTAB_ */
+
+/* vim:set ts=4 sw=4 sts=4 expandtab: */
@@ -1,8 +1,388 @@
 require 'test/unit'
-require 'atosl'
+require 'atoslife'
+require 'tmpdir'
 
 class HolaTest < Test::Unit::TestCase
+  SAMPLE_PATH = File.expand_path('../../samples/CrashDummy-iPhoneX', __FILE__)
+
   def test_executable
     assert_equal "1", "1"
   end
+
+  def test_image_serves_repeated_lookups
+    image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64")
+    2.times do
+      result = image.symbolicate(["0x100a38f0c"], load_address: "0x100a34000")
+      assert_equal ["-[ObjcWrapper assertionFailure] (in CrashDummy-iPhoneX) (ObjcWrapper.m:28)\n"], result
+    end
+    image.close
+    assert image.closed?
+    assert_raise(IOError) { image.symbolicate(["0x100a38f0c"]) }
+  end
+
+  def test_bad_arguments_raise_instead_of_exiting
+    assert_raise(ArgumentError) { Atoslife::Image.new(SAMPLE_PATH, arch: "pdp11") }
+    assert_raise(ArgumentError) { Atoslife::Image.new(SAMPLE_PATH + ".missing", arch: "arm64") }
+    assert_raise(RuntimeError) { Atoslife::Image.new(__FILE__, arch: "arm64") }
+    assert_raise(ArgumentError) do
+      Atoslife.symbolicate_batch("arm64", SAMPLE_PATH, "0x100a34000", ["0x1" + "0" * 20])
+    end
+  end
+
+  def test_truncated_file_raises_instead_of_exiting
+    Dir.mktmpdir do |dir|
+      truncated = File.join(dir, File.basename(SAMPLE_PATH))
+      # Cut in the symbol table, then in the DWARF sections
+      [2000, 400000].each do |size|
+        File.binwrite(truncated, File.binread(SAMPLE_PATH, size))
+        assert_raise(RuntimeError) { Atoslife::Image.new(truncated, arch: "arm64") }
+      end
+    end
+  end
+
+  def test_batch_returns_one_result_per_address_in_input_order
+    addresses = ["0x100a39000", "0x100a35000", "0x100a38f0c"]
+    results = Atoslife.symbolicate_batch("arm64", SAMPLE_PATH, "0x100a34000", addresses)
+    assert_equal [
+      "-[ObjcWrapper assertionFailure] (in CrashDummy-iPhoneX) (ObjcWrapper.m:30)\n",
+      "0x100a35000\n",
+      "-[ObjcWrapper assertionFailure] (in CrashDummy-iPhoneX) (ObjcWrapper.m:28)\n",
+    ], results
+  end
+
+  def test_batch_gives_the_same_results_as_an_image
+    image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64")
+    (0x100a34000...0x100a40000).step(64).each_slice(37) do |slice|
+      addresses = slice.map { |address| "0x%x" % address }
+      assert_equal image.symbolicate(addresses, load_address: "0x100a34000"),
+                   Atoslife.symbolicate_batch("arm64", SAMPLE_PATH, "0x100a34000", addresses)
+    end
+    image.close
+  end
+
+  def test_inlines_give_the_inline_stack
+    image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64")
+    assert_equal ["+[ObjcWrapper sharedWrapper] (in CrashDummy-iPhoneX) (once.h:84)\n"],
+                 image.symbolicate(["0x100a38e10"], load_address: "0x100a34000")
+    assert_equal ["_dispatch_once (in CrashDummy-iPhoneX) (once.h:84)\n" \
+                  "+[ObjcWrapper sharedWrapper] (in CrashDummy-iPhoneX) (ObjcWrapper.m:17)\n"],
+                 image.symbolicate(["0x100a38e10"], load_address: "0x100a34000", inlines: true)
+    image.close
+  end
+
+  def test_functions_nested_in_types_are_found
+    # viewDidLoad and the crashMethods accessors sit in the ViewController
+    # structure of the CrashDummy module
+    addresses = ["0x100a3a154", "0x100a3a058"]
+    image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64")
+    assert_equal ["viewDidLoad () (in CrashDummy-iPhoneX) (ViewController.swift:15)\n",
+                  "crashMethods.set (value) (in CrashDummy-iPhoneX) (ViewController.swift:13)\n"],
+                 image.symbolicate(addresses, load_address: "0x100a34000")
+    image.close
+  end
+
+  def test_image_is_shared_between_threads
+    image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64")
+    threads = 4.times.map do
+      Thread.new do
+        20.times.map { image.symbolicate(["0x100a38f0c"], load_address: "0x100a34000") }
+      end
+    end
+    threads.each do |thread|
+      thread.value.each do |result|
+        assert_equal ["-[ObjcWrapper assertionFailure] (in CrashDummy-iPhoneX) (ObjcWrapper.m:28)\n"], result
+      end
+    end
+    image.close
+  end
+
+  def test_threads_give_the_same_results
+    image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64")
+    addresses = (0x100a34000...0x100a40000).step(4).map { |address| "0x%x" % address }.shuffle(random: Random.new(1))
+    expected = image.symbolicate(addresses, load_address: "0x100a34000")
+    assert_equal expected, image.symbolicate(addresses, load_address: "0x100a34000", threads: 4)
+    image.close
+  end
+
+  def test_index_threads_give_the_same_results
+    addresses = (0x100a34000...0x100a40000).step(4).map { |address| "0x%x" % address }
+    results = [1, 4].map do |threads|
+      image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", index_threads: threads)
+      result = image.symbolicate(addresses, load_address: "0x100a34000")
+      image.close
+      result
+    end
+    assert_equal results[0], results[1]
+  end
+
+  def test_cache_dir_gives_the_same_results
+    addresses = (0x100a34000...0x100a40000).step(64).map { |address| "0x%x" % address }
+    image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64")
+    expected = image.symbolicate(addresses, load_address: "0x100a34000")
+    image.close
+
+    Dir.mktmpdir do |dir|
+      2.times do
+        image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: dir)
+        assert_equal expected, image.symbolicate(addresses, load_address: "0x100a34000")
+        image.close
+      end
+      assert_equal 1, Dir.children(dir).size
+    end
+  end
+
+  def test_cache_dir_that_cannot_be_created_is_done_without
+    Dir.mktmpdir do |dir|
+      image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: File.join(dir, "missing", "cache"))
+      assert_equal ["-[ObjcWrapper assertionFailure] (in CrashDummy-iPhoneX) (ObjcWrapper.m:28)\n"],
+                   image.symbolicate(["0x100a38f0c"], load_address: "0x100a34000")
+      image.close
+      assert_empty Dir.children(dir)
+    end
+  end
+
+  def test_cache_that_cannot_be_written_is_done_without
+    Dir.mktmpdir do |dir|
+      # A file size limit fails the write as a full disk would
+      pid = fork do
+        Signal.trap("XFSZ", "IGNORE")
+        Process.setrlimit(:FSIZE, 4096)
+        image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: dir)
+        result = image.symbolicate(["0x100a38f0c"], load_address: "0x100a34000")
+        image.close
+        exit!(result == ["-[ObjcWrapper assertionFailure] (in CrashDummy-iPhoneX) (ObjcWrapper.m:28)\n"])
+      end
+      Process.wait(pid)
+      assert $?.success?
+      assert_empty Dir.children(dir)
+    end
+  end
+
+  def test_functions_with_the_same_name_survive_the_cache
+    # Two crashMethods.materialize, and viewDidLoad with its @objc thunk
+    addresses = ["0x100a3a0f4", "0x100a3a10c", "0x100a3a154", "0x100a3a7d8"]
+    expected = ["crashMethods.materialize () (in CrashDummy-iPhoneX) (<compiler-generated>:0)\n",
+                "crashMethods.materialize () (in CrashDummy-iPhoneX) (<compiler-generated>:0)\n",
+                "viewDidLoad () (in CrashDummy-iPhoneX) (ViewController.swift:15)\n",
+                "viewDidLoad () (in CrashDummy-iPhoneX) (<compiler-generated>:0)\n"]
+
+    Dir.mktmpdir do |dir|
+      2.times do
+        image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: dir)
+        assert_equal expected, image.symbolicate(addresses, load_address: "0x100a34000")
+        image.close
+      end
+
+      # Each name is stored once for both functions
+      cache = File.binread(Dir[File.join(dir, "*")].first)
+      assert_equal 1, cache.scan("crashMethods.materialize ()").size
+      assert_equal 1, cache.scan("viewDidLoad ()").size
+    end
+  end
+
+  def test_corrupt_cache_block_is_rebuilt
+    Dir.mktmpdir do |dir|
+      Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: dir).close
+      cache = Dir[File.join(dir, "*")].first
+      original = File.binread(cache)
+
+      data = original.dup
+      offset = data.index("-[ObjcWrapper assertionFailure]") + 3
+      data.setbyte(offset, data.getbyte(offset) ^ 0x20)
+      File.binwrite(cache, data)
+
+      # The bad block is caught, its file removed and the cache written again
+      image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: dir)
+      assert_equal ["-[ObjcWrapper assertionFailure] (in CrashDummy-iPhoneX) (ObjcWrapper.m:28)\n"],
+                   image.symbolicate(["0x100a38f0c"], load_address: "0x100a34000")
+      image.close
+      assert_equal original, File.binread(cache)
+    end
+  end
+
+  def test_warm_cache_needs_no_dwarf
+    addresses = (0x100a34000...0x100a40000).step(64).map { |address| "0x%x" % address }
+    image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64")
+    expected = image.symbolicate(addresses, load_address: "0x100a34000")
+    image.close
+
+    Dir.mktmpdir do |dir|
+      Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: dir).close
+
+      image = Atoslife::Image.new(write_without_dwarf(dir), arch: "arm64", cache_dir: dir)
+      assert_equal expected, image.symbolicate(addresses, load_address: "0x100a34000")
+      image.close
+    end
+  end
+
+  def test_corrupt_line_programs_cost_only_the_lines
+    Dir.mktmpdir do |dir|
+      image = Atoslife::Image.new(write_with_corrupt_line_programs(dir), arch: "arm64")
+      assert_equal ["-[ObjcWrapper assertionFailure] (in CrashDummy-iPhoneX) + 0\n"],
+                   image.symbolicate(["0x100a38f0c"], load_address: "0x100a34000")
+      image.close
+    end
+  end
+
+  def test_dwarf_errors_raise_instead_of_exiting
+    Dir.mktmpdir do |dir|
+      stripped = write_without_dwarf(dir)
+      [1, 4].each do |threads|
+        assert_raise(RuntimeError) do
+          Atoslife::Image.new(stripped, arch: "arm64", index_threads: threads, cache_dir: dir)
+        end
+      end
+      assert_equal 0, Atoslife.cache_stats(dir)[:entries]
+      assert_equal [:failed], Atoslife.prewarm(stripped, cache_dir: dir).map { |result| result[:status] }
+    end
+  end
+
+  def test_trim_cache_removes_least_recently_used
+    Dir.mktmpdir do |dir|
+      old = File.join(dir, "0" * 32)
+      File.binwrite(old, "x" * 4096)
+      File.utime(Time.now - 60, Time.now - 60, old)
+      Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: dir).close
+
+      stats = Atoslife.cache_stats(dir)
+      assert_equal 2, stats[:entries]
+      assert_operator stats[:bytes], :>, 4096
+
+      assert_equal 1, Atoslife.trim_cache(dir, stats[:bytes] - 1)
+      refute File.exist?(old)
+      assert_equal 1, Atoslife.cache_stats(dir)[:entries]
+    end
+  end
+
+  def test_trim_cache_counts_and_clears_left_over_temp_files
+    Dir.mktmpdir do |dir|
+      missing = File.join(dir, "missing")
+      assert_equal 0, Atoslife.cache_stats(missing)[:entries]
+      refute File.exist?(missing)
+
+      stale = File.join(dir, ".#{"1" * 32}.abcdef")
+      live = File.join(dir, ".#{"2" * 32}.ghijkl")
+      File.binwrite(stale, "x" * 4096)
+      File.binwrite(live, "x" * 4096)
+      File.utime(Time.now - 3600, Time.now - 3600, stale)
+
+      stats = Atoslife.cache_stats(dir)
+      assert_equal 0, stats[:entries]
+      assert_equal 8192, stats[:bytes]
+
+      assert_equal 0, Atoslife.trim_cache(dir, 0)
+      refute File.exist?(stale)
+      assert File.exist?(live)
+    end
+  end
+
+  def test_cache_build_waits_for_the_lock_holder
+    Dir.mktmpdir do |dir|
+      Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: dir).close
+      cache = File.join(dir, Dir.children(dir).first)
+      File.unlink(cache)
+
+      lock = File.open("#{cache}.lock", File::RDWR | File::CREAT)
+      lock.flock(File::LOCK_EX)
+      opener = Thread.new { Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", cache_dir: dir).close }
+      sleep 0.3
+      assert opener.alive?
+      refute File.exist?(cache)
+
+      lock.close
+      opener.join
+      assert File.exist?(cache)
+      refute File.exist?("#{cache}.lock")
+    end
+  end
+
+  def test_shared_images_are_opened_once
+    addresses = (0x100a34000...0x100a40000).step(64).map { |address| "0x%x" % address }
+    image = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64")
+    expected = image.symbolicate(addresses, load_address: "0x100a34000")
+    image.close
+
+    first = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", shared: true)
+    hits = Atoslife.registry_stats[:hits]
+    second = Atoslife::Image.new(SAMPLE_PATH, arch: "arm64", shared: true)
+    assert_equal hits + 1, Atoslife.registry_stats[:hits]
+    assert_equal expected, second.symbolicate(addresses, load_address: "0x100a34000")
+    first.close
+    assert_equal expected, second.symbolicate(addresses, load_address: "0x100a34000", threads: 2)
+    second.close
+    assert_operator Atoslife.registry_stats[:entries], :>=, 1
+  end
+
+  def test_prewarm_builds_each_cache_once
+    Dir.mktmpdir do |dir|
+      results = Atoslife.prewarm([File.dirname(SAMPLE_PATH)], cache_dir: dir, threads: 2)
+      assert_equal 1, results.size
+      assert_equal :built, results[0][:status]
+      assert_equal "arm64", results[0][:arch]
+      assert File.exist?(File.join(dir, results[0][:uuid]))
+
+      assert_equal [:cached], Atoslife.prewarm(SAMPLE_PATH, cache_dir: dir).map { |result| result[:status] }
+    end
+  end
+
+  def test_prewarm_reports_slices_it_could_not_cache
+    Dir.mktmpdir do |dir|
+      File.binwrite(File.join(dir, "file"), "")
+      results = Atoslife.prewarm(SAMPLE_PATH, cache_dir: File.join(dir, "file", "cache"))
+      assert_equal [:failed], results.map { |result| result[:status] }
+
+      truncated = File.join(dir, File.basename(SAMPLE_PATH))
+      File.binwrite(truncated, File.binread(SAMPLE_PATH, 400000))
+      results = Atoslife.prewarm(truncated, cache_dir: File.join(dir, "cache"))
+      assert_equal [:failed], results.map { |result| result[:status] }
+    end
+  end
+
+  private
+
+  # A copy of the sample under dir, with the same UUID and basename, and
+  # its data changed by the block given the offset of the __DWARF segment
+  # command
+  def write_patched_dwarf(dir)
+    data = File.binread(SAMPLE_PATH)
+    offset = 32
+    data.unpack1("@16L<").times do
+      cmd, cmdsize = data.unpack("@#{offset}L<2")
+      yield data, offset if cmd == 0x19 && data[offset + 8, 16].delete("\0") == "__DWARF"
+      offset += cmdsize
+    end
+    Dir.mkdir(File.join(dir, "patched"))
+    patched = File.join(dir, "patched", File.basename(SAMPLE_PATH))
+    File.binwrite(patched, data)
+    patched
+  end
+
+  # Every byte of the __DWARF segment zeroed
+  def write_without_dwarf(dir)
+    write_patched_dwarf(dir) do |data, segment|
+      fileoff, filesize = data.unpack("@#{segment + 40}Q<2")
+      data[fileoff, filesize] = "\0" * filesize
+    end
+  end
+
+  # Each line program keeps its header, which the CU walk reads, but its
+  # opcodes are extended ones that run past its end
+  def write_with_corrupt_line_programs(dir)
+    write_patched_dwarf(dir) do |data, segment|
+      data.unpack1("@#{segment + 64}L<").times do |i|
+        section = segment + 72 + i * 80
+        next unless data[section, 16].delete("\0") == "__debug_line"
+
+        size = data.unpack1("@#{section + 40}Q<")
+        pos = start = data.unpack1("@#{section + 48}L<")
+        while pos < start + size
+          unit_length, _version, header_length = data.unpack("@#{pos}L<S<L<")
+          program = pos + 10 + header_length
+          stop = pos + 4 + unit_length
+          data[program, stop - program] = ("\0\xff\xff\xff\x0f".b * (stop - program))[0, stop - program]
+          pos = stop
+        end
+      end
+    end
+  end
 end